@@ -0,0 +1,501 @@
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "player.h"
+#if !CONFIG_IDF_TARGET_LINUX
+#include "library.h"
+#include "sdcard.h"
+#endif
+#include <errno.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+static const char *TAG = "BENCH";
+
+// Every result is one line starting with this and a JSON object, so they
+// can be grepped out of the log and compared between runs
+#define RESULT_PREFIX "BENCH "
+
+#define DATA_FILE "data.bin"
+#define SONG_FILE "song.wav"
+#define SCAN_DIR "scan"
+#define WRITE_BLOCK 4096
+
+static const size_t read_blocks[] = {512, 1024, 2048, 4096, 8192, 16384,
+                                     32768};
+#define READ_BLOCKS (sizeof(read_blocks) / sizeof(read_blocks[0]))
+
+static char path_buf[300];
+
+/**
+ * @brief Helper to build a path inside the benchmark directory
+ */
+static const char *bench_path(const char *name) {
+  snprintf(path_buf, sizeof(path_buf), "%s/%s", CONFIG_BENCH_DIR, name);
+  return path_buf;
+}
+
+/**
+ * @brief Helper to print one result, `fmt` gives the fields after the name
+ */
+static void result(const char *name, const char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  printf(RESULT_PREFIX "{\"bench\":\"%s\",", name);
+  vprintf(fmt, args);
+  printf("}\n");
+  va_end(args);
+}
+
+static uint32_t kb_per_s(uint64_t bytes, int64_t us) {
+  return us > 0 ? (uint32_t)(bytes * 1000000 / 1024 / us) : 0;
+}
+
+static long long permille(int64_t part, int64_t total) {
+  return total > 0 ? (long long)(part * 1000 / total) : 0;
+}
+
+/**
+ * @brief Helper to write `kb` KB of a byte ramp after an optional header,
+ * timing it
+ */
+static esp_err_t write_file(const char *path, const void *header,
+                            size_t header_len, uint32_t kb) {
+  uint8_t *block = malloc(WRITE_BLOCK);
+  if (block == NULL) {
+    return ESP_ERR_NO_MEM;
+  }
+  FILE *f = fopen(path, "wb");
+  if (f == NULL) {
+    ESP_LOGE(TAG, "Can't create %s: %s", path, strerror(errno));
+    free(block);
+    return ESP_FAIL;
+  }
+
+  int64_t start = esp_timer_get_time();
+  esp_err_t ret = ESP_OK;
+  if (header_len > 0 && fwrite(header, 1, header_len, f) != header_len) {
+    ret = ESP_FAIL;
+  }
+  uint64_t bytes = (uint64_t)kb * 1024;
+  for (uint64_t done = 0; ret == ESP_OK && done < bytes; done += WRITE_BLOCK) {
+    for (size_t i = 0; i < WRITE_BLOCK; i++) {
+      block[i] = (uint8_t)(done + i);
+    }
+    if (fwrite(block, 1, WRITE_BLOCK, f) != WRITE_BLOCK) {
+      ret = ESP_FAIL;
+    }
+  }
+  if (fclose(f) != 0) {
+    ret = ESP_FAIL;
+  }
+  int64_t elapsed = esp_timer_get_time() - start;
+  free(block);
+
+  if (ret != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to write %s", path);
+    return ret;
+  }
+  result("seq_write",
+         "\"file\":\"%s\",\"kb\":%" PRIu32 ",\"us\":%lld,\"kb_s\":%" PRIu32,
+         path, kb, (long long)elapsed, kb_per_s(bytes, elapsed));
+  return ESP_OK;
+}
+
+typedef struct {
+  uint64_t bytes;
+  uint32_t reads;
+  int64_t us;
+  int64_t max_us;
+} read_run_t;
+
+/**
+ * @brief Helper to read a whole file `block` bytes at a time, timing it
+ */
+static esp_err_t read_file(const char *path, uint8_t *buf, size_t block,
+                           read_run_t *run) {
+  FILE *f = fopen(path, "rb");
+  if (f == NULL) {
+    ESP_LOGE(TAG, "Can't open %s", path);
+    return ESP_FAIL;
+  }
+  // Straight to the driver, like the read-ahead does
+  setvbuf(f, NULL, _IONBF, 0);
+
+  memset(run, 0, sizeof(*run));
+  int64_t start = esp_timer_get_time();
+  while (1) {
+    int64_t read_start = esp_timer_get_time();
+    size_t got = fread(buf, 1, block, f);
+    int64_t read_us = esp_timer_get_time() - read_start;
+    if (got == 0) {
+      break;
+    }
+    run->bytes += got;
+    run->reads++;
+    if (read_us > run->max_us) {
+      run->max_us = read_us;
+    }
+  }
+  run->us = esp_timer_get_time() - start;
+  fclose(f);
+  return ESP_OK;
+}
+
+/**
+ * @brief Sequential reads of the whole data file with every block size,
+ * in the same DMA capable memory the read-ahead uses
+ */
+static void bench_seq_read(void) {
+  const char *path = bench_path(DATA_FILE);
+  size_t max_block = read_blocks[READ_BLOCKS - 1];
+  uint8_t *buf = heap_caps_malloc(max_block, MALLOC_CAP_DMA);
+  if (buf == NULL) {
+    ESP_LOGE(TAG, "No memory for a %u byte read", (unsigned)max_block);
+    return;
+  }
+
+  for (size_t b = 0; b < READ_BLOCKS; b++) {
+    size_t block = read_blocks[b];
+    read_run_t run;
+    if (read_file(path, buf, block, &run) != ESP_OK) {
+      break;
+    }
+    result("seq_read",
+           "\"block\":%u,\"reads\":%" PRIu32 ",\"us\":%lld,\"kb_s\":%" PRIu32
+           ",\"max_read_us\":%lld",
+           (unsigned)block, run.reads, (long long)run.us,
+           kb_per_s(run.bytes, run.us), (long long)run.max_us);
+  }
+
+  heap_caps_free(buf);
+}
+
+#if CONFIG_BENCH_CARD_BUSES
+#define CARD_BUS_BLOCK 32768
+
+// Modes compared, the SD bus ones wider than the configured width are
+// skipped as the lines may not be wired
+static const sdcard_bus_t card_buses[] = {
+#if !CONFIG_MPLAYER_SDCARD_SDMMC || CONFIG_BENCH_CARD_SPI
+    {SDCARD_BACKEND_SDSPI, 1, 10000},
+    {SDCARD_BACKEND_SDSPI, 1, 20000},
+#endif
+#if CONFIG_MPLAYER_SDCARD_SDMMC
+    {SDCARD_BACKEND_SDMMC, 1, 20000},
+    {SDCARD_BACKEND_SDMMC, 1, 40000},
+    {SDCARD_BACKEND_SDMMC, 4, 20000},
+    {SDCARD_BACKEND_SDMMC, 4, 40000},
+#endif
+};
+#define CARD_BUSES (sizeof(card_buses) / sizeof(card_buses[0]))
+
+/**
+ * @brief Helper to unmount the card if it is mounted
+ */
+static esp_err_t card_unmount(void) {
+  sdcard_bus_t bus;
+  return sdcard_get_bus(&bus) == ESP_OK ? sdcard_detach() : ESP_OK;
+}
+
+/**
+ * @brief Remount the card in every mode and read the data file in big
+ * blocks, then go back to the configured mode. The bus_kb_s is what the
+ * clock and lines could move at best, kb_s against it is how much goes
+ * into the protocol and FatFs
+ */
+static esp_err_t bench_card_buses(void) {
+  const char *path = bench_path(DATA_FILE);
+  uint8_t *buf = heap_caps_malloc(CARD_BUS_BLOCK, MALLOC_CAP_DMA);
+  if (buf == NULL) {
+    ESP_LOGE(TAG, "No memory for a %u byte read", CARD_BUS_BLOCK);
+    return ESP_ERR_NO_MEM;
+  }
+
+  for (size_t i = 0; i < CARD_BUSES; i++) {
+    const sdcard_bus_t *bus = &card_buses[i];
+    if (bus->backend == SDCARD_BACKEND_SDMMC &&
+        bus->width > CONFIG_MPLAYER_SDCARD_BUS_WIDTH) {
+      continue;
+    }
+    esp_err_t ret = card_unmount();
+    if (ret != ESP_OK) {
+      break;
+    }
+
+    sdcard_bus_t used = *bus;
+    read_run_t run = {0};
+    ret = sdcard_init_bus(bus);
+    if (ret == ESP_OK) {
+      sdcard_get_bus(&used);
+      ret = read_file(path, buf, CARD_BUS_BLOCK, &run);
+    }
+    uint64_t bus_bytes = (uint64_t)used.freq_khz * 1000 * used.width / 8;
+    result("card_bus",
+           "\"backend\":\"%s\",\"width\":%u,\"khz\":%" PRIu32
+           ",\"bus_kb_s\":%" PRIu32 ",\"kb_s\":%" PRIu32
+           ",\"max_read_us\":%lld,\"err\":\"%s\"",
+           sdcard_backend_name(used.backend), used.width, used.freq_khz,
+           kb_per_s(bus_bytes, 1000000), kb_per_s(run.bytes, run.us),
+           (long long)run.max_us, esp_err_to_name(ret));
+  }
+  heap_caps_free(buf);
+
+  esp_err_t ret = card_unmount();
+  if (ret == ESP_OK) {
+    ret = sdcard_init();
+  }
+  if (ret != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to mount the SD card back");
+  }
+  return ret;
+}
+#endif
+
+/**
+ * @brief Time opening and closing the data file over and over
+ */
+static void bench_fopen(void) {
+  const char *path = bench_path(DATA_FILE);
+  int64_t total = 0;
+  int64_t max_us = 0;
+
+  for (int i = 0; i < CONFIG_BENCH_OPEN_COUNT; i++) {
+    int64_t start = esp_timer_get_time();
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+      ESP_LOGE(TAG, "Can't open %s", path);
+      return;
+    }
+    fclose(f);
+    int64_t elapsed = esp_timer_get_time() - start;
+    total += elapsed;
+    if (elapsed > max_us) {
+      max_us = elapsed;
+    }
+  }
+
+  result("fopen",
+         "\"count\":%d,\"avg_us\":%lld,\"max_us\":%lld",
+         CONFIG_BENCH_OPEN_COUNT, (long long)(total / CONFIG_BENCH_OPEN_COUNT),
+         (long long)max_us);
+}
+
+#if !CONFIG_IDF_TARGET_LINUX
+/**
+ * @brief Fill a directory with empty songs and time the library on it the
+ * way the player uses it: the first walk writing the index, a walk finding
+ * it unchanged and opening it
+ */
+static void bench_dir_scan(void) {
+  static library_t lib; // Too big for the stack with its window
+  char dir[300];
+  char file[320];
+  snprintf(dir, sizeof(dir), "%s/%s", CONFIG_BENCH_DIR, SCAN_DIR);
+  mkdir(dir, 0755);
+
+  int64_t start = esp_timer_get_time();
+  for (int i = 0; i < CONFIG_BENCH_DIR_FILES; i++) {
+    snprintf(file, sizeof(file), "%s/f%04d.wav", dir, i);
+    FILE *f = fopen(file, "wb");
+    if (f == NULL) {
+      ESP_LOGE(TAG, "Can't create %s", file);
+      return;
+    }
+    fclose(f);
+  }
+  int64_t create_us = esp_timer_get_time() - start;
+
+  // From scratch, as on a new card
+  snprintf(file, sizeof(file), "%s/%s", dir, LIBRARY_INDEX_NAME);
+  remove(file);
+  snprintf(file, sizeof(file), "%s/%s", dir, LIBRARY_NAMES_NAME);
+  remove(file);
+
+  bool changed;
+  start = esp_timer_get_time();
+  esp_err_t ret = library_refresh(dir, false, &changed);
+  if (ret == ESP_OK) {
+    ret = library_commit(dir, &lib);
+  }
+  int64_t build_us = esp_timer_get_time() - start;
+  if (ret != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to index %s: %s", dir, esp_err_to_name(ret));
+    return;
+  }
+  uint32_t count = library_count(&lib);
+  library_close(&lib);
+
+  start = esp_timer_get_time();
+  ret = library_refresh(dir, false, &changed);
+  int64_t check_us = esp_timer_get_time() - start;
+
+  start = esp_timer_get_time();
+  if (ret == ESP_OK) {
+    ret = library_open(dir, &lib);
+  }
+  int64_t open_us = esp_timer_get_time() - start;
+  if (ret != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to reopen %s: %s", dir, esp_err_to_name(ret));
+    return;
+  }
+  library_close(&lib);
+
+  result("dir_scan",
+         "\"files\":%" PRIu32 ",\"build_us\":%lld,\"per_file_ns\":%lld,"
+         "\"check_us\":%lld,\"changed\":%d,\"open_us\":%lld,"
+         "\"create_us\":%lld",
+         count, (long long)build_us,
+         (long long)(count ? build_us * 1000 / (int64_t)count : 0),
+         (long long)check_us, changed, (long long)open_us,
+         (long long)create_us);
+}
+#endif
+
+/**
+ * @brief Write a 16 bit mono WAV lasting a bit more than the playback
+ */
+static esp_err_t write_song(void) {
+  uint32_t rate = CONFIG_BENCH_WAV_RATE;
+  uint32_t kb = (rate * 2 * (CONFIG_BENCH_PLAY_SECONDS + 2) + 1023) / 1024;
+  uint32_t data_len = kb * 1024;
+  uint8_t header[44];
+
+  memcpy(header, "RIFF", 4);
+  uint32_t riff_len = 36 + data_len;
+  memcpy(header + 4, &riff_len, 4);
+  memcpy(header + 8, "WAVEfmt ", 8);
+  uint32_t fmt_len = 16;
+  uint16_t format = 1, channels = 1, align = 2, bits = 16;
+  uint32_t byte_rate = rate * 2;
+  memcpy(header + 16, &fmt_len, 4);
+  memcpy(header + 20, &format, 2);
+  memcpy(header + 22, &channels, 2);
+  memcpy(header + 24, &rate, 4);
+  memcpy(header + 28, &byte_rate, 4);
+  memcpy(header + 32, &align, 2);
+  memcpy(header + 34, &bits, 2);
+  memcpy(header + 36, "data", 4);
+  memcpy(header + 40, &data_len, 4);
+
+  return write_file(bench_path(SONG_FILE), header, sizeof(header), kb);
+}
+
+/**
+ * @brief Play the song and read what the audio path cost from the player
+ * statistics: time and cycles spent in the output pull (the DMA ISR on the
+ * ESP32), how much of the playing time the producer task was busy, the load
+ * of every stage of the pipeline and how long the card was kept busy. The
+ * player statistics are reset first so they only cover this run, the
+ * read-ahead and power ones are taken by difference
+ */
+static void bench_playback(void) {
+  if (write_song() != ESP_OK) {
+    return;
+  }
+
+  mplayer_stats_t before;
+  mplayer_power_t power_before;
+  mplayer_reset_stats();
+  mplayer_get_stats(&before);
+  mplayer_get_power(&power_before);
+
+  if (mplayer_play(bench_path(SONG_FILE)) != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to play the song");
+    return;
+  }
+  vTaskDelay(pdMS_TO_TICKS(CONFIG_BENCH_PLAY_SECONDS * 1000));
+
+  mplayer_stats_t st;
+  mplayer_power_t power;
+  mplayer_get_stats(&st);
+  mplayer_get_power(&power);
+  mplayer_stop();
+
+  int64_t decoding = power.time_us[MPLAYER_POWER_DECODING] -
+                     power_before.time_us[MPLAYER_POWER_DECODING];
+  int64_t waiting = power.time_us[MPLAYER_POWER_WAITING] -
+                    power_before.time_us[MPLAYER_POWER_WAITING];
+  int64_t playing = decoding + waiting;
+
+  result("isr",
+         "\"blocks\":%" PRIu32 ",\"pull_avg_us\":%" PRIu32
+         ",\"pull_max_us\":%" PRIu32 ",\"pull_avg_cycles\":%" PRIu32
+         ",\"pull_max_cycles\":%" PRIu32,
+         st.blocks, st.pull_avg_us, st.pull_max_us, st.pull_avg_cycles,
+         st.pull_max_cycles);
+  result("producer",
+         "\"rate\":%d,\"playing_us\":%lld,\"busy_us\":%lld,"
+         "\"busy_permille\":%lld,\"underruns\":%" PRIu32
+         ",\"fill_min\":%" PRIu32 ",\"stack_free\":%" PRIu32,
+         CONFIG_BENCH_WAV_RATE, (long long)playing, (long long)decoding,
+         (long long)(playing > 0 ? decoding * 1000 / playing : 0),
+         st.underruns, st.fill_min, st.player_stack_free);
+  int64_t elapsed = st.elapsed_us;
+  result("pipeline",
+         "\"reader_permille\":%lld,\"decoder_permille\":%lld,"
+         "\"output_permille\":%lld,\"cmd_max_us\":%" PRIu32
+         ",\"fill_avg\":%" PRIu32,
+         permille(st.reader.read_time_us - before.reader.read_time_us,
+                  elapsed),
+         permille(st.decode_time_us, elapsed),
+         permille(st.pull_time_us, elapsed),
+         st.cmd_latency_max_us, st.fill_avg);
+  result("card_reads",
+         "\"reads\":%" PRIu32 ",\"max_read_us\":%" PRIu32
+         ",\"stalls\":%" PRIu32,
+         st.reader.reads - before.reader.reads, st.reader.max_read_us,
+         st.reader.stalls - before.reader.stalls);
+  int64_t busy = st.reader.card_busy_us - before.reader.card_busy_us;
+  uint32_t wakeups = st.reader.wakeups - before.reader.wakeups;
+  result("card_duty",
+         "\"busy_us\":%lld,\"busy_permille\":%lld,\"ms_per_min\":%lld,"
+         "\"wakeups_per_min\":%lld,\"bursts\":%" PRIu32,
+         (long long)busy, permille(busy, playing),
+         permille(busy, playing) * 60,
+         (long long)(playing > 0 ? wakeups * 60000000LL / playing : 0),
+         st.reader.bursts - before.reader.bursts);
+}
+
+void app_main(void) {
+#if !CONFIG_IDF_TARGET_LINUX
+  if (sdcard_init() != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to mount the SD card");
+    return;
+  }
+  sdcard_bus_t bus;
+  sdcard_get_bus(&bus);
+  result("card", "\"backend\":\"%s\",\"width\":%u,\"khz\":%" PRIu32,
+         sdcard_backend_name(bus.backend), bus.width, bus.freq_khz);
+#endif
+  mkdir(CONFIG_BENCH_DIR, 0755);
+
+  if (mplayer_setup() != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to setup the player");
+    return;
+  }
+
+  ESP_LOGI(TAG, "Benchmarking in %s", CONFIG_BENCH_DIR);
+  if (write_file(bench_path(DATA_FILE), NULL, 0, CONFIG_BENCH_FILE_KB) ==
+      ESP_OK) {
+    bench_seq_read();
+    bench_fopen();
+#if CONFIG_BENCH_CARD_BUSES
+    if (bench_card_buses() != ESP_OK) {
+      return;
+    }
+#endif
+  }
+#if !CONFIG_IDF_TARGET_LINUX
+  bench_dir_scan();
+#endif
+  bench_playback();
+
+  printf(RESULT_PREFIX "{\"bench\":\"done\"}\n");
+}
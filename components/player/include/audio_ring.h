@@ -0,0 +1,108 @@
+
+#ifndef __AUDIO_RING_H__
+#define __AUDIO_RING_H__
+
+/**
+ * Lock free Single Producer - Single Consumer ring of bytes, shared by the
+ * player, the decoders and the output backends.
+ *
+ * The size must be a power of two, head and tail are free running counters
+ * masked on access so the whole storage is usable and no modulo is needed.
+ * Producer and consumer can reserve up to two contiguous spans (the second one
+ * only exists when the free/used region wraps around the end of the storage)
+ * so data can be read or decoded straight into the ring and out of it with
+ * memcpy, then the reservation is committed.
+ *
+ * Only the producer may call the write side and only the consumer the read
+ * side, the consumer side is safe to call from an ISR.
+ */
+
+#include "esp_err.h"
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+    uint8_t *data;       /**< Storage, not owned by the ring */
+    size_t mask;         /**< Storage size - 1 */
+    atomic_size_t head;  /**< Total bytes ever written */
+    atomic_size_t tail;  /**< Total bytes ever read */
+} audio_ring_t;
+
+/**
+ * Contiguous region inside the ring storage
+ */
+typedef struct {
+    uint8_t *ptr;
+    size_t len;
+} audio_ring_span_t;
+
+/**
+ * Attach `storage` to the ring and empty it, `size` must be a power of two
+ */
+esp_err_t audio_ring_init(audio_ring_t *ring, uint8_t *storage, size_t size);
+
+/**
+ * Empty the ring, only valid while neither side is using it
+ */
+void audio_ring_reset(audio_ring_t *ring);
+
+/**
+ * Bytes available to read / space available to write
+ */
+size_t audio_ring_used(audio_ring_t *ring);
+size_t audio_ring_free(audio_ring_t *ring);
+
+// Forced inline, the consumer side runs from IRAM in the DMA ISR and must
+// not call into flash
+static inline __attribute__((always_inline)) size_t
+audio_ring_size(const audio_ring_t *ring) {
+    return ring->mask + 1;
+}
+
+/**
+ * Producer side, get the free space as up to two spans and return the total
+ * length, then publish how many bytes were actually written into them
+ */
+size_t audio_ring_write_spans(audio_ring_t *ring, audio_ring_span_t spans[2]);
+void audio_ring_write_commit(audio_ring_t *ring, size_t len);
+
+/**
+ * Consumer side, get the used space as up to two spans and return the total
+ * length, then release how many bytes were actually consumed
+ */
+size_t audio_ring_read_spans(audio_ring_t *ring, audio_ring_span_t spans[2]);
+void audio_ring_read_commit(audio_ring_t *ring, size_t len);
+
+/**
+ * Producer side, where the consumer is (total bytes read) and where the
+ * written data ends (total bytes written)
+ */
+size_t audio_ring_tail(audio_ring_t *ring);
+size_t audio_ring_head(audio_ring_t *ring);
+
+/**
+ * Producer side, get `len` bytes already written from position `start` on
+ * as up to two spans, to touch up data the consumer did not get to yet. It
+ * is up to the producer to keep clear of what the consumer is reading
+ */
+void audio_ring_peek_spans(audio_ring_t *ring, size_t start, size_t len,
+                           audio_ring_span_t spans[2]);
+
+/**
+ * Producer side, move the end of the written data back to `head` to hide
+ * what comes after from the consumer, or forward again to its old end to
+ * give it back. The bytes in between are kept as long as nothing is written.
+ * A `head` the consumer already read past is moved up to the tail, the head
+ * actually set is returned
+ */
+size_t audio_ring_set_head(audio_ring_t *ring, size_t head);
+
+/**
+ * Copy helpers built on the spans, they return the bytes moved which can be
+ * less than `len`
+ */
+size_t audio_ring_write(audio_ring_t *ring, const uint8_t *src, size_t len);
+size_t audio_ring_read(audio_ring_t *ring, uint8_t *dst, size_t len);
+
+#endif /* __AUDIO_RING_H__ */
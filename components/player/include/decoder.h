@@ -2,4 +2,118 @@
 #ifndef __DECODER_H__
 #define __DECODER_H__
 
+/**
+ * Decoders turn an opened song file into blocks of signed 16 bit mono PCM at
+ * the song own sample rate, the player then takes those blocks through the
+ * rest of the pipeline and into the audio ring.
+ *
+ * Every format implements the decoder_ops_t table, the right one is picked
+ * by looking at the first bytes of the file (see decoder_open), the raw
+ * decoder is the last resort and plays headerless 8 bit unsigned PCM as
+ * before, only for files with its own extensions as it has no header to
+ * recognise.
+ */
+
+#include "esp_err.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include "readahead.h"
+#include <stdint.h>
+
+/**
+ * How many bytes of the file start are given to the probe functions
+ */
+#define DECODER_PROBE_SIZE 64
+
+/**
+ * Format of the song being decoded, filled by the decoder open
+ */
+typedef struct {
+    uint32_t sample_rate;     /**< Frames per second */
+    uint16_t channels;        /**< Channels in the file, output is always mono */
+    uint16_t bits_per_sample; /**< Bits per sample in the file */
+    uint32_t total_frames;    /**< Length of the song in frames, 0 if unknown */
+} decoder_format_t;
+
+typedef struct decoder decoder_t;
+
+/**
+ * Operations every decoder implements
+ */
+typedef struct {
+    const char *name;
+    /**
+     * File extensions of the format, lower case without the dot and NULL
+     * terminated
+     */
+    const char *const *extensions;
+
+    /**
+     * Check if this decoder understands a file starting with `header`, `len`
+     * can be shorter than DECODER_PROBE_SIZE for tiny files
+     */
+    bool (*probe)(const uint8_t *header, size_t len);
+
+    /**
+     * Parse the headers of `dec->stream` (positioned at the start) and fill
+     * `dec->format`, leaves the file ready to decode the first frame.
+     * Returns ESP_ERR_NOT_SUPPORTED, having allocated nothing, if the file
+     * passed the probe but its content is for another decoder
+     */
+    esp_err_t (*open)(decoder_t *dec);
+
+    /**
+     * Decode up to `max_frames` mono frames into `dst`, returns the frames
+     * decoded, 0 once the song is over or on error
+     */
+    size_t (*decode)(decoder_t *dec, int16_t *dst, size_t max_frames);
+
+    /**
+     * Move to the given frame, decoding continues from there
+     */
+    esp_err_t (*seek)(decoder_t *dec, uint32_t frame);
+
+    /**
+     * Free whatever open allocated, the stream is not closed
+     */
+    void (*close)(decoder_t *dec);
+} decoder_ops_t;
+
+/**
+ * An opened decoder, the fields after `format` belong to the decoder itself
+ */
+struct decoder {
+    const decoder_ops_t *ops; /**< Decoder picked by decoder_open */
+    readahead_t *stream;      /**< Song file, owned by the caller */
+    decoder_format_t format;  /**< Filled by open */
+    void *priv;               /**< Decoder private state */
+};
+
+/**
+ * Available decoders
+ */
+extern const decoder_ops_t decoder_wav;
+extern const decoder_ops_t decoder_ima_adpcm;
+extern const decoder_ops_t decoder_mp3;
+extern const decoder_ops_t decoder_raw;
+
+/**
+ * If `path` has the extension of one of the decoders, other files are not
+ * songs and not worth opening
+ */
+bool decoder_is_song(const char *path);
+
+/**
+ * Probe `stream` against every decoder and open the first one that accepts
+ * it, `path` is the file it reads, for its extension
+ */
+esp_err_t decoder_open(decoder_t *dec, readahead_t *stream, const char *path);
+
+/**
+ * Shortcuts for the ops of an opened decoder
+ */
+size_t decoder_decode(decoder_t *dec, int16_t *dst, size_t max_frames);
+esp_err_t decoder_seek(decoder_t *dec, uint32_t frame);
+void decoder_close(decoder_t *dec);
+
 #endif /* __DECODER_H__ */
@@ -0,0 +1,79 @@
+
+#ifndef __DSP_H__
+#define __DSP_H__
+
+/**
+ * Last stage of the player before the ring, it takes blocks of 16 bit mono
+ * PCM, applies the volume and the fades and turns them into the 8 bit
+ * unsigned samples the output plays, all in fixed point and in the player
+ * task so the output only has bytes to copy.
+ *
+ * A new gain is reached over DSP_GAIN_RAMP samples so volume changes don't
+ * step. Fade ins go linearly from silence to the gain. The 8 bit conversion
+ * adds triangular dither and first order noise shaping (the error of every
+ * sample is taken out of the next one), so the quiet parts turn into some
+ * hiss pushed to the high end instead of truncation distortion.
+ *
+ * The fades on samples already in the ring work straight on the 8 bit ones.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Gain of 1, gains are Q15
+ */
+#define DSP_UNITY_GAIN 32768
+
+/**
+ * Samples taken to go from a gain to a new one
+ */
+#define DSP_GAIN_RAMP 256
+
+typedef struct {
+    int32_t gain;       /**< Gain now, Q23 so the ramp steps are exact enough */
+    int32_t target;     /**< Gain ramped to, Q23 */
+    int32_t gain_step;  /**< Added every sample while ramping, Q23 */
+    uint32_t fade_pos;  /**< Samples into the fade in */
+    uint32_t fade_len;  /**< Length of the fade in, 0 once done */
+    int32_t error;      /**< Quantization error of the last sample */
+    uint32_t seed;      /**< Dither noise generator state */
+} dsp_t;
+
+/**
+ * Start at `gain` with no fade
+ */
+void dsp_init(dsp_t *dsp, uint32_t gain);
+
+/**
+ * Start the dither noise and the noise shaping over, the gain and the fade
+ * are left alone. A song then gives the same samples whatever came before
+ */
+void dsp_reset(dsp_t *dsp);
+
+/**
+ * Ramp to `gain` from wherever the gain is now
+ */
+void dsp_set_gain(dsp_t *dsp, uint32_t gain);
+
+/**
+ * Fade the next `samples` samples in from silence
+ */
+void dsp_fade_in(dsp_t *dsp, uint32_t samples);
+
+/**
+ * Process `frames` samples of `in` into `out` as 8 bit unsigned
+ */
+void dsp_process(dsp_t *dsp, const int16_t *in, size_t frames, uint8_t *out);
+
+/**
+ * Fade 8 bit unsigned samples in place, `buf` holds the samples from `pos`
+ * on of a fade lasting `fade_len` samples, so a fade can be split over the
+ * two spans of the ring. Samples past the fade are left alone by the fade
+ * in and silenced by the fade out
+ */
+void dsp_fade_in_u8(uint8_t *buf, size_t len, uint32_t pos, uint32_t fade_len);
+void dsp_fade_out_u8(uint8_t *buf, size_t len, uint32_t pos,
+                     uint32_t fade_len);
+
+#endif /* __DSP_H__ */
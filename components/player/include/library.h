@@ -0,0 +1,146 @@
+
+#ifndef __LIBRARY_H__
+#define __LIBRARY_H__
+
+/**
+ * The song library of a directory and all its subdirectories, kept as an
+ * index on the card and only ever read through a small window, so the
+ * memory used is the same for ten songs or for tens of thousands.
+ *
+ * The index is two files, LIBRARY_INDEX_NAME has a header and a fixed size
+ * record per song (size, modification time, format, duration and where its
+ * path is) and LIBRARY_NAMES_NAME has the paths, relative to the library
+ * directory, one after the other. Song `i` is found by seeking straight to
+ * its record, and as records and paths are written in the same order a
+ * window of songs takes one read of each file.
+ *
+ * library_refresh walks the tree once with FatFs to check if the index
+ * still matches, only if it doesn't it walks it again writing a new one,
+ * keeping the records of songs whose path, size and modification time did
+ * not change and opening the rest to find their format and duration. The
+ * new index is written aside and library_commit puts it in place. Only
+ * files with the extension of a decoder are songs (see decoder_is_song),
+ * the covers, playlists and notes around them are left out.
+ *
+ * Records are stored little endian, as the ESP32 is.
+ */
+
+#include "esp_err.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * Index files inside the library directory, names starting with a dot are
+ * never listed as songs
+ */
+#define LIBRARY_INDEX_NAME ".mplayer.idx"
+#define LIBRARY_NAMES_NAME ".mplayer.nam"
+
+/**
+ * Songs kept in memory around the last one asked for
+ */
+#define LIBRARY_WINDOW 16
+
+/**
+ * Longest path of a song, relative to the library directory and with its
+ * NUL, longer ones are skipped
+ */
+#define LIBRARY_PATH_LEN 256
+
+/**
+ * Deepest subdirectory walked into, the library directory being 1
+ */
+#define LIBRARY_MAX_DEPTH 8
+
+/**
+ * Format of a song as found by the decoders
+ */
+typedef enum {
+    LIBRARY_FORMAT_UNKNOWN = 0, /**< Not probed yet */
+    LIBRARY_FORMAT_WAV,
+    LIBRARY_FORMAT_IMA_ADPCM,
+    LIBRARY_FORMAT_MP3,
+    LIBRARY_FORMAT_RAW,
+    LIBRARY_FORMAT_UNSUPPORTED, /**< No decoder could open it */
+} library_format_t;
+
+/**
+ * Record of a song, as stored in the index
+ */
+typedef struct {
+    uint32_t name_offset; /**< Start of the path in the names file */
+    uint32_t size;        /**< File size in bytes */
+    uint32_t mtime;       /**< FAT date << 16 | FAT time */
+    uint32_t duration_ms; /**< Song length, 0 if unknown */
+    uint8_t format;       /**< library_format_t */
+    uint8_t reserved[3];
+} library_entry_t;
+
+/**
+ * An opened library, the window holds the songs from `first` to
+ * `first + len - 1`
+ */
+typedef struct {
+    FILE *records;       /**< Index file, NULL if the library is not open */
+    FILE *names;         /**< Names file */
+    uint32_t count;      /**< Songs in the library */
+    uint32_t names_size; /**< Bytes in the names file */
+    uint32_t first;      /**< First song in the window */
+    uint32_t len;        /**< Songs in the window */
+    library_entry_t entries[LIBRARY_WINDOW];
+    uint16_t name_pos[LIBRARY_WINDOW]; /**< Path of each song in name_buf */
+    char name_buf[LIBRARY_WINDOW * LIBRARY_PATH_LEN];
+} library_t;
+
+/**
+ * Open the index of `dir_path`, ESP_ERR_NOT_FOUND if there is none (or it
+ * is not valid), in which case one has to be made with library_refresh and
+ * library_commit
+ */
+esp_err_t library_open(const char *dir_path, library_t *lib);
+
+/**
+ * Songs in an opened library, 0 if it is not open
+ */
+static inline uint32_t library_count(const library_t *lib) {
+    return lib->records ? lib->count : 0;
+}
+
+/**
+ * Get the record and path of song `idx`, loading the window around it if
+ * it is not in memory. The pointers stay valid until a song outside the
+ * window is asked for
+ */
+esp_err_t library_get(library_t *lib, uint32_t idx,
+                      const library_entry_t **entry, const char **path);
+
+/**
+ * Find the song with the given path going through the whole index, -1 if
+ * it is not there
+ */
+int32_t library_find(library_t *lib, const char *path);
+
+/**
+ * Walk `dir_path` and check if its index is still right, if not write a
+ * new one aside reusing what is still valid from the current one.
+ * `probe` opens the songs whose format is unknown (slow, better from a low
+ * priority task), without it only paths, sizes and times are listed.
+ * `changed` tells if a new index was written. It does not use any opened
+ * library_t so it can run while one is being read
+ */
+esp_err_t library_refresh(const char *dir_path, bool probe, bool *changed);
+
+/**
+ * Replace the index of `dir_path` with the one written by library_refresh
+ * and reopen `lib` (which may be closed) on it
+ */
+esp_err_t library_commit(const char *dir_path, library_t *lib);
+
+/**
+ * Close the index files
+ */
+void library_close(library_t *lib);
+
+#endif /* __LIBRARY_H__ */
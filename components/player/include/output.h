@@ -0,0 +1,71 @@
+
+#ifndef __OUTPUT_H__
+#define __OUTPUT_H__
+
+/**
+ * Audio output backends for the music player. A backend owns whatever moves
+ * samples out of the chip (the DAC fed by DMA on the ESP32, or a plain file /
+ * null sink when running on a host) and asks the player for a whole block of
+ * samples at a time through a pull callback, so the cost of the output path
+ * is paid once per block instead of once per sample.
+ *
+ * Samples are always 8 bit unsigned mono, 0x80 being silence.
+ */
+
+#include "esp_err.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define OUTPUT_SILENCE 0x80
+
+/**
+ * Called by the backend every time it needs a new block, usually from an
+ * interrupt. It must fill the whole `len` bytes of `dst` (padding with
+ * silence if there is not enough audio) and return how many of those bytes
+ * were real audio samples. `need_yield` is set if it woke up a higher
+ * priority task and the backend should yield when leaving its ISR.
+ */
+typedef size_t (*output_pull_cb_t)(uint8_t *dst, size_t len, bool *need_yield,
+                                   void *ctx);
+
+/**
+ * Backend operations, every backend exposes one constant instance of this.
+ */
+typedef struct {
+    const char *name;
+
+    /**
+     * Allocate the backend resources, `pull` will be used to request blocks
+     */
+    esp_err_t (*init)(uint32_t sample_rate, output_pull_cb_t pull, void *ctx);
+
+    /**
+     * Change the output sample rate, only valid while the output is stopped
+     */
+    esp_err_t (*set_sample_rate)(uint32_t sample_rate);
+
+    /**
+     * Start and stop pulling blocks from the player
+     */
+    esp_err_t (*start)(void);
+    esp_err_t (*stop)(void);
+
+    /**
+     * Release everything init allocated
+     */
+    void (*deinit)(void);
+} output_backend_t;
+
+/**
+ * Continuous DAC output fed through DMA, only on chips with a DAC
+ */
+extern const output_backend_t output_dac_dma;
+
+/**
+ * File or null sink, writes every block to CONFIG_MPLAYER_OUTPUT_SINK_PATH (or
+ * nowhere if empty) and measures how long producing each block took
+ */
+extern const output_backend_t output_sink;
+
+#endif /* __OUTPUT_H__ */
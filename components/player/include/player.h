@@ -5,41 +5,270 @@
 
 /**
  * This the music player component of the music player, it works by first
- * opening a file under a FS somewhere, the file format isn't really decided
- * still, so for now let's just assume that the file can be read, ignoring if
- * the file has any compression applied then the file is read continuosly into a
- * buffer inside a task a previous setted interrupt will take data from that
- * buffer and pass it to the DAC1 in the ESP32, when the buffer is used to a
- * certain value it refills so the music can work smothly
+ * opening a file under a FS somewhere, the decoder for the file is picked by
+ * looking at its header (see decoder.h) and it also sets the output sample
+ * rate for the song, then the file is decoded continuosly into a buffer
+ * inside a task, the output backend (see output.h) takes whole blocks from
+ * that buffer and passes them to the DAC1 in the ESP32 through DMA, when the
+ * buffer is used to a certain value it refills so the music can work smothly
+ *
+ * Every control function below only queues a command for the player task and
+ * returns, the task runs them in order between blocks so they never race the
+ * decoding nor wait on the card, and tells how they went through the event
+ * callback (see mplayer_set_event_callback)
  */
 
 #include "esp_err.h"
+#include "readahead.h"
+#include <stdbool.h>
+#include <stdint.h>
 
 /**
- * Setup the Task and Interrupt for the music player inner workings
+ * Counters to check how often the filler task wakes up, it only does when
+ * the output asks for a refill, when the end of a song is done playing or
+ * when one of the functions below changes the state
+ */
+typedef struct {
+    uint32_t task_wakeups;    /**< Total wakeups of the filler task */
+    uint32_t refill_requests; /**< Ring went under the low watermark */
+    uint32_t drain_signals;   /**< Ring emptied at the end of a song */
+} mplayer_wakeups_t;
+
+/**
+ * Silence heard when going from a song to another, counted in output
+ * samples from the last sample of one song to the first of the next, be it
+ * a gapless advance, the end of a song or a skip
+ */
+typedef struct {
+    uint32_t transitions; /**< Song changes measured */
+    uint32_t last_gap;    /**< Silence in the last change */
+    uint32_t max_gap;     /**< Longest silence seen */
+} mplayer_gaps_t;
+
+/**
+ * Buckets of the ring fill histogram, bucket `i` counts the blocks pulled
+ * with the ring between i/8 and (i+1)/8 full (the last one also when full)
+ */
+#define MPLAYER_FILL_BUCKETS 8
+
+/**
+ * Playback health since setup (or mplayer_reset_stats). The output side is
+ * only counted while a song plays steadily, not while it starts, changes to
+ * the next one or drains its end, so any silence it got there is a real
+ * underrun
+ */
+typedef struct {
+    uint32_t blocks;           /**< Blocks pulled by the output */
+    uint32_t underruns;        /**< Times the ring ran out of audio */
+    uint32_t underrun_samples; /**< Silence played because of those */
+    uint32_t longest_underrun; /**< Longest run of that silence, samples */
+    uint32_t fill_min;         /**< Emptiest the ring was, samples */
+    uint32_t fill_avg;         /**< Average ring fill, samples */
+    uint32_t fill[MPLAYER_FILL_BUCKETS]; /**< Blocks by ring fill */
+    uint32_t pull_avg_us;      /**< Time in the output pull (the DMA ISR) */
+    uint32_t pull_max_us;
+    uint32_t pull_avg_cycles;  /**< Same in CPU cycles, 0 on the host */
+    uint32_t pull_max_cycles;
+    int64_t pull_time_us;      /**< All of it, the output load */
+    int64_t decode_time_us;    /**< Time spent decoding into the ring */
+    int64_t elapsed_us;        /**< Since setup, to turn times into loads */
+    uint32_t commands;         /**< Commands run */
+    uint32_t cmd_latency_avg_us; /**< From queued to started by the task */
+    uint32_t cmd_latency_max_us;
+    uint32_t player_stack_free; /**< Stack the player task never used, bytes */
+    readahead_stats_t reader;   /**< Card reads, see readahead.h */
+} mplayer_stats_t;
+
+/**
+ * Player commands, as queued by the control functions
+ */
+typedef enum {
+    MPLAYER_CMD_NONE = 0, /**< Not a command, the player did it on its own */
+    MPLAYER_CMD_PLAY,
+    MPLAYER_CMD_STOP,
+    MPLAYER_CMD_PAUSE,
+    MPLAYER_CMD_RESUME,
+    MPLAYER_CMD_SEEK,
+    MPLAYER_CMD_SEEK_RELATIVE,
+    MPLAYER_CMD_NEXT,
+    MPLAYER_CMD_PRELOAD,
+    MPLAYER_CMD_SET_NEXT,
+} mplayer_cmd_t;
+
+/**
+ * What the player tells through the event callback, every command ends in
+ * one of these but the preloads, which only tell when they fail
+ */
+typedef enum {
+    MPLAYER_EVENT_STARTED = 0, /**< A song given to play started */
+    MPLAYER_EVENT_ADVANCED,    /**< Moved on to the song given to set_next */
+    MPLAYER_EVENT_FINISHED,    /**< Song over (or skipped) and no next one */
+    MPLAYER_EVENT_STOPPED,
+    MPLAYER_EVENT_PAUSED,
+    MPLAYER_EVENT_RESUMED,
+    MPLAYER_EVENT_SEEKED,
+    MPLAYER_EVENT_ERROR,       /**< `cmd` failed with `err` */
+} mplayer_event_type_t;
+
+typedef struct {
+    mplayer_event_type_t type;
+    mplayer_cmd_t cmd;    /**< Command it comes from, MPLAYER_CMD_NONE if none */
+    esp_err_t err;        /**< ESP_OK but for MPLAYER_EVENT_ERROR */
+    uint32_t position_ms; /**< Position in the song when it happened */
+} mplayer_event_t;
+
+/**
+ * Called from the player task for every event, it should just hand the
+ * event over to another task, the player waits for it
+ */
+typedef void (*mplayer_event_cb_t)(const mplayer_event_t *event, void *ctx);
+
+/**
+ * Power states of the player, the output only runs while playing and the
+ * CPU is only kept at full speed while decoding, with power management
+ * enabled the chip can lower its clock (or light sleep) the rest of the time
+ */
+typedef enum {
+    MPLAYER_POWER_IDLE = 0, /**< Nothing playing, output stopped */
+    MPLAYER_POWER_PAUSED,   /**< Song paused, output stopped */
+    MPLAYER_POWER_WAITING,  /**< Playing, waiting for the output to drain */
+    MPLAYER_POWER_DECODING, /**< Playing, filling the ring */
+    MPLAYER_POWER_STATES,
+} mplayer_power_state_t;
+
+/**
+ * Time spent in each power state since setup
+ */
+typedef struct {
+    mplayer_power_state_t state;                /**< Current state */
+    int64_t time_us[MPLAYER_POWER_STATES];      /**< Time in each state */
+} mplayer_power_t;
+
+/**
+ * Setup the Task and Output backend for the music player inner workings
  */
 esp_err_t mplayer_setup(void);
 
 /**
- * Play a song residing in the file indicated
+ * Set the function told about every event, NULL for none
+ */
+void mplayer_set_event_callback(mplayer_event_cb_t cb, void *ctx);
+
+/**
+ * Play a song residing in the file indicated, stopping the one playing
+ */
+esp_err_t mplayer_play(const char *filepath);
+
+/**
+ * Same as mplayer_play but starting `ms` into the song, nothing before it
+ * is played (if the song can't seek it plays from the start)
+ */
+esp_err_t mplayer_play_from(const char *filepath, uint32_t ms);
+
+/**
+ * Open the song at `filepath` and start reading its beginning, so a later
+ * mplayer_play of the same path starts right away. Two songs are kept
+ * preloaded, the oldest one not queued as next is dropped for a new one
  */
-esp_err_t mplayer_play(char *filepath);
+esp_err_t mplayer_preload(const char *filepath);
 
 /**
- * Function to pause and resume the song, work by toggling the interrupt on/off
+ * Preload the song to continue with once the current one ends, the player
+ * switches to it on its own at the last sample so there is no silence in
+ * between (if the output has to change its rate there is a short one).
+ * NULL clears it
+ */
+esp_err_t mplayer_set_next(const char *filepath);
+
+/**
+ * Skip to the song given to mplayer_set_next right away
+ * (MPLAYER_EVENT_ADVANCED), if there is none the current one just ends
+ * (MPLAYER_EVENT_FINISHED)
+ */
+esp_err_t mplayer_next(void);
+
+/**
+ * Function to pause and resume the song, while paused the output is
+ * stopped. The pause fades out (CONFIG_MPLAYER_FADE_MS) a little ahead of
+ * what is playing so it takes effect a short while later, the resume fades
+ * back in right where it stopped
  */
 esp_err_t mplayer_pause(void);
 esp_err_t mplayer_resume(void);
 
 /**
- * Stop the current playing song, stops the ISR and the filler task,
+ * Stop the current playing song, stops the output and the filler task,
  * also clears the buffer for safety
  */
 esp_err_t mplayer_stop(void);
 
 /**
- * Check if the current song has finished playing
+ * Move the current song to `ms` from its start, the audio fades out, the
+ * output is stopped, the buffer emptied and refilled from there before it
+ * fades in again, so nothing of the old position is heard. WAV, IMA ADPCM
+ * and raw land on the exact sample, MP3 on the frame the Xing table (or the
+ * bitrate) points to. Seeking past the end ends the song
+ */
+esp_err_t mplayer_seek(uint32_t ms);
+
+/**
+ * Seek `delta_ms` forward (or backwards if negative) from where the song
+ * is, clamped to the song length, for scrubbing
+ */
+esp_err_t mplayer_seek_relative(int32_t delta_ms);
+
+/**
+ * Set the volume from 0 to 100, squared into the gain as that is closer to
+ * how loud it sounds. It is applied when producing (never in the output)
+ * and ramped, so it is heard once the output gets to the audio produced
+ * after the call
+ */
+esp_err_t mplayer_set_volume(uint8_t percent);
+uint8_t mplayer_get_volume(void);
+
+/**
+ * Position and length of the current song, 0 if nothing is playing (or
+ * the length is unknown)
+ */
+uint32_t mplayer_get_position_ms(void);
+uint32_t mplayer_get_duration_ms(void);
+
+/**
+ * When (esp_timer_get_time) the output got the first sample of the song
+ * started by the last mplayer_play, 0 until then
+ */
+int64_t mplayer_get_first_sample_time(void);
+
+/**
+ * Copy the wakeup counters since setup
+ */
+void mplayer_get_wakeups(mplayer_wakeups_t *out);
+
+/**
+ * Copy the song change gap measurements since setup
+ */
+void mplayer_get_gaps(mplayer_gaps_t *out);
+
+/**
+ * Copy the time spent in each power state since setup
+ */
+void mplayer_get_power(mplayer_power_t *out);
+
+/**
+ * Copy the playback health statistics since setup or the last reset
+ */
+void mplayer_get_stats(mplayer_stats_t *out);
+
+/**
+ * Start the statistics over, for them to cover a single run. The read-ahead
+ * ones in `reader` are not reset
+ */
+void mplayer_reset_stats(void);
+
+/**
+ * Log the statistics in a few lines, also done every
+ * CONFIG_MPLAYER_STATS_LOG_INTERVAL seconds if set
  */
-bool mplayer_has_finished(void);
+void mplayer_log_stats(void);
 
 #endif /* __PLAYER_H__ */
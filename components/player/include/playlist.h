@@ -0,0 +1,89 @@
+
+#ifndef __PLAYLIST_H__
+#define __PLAYLIST_H__
+
+/**
+ * M3U and M3U8 playlists, read through an index of where every entry
+ * starts in the file so song `i` is two short reads whatever the size of
+ * the playlist, and the memory used is the same for ten entries or for
+ * thousands.
+ *
+ * The playlist is read once, a chunk at a time with one bounded line
+ * buffer, writing the offset of every entry to an index file next to it
+ * (the playlist name with a dot in front and PLAYLIST_INDEX_SUFFIX after).
+ * The index keeps the size and modification time of the playlist, as long
+ * as they match it is used as it is.
+ *
+ * Comments and directives (#EXTM3U, #EXTINF...), blank lines and URLs are
+ * skipped. Entries are paths relative to the playlist, or absolute ones
+ * from the card root, with '/' or '\' separators and an optional drive
+ * letter. They are resolved as strings only, nothing is checked on the card
+ * until the song is played. Both kinds are read as bytes, so an M3U in a
+ * legacy code page only works for ASCII paths.
+ *
+ * Offsets are stored little endian, as the ESP32 is.
+ */
+
+#include "esp_err.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * Appended to the index file name
+ */
+#define PLAYLIST_INDEX_SUFFIX ".idx"
+
+/**
+ * Longest line of a playlist with its NUL, longer entries are skipped
+ */
+#define PLAYLIST_LINE_LEN 512
+
+/**
+ * Longest path of a directory, the playlist one and the root
+ */
+#define PLAYLIST_DIR_LEN 256
+
+/**
+ * An opened playlist
+ */
+typedef struct {
+    FILE *file;                  /**< The playlist, NULL if not open */
+    FILE *index;                 /**< Offset of every entry */
+    uint32_t count;              /**< Entries */
+    char root[PLAYLIST_DIR_LEN]; /**< Where absolute paths start */
+    char dir[PLAYLIST_DIR_LEN];  /**< Playlist directory, relative to root */
+    char line[PLAYLIST_LINE_LEN];
+} playlist_t;
+
+/**
+ * Open the playlist at `path` (under `root`), making its index if there is
+ * none or if the playlist changed since
+ */
+esp_err_t playlist_open(const char *path, const char *root, playlist_t *pl);
+
+/**
+ * Entries in an opened playlist, 0 if it is not open
+ */
+static inline uint32_t playlist_count(const playlist_t *pl) {
+    return pl->file ? pl->count : 0;
+}
+
+/**
+ * Get the full path of entry `idx`
+ */
+esp_err_t playlist_get(playlist_t *pl, uint32_t idx, char *path, size_t len);
+
+/**
+ * Find the entry with the given full path going through the whole
+ * playlist, -1 if it is not there
+ */
+int32_t playlist_find(playlist_t *pl, const char *path);
+
+/**
+ * Close the playlist and its index
+ */
+void playlist_close(playlist_t *pl);
+
+#endif /* __PLAYLIST_H__ */
@@ -0,0 +1,90 @@
+
+#ifndef __READAHEAD_H__
+#define __READAHEAD_H__
+
+/**
+ * Read-ahead streams for song files. Every stream has two buffers of
+ * CONFIG_MPLAYER_READAHEAD_SIZE bytes in DMA capable memory, a dedicated
+ * reader task fills them with large reads aligned to that size while the
+ * decoder consumes the other one, so the decoding never waits on the card
+ * unless it is slower than the audio.
+ *
+ * With CONFIG_MPLAYER_PREFETCH_KB (boards with PSRAM) every stream also
+ * gets a prefetch ring in PSRAM that the reader fills in bursts of back to
+ * back reads, the buffers are then loaded from it. A burst starts when
+ * what is left in it goes under CONFIG_MPLAYER_PREFETCH_REFILL_PERCENT and
+ * the card has nothing to do between them, card_busy_us and wakeups in
+ * the statistics show how much that is.
+ *
+ * The read side (read, seek, tell) must only be used from one task, usually
+ * the one decoding.
+ */
+
+#include "esp_err.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h> // For SEEK_SET, SEEK_CUR and SEEK_END
+
+typedef struct readahead readahead_t;
+
+/**
+ * Buckets of the read latency histogram, bucket `i` counts the reads that
+ * took less than 512 << i us, the last one every slower read
+ */
+#define READAHEAD_LATENCY_BUCKETS 8
+
+/**
+ * What the reader did since setup, for every stream
+ */
+typedef struct {
+    uint32_t reads;        /**< Reads from the card */
+    uint32_t max_read_us;  /**< Slowest read */
+    int64_t read_time_us;  /**< Time spent in reads, the reader load */
+    uint32_t latency[READAHEAD_LATENCY_BUCKETS]; /**< Reads by duration */
+    int64_t card_busy_us;  /**< Time the card was busy, see wakeups */
+    uint32_t wakeups;      /**< Busy spells, reads under 5 ms apart are one */
+    uint32_t bursts;       /**< Prefetch bursts */
+    uint32_t stalls;       /**< Times the consumer waited for a read */
+    int64_t stall_time_us; /**< Time it spent waiting */
+    uint32_t stack_free;   /**< Stack the reader task never used, bytes */
+} readahead_stats_t;
+
+/**
+ * Create the reader task, call it once before opening any stream
+ */
+esp_err_t readahead_setup(void);
+
+/**
+ * Open the file at `path` and start reading its beginning, NULL if the file
+ * can't be opened or there is no free stream
+ */
+readahead_t *readahead_open(const char *path);
+
+/**
+ * Stop reading and close the file, waits for a read in progress to end
+ */
+void readahead_close(readahead_t *ra);
+
+/**
+ * Copy up to `len` bytes from the current position into `dst`, blocking
+ * until the reader has them, returns less only at the end of the file
+ */
+size_t readahead_read(readahead_t *ra, void *dst, size_t len);
+
+/**
+ * Move the current position, same `whence` values as fseek
+ */
+esp_err_t readahead_seek(readahead_t *ra, long offset, int whence);
+
+/**
+ * Current position and total size of the file
+ */
+long readahead_tell(readahead_t *ra);
+long readahead_size(readahead_t *ra);
+
+/**
+ * Copy the reader statistics
+ */
+void readahead_get_stats(readahead_stats_t *out);
+
+#endif /* __READAHEAD_H__ */
@@ -0,0 +1,70 @@
+
+#ifndef __RESAMPLER_H__
+#define __RESAMPLER_H__
+
+/**
+ * Fixed point sample rate converter for 16 bit mono PCM, it sits between the
+ * decoder and the output so songs at any rate can be played at the single
+ * output rate.
+ *
+ * It is a polyphase windowed sinc (bandlimited interpolation), the filter
+ * wing is precomputed at build time by tools/gen_resampler_coeffs.py for each
+ * quality and stretched when downsampling so it also works as the
+ * anti-aliasing filter. Only integer math is used while processing.
+ */
+
+#include "esp_err.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Input frames kept inside the resampler, has to hold both filter wings
+ */
+#define RESAMPLER_BUF_FRAMES 1024
+
+/**
+ * Quality / CPU trade-off, the number of zero crossings of the sinc per wing
+ * and so the taps per output sample grow with it
+ */
+typedef enum {
+    RESAMPLER_LOW = 0, /**< 4 zero crossings, cheapest */
+    RESAMPLER_MEDIUM,  /**< 8 zero crossings */
+    RESAMPLER_HIGH,    /**< 16 zero crossings, best stopband */
+} resampler_quality_t;
+
+typedef struct {
+    bool passthrough;        /**< Same rate in and out, just copies */
+    bool flushed;            /**< Trailing silence already appended */
+    const int16_t *coeffs;   /**< Filter wing for the quality */
+    const int16_t *deltas;   /**< Difference between consecutive coeffs */
+    uint32_t wing_len;       /**< Table entries in the wing, Q16 */
+    uint32_t table_step;     /**< Table advance per input frame, Q16 */
+    int32_t gain;            /**< Output scale when downsampling, Q15 */
+    uint32_t wing_frames;    /**< Input frames each filter wing spans */
+    uint64_t step;           /**< Input frames per output frame, Q32 */
+    uint64_t pos;            /**< Next output position inside buf, Q32 */
+    size_t len;              /**< Frames in buf */
+    int16_t buf[RESAMPLER_BUF_FRAMES];
+} resampler_t;
+
+/**
+ * Prepare the converter for `in_rate` to `out_rate`
+ */
+esp_err_t resampler_init(resampler_t *rs, uint32_t in_rate, uint32_t out_rate,
+                         resampler_quality_t quality);
+
+/**
+ * Take up to `*in_frames` from `in` (updated to the frames actually taken)
+ * and write up to `max_out` frames to `out`, returns the frames written
+ */
+size_t resampler_process(resampler_t *rs, const int16_t *in,
+                         size_t *in_frames, int16_t *out, size_t max_out);
+
+/**
+ * Once the input is over, push out what is still inside the filter, returns
+ * 0 once everything was written
+ */
+size_t resampler_flush(resampler_t *rs, int16_t *out, size_t max_out);
+
+#endif /* __RESAMPLER_H__ */
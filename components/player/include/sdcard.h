@@ -3,23 +3,66 @@
 #define __SDCARD_H__
 
 #include "esp_err.h"
+#include <stddef.h>
+#include <stdint.h>
 
 #define MOUNT_POINT "/sdcard"
 
 /**
- * Setup the sdcard using the sdmmc driver under the predefined pins:
+ * How the card is mounted
+ */
+typedef enum {
+    SDCARD_BACKEND_SDSPI, /**< SPI2, pins set in the config */
+    SDCARD_BACKEND_SDMMC, /**< SDMMC host slot 1 */
+} sdcard_backend_t;
+
+typedef struct {
+    sdcard_backend_t backend;
+    uint8_t width;     /**< Data lines, always 1 over SPI */
+    uint32_t freq_khz; /**< Highest clock, or the one used once mounted */
+} sdcard_bus_t;
+
+/**
+ * The bus set in the config (MPLAYER_SDCARD_*)
+ */
+void sdcard_default_bus(sdcard_bus_t *bus);
+
+/**
+ * Mount the card on MOUNT_POINT with the bus set in the config, by default
+ * over SPI on these pins:
  * CMD/MOSI: 21
  * CLK: 22
  * D0/MISO: 23
+ * D3/CS: 13
  * D1: Not Used
  * D2: Not Used
- * D3: Not Used
  */
 esp_err_t sdcard_init(void);
 
+/**
+ * Same with a given bus, to compare them
+ */
+esp_err_t sdcard_init_bus(const sdcard_bus_t *bus);
+
+/**
+ * The bus of the mounted card, with the clock it really runs at
+ */
+esp_err_t sdcard_get_bus(sdcard_bus_t *bus);
+
+/**
+ * "sdspi" or "sdmmc"
+ */
+const char *sdcard_backend_name(sdcard_backend_t backend);
+
 /**
  * Just Unmount and Try to cleanly end everything with her
  */
 esp_err_t sdcard_detach(void);
 
+/**
+ * Turn a path under MOUNT_POINT into the path FatFs uses for it ("0:/..."),
+ * for the few places that call FatFs directly to get more than the VFS gives
+ */
+esp_err_t sdcard_fatfs_path(const char *path, char *out, size_t len);
+
 #endif /* __SDCARD_H__ */
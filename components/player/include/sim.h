@@ -0,0 +1,83 @@
+
+#ifndef __SIM_H__
+#define __SIM_H__
+
+/**
+ * Virtual time to run the whole player on the linux target, built when the
+ * sink output is set to virtual time pacing.
+ *
+ * The sink task is the clock, it runs at the idle priority so it only
+ * gets the CPU once every other task is blocked, then it moves the clock one
+ * block forward and pulls that block like the DMA would. Decoding takes no
+ * virtual time at all, waiting on the card does: after every read the
+ * reader sleeps on the virtual clock for the latency set with
+ * sim_set_storage, and the output keeps playing (or runs out) meanwhile.
+ * With the output stopped the clock jumps straight to the next task to
+ * wake up.
+ *
+ * The same songs with the same storage give the same sample stream (see
+ * CONFIG_MPLAYER_OUTPUT_SINK_PATH) and the same underruns (see
+ * mplayer_get_stats) on any machine, as fast as it can decode. Songs are
+ * read from the host filesystem. The test app checks it on every run (see
+ * test/main/test_sim.c).
+ *
+ * Other tasks should wait with sim_sleep_us too, a vTaskDelay is in real
+ * time and the clock runs way faster than that.
+ */
+
+#include "esp_err.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+/**
+ * How long every card read takes
+ */
+typedef struct {
+    uint32_t latency_us;  /**< Every read takes this */
+    uint32_t jitter_us;   /**< Plus up to this, pseudo random but repeatable */
+    uint32_t spike_every; /**< Every this many reads (0 for never)... */
+    uint32_t spike_us;    /**< ...one takes this instead */
+} sim_storage_t;
+
+/**
+ * Make `clock` the task moving the clock, it is woken when a task goes to
+ * sleep on it
+ */
+void sim_set_clock_task(TaskHandle_t clock);
+
+/**
+ * Virtual time since start
+ */
+int64_t sim_now_us(void);
+
+/**
+ * Block the calling task for `us` of virtual time
+ */
+void sim_sleep_us(uint32_t us);
+
+/**
+ * Move the clock forward, stopping to wake (and let run) every task whose
+ * time comes on the way. Only for the clock task
+ */
+void sim_advance_us(uint32_t us);
+
+/**
+ * Move the clock to the first task to wake up and let it run, false if
+ * nobody sleeps. Only for the clock task
+ */
+bool sim_advance_to_next(void);
+
+/**
+ * Set the storage latencies, CONFIG_MPLAYER_SIM_READ_LATENCY_US and
+ * CONFIG_MPLAYER_SIM_READ_JITTER_US until then
+ */
+void sim_set_storage(const sim_storage_t *storage);
+
+/**
+ * Sleep as long as the next card read takes, called by the reader
+ */
+void sim_storage_delay(void);
+
+#endif /* __SIM_H__ */
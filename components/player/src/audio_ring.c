@@ -0,0 +1,144 @@
+#include "audio_ring.h"
+#include "esp_attr.h"
+#include <stdbool.h>
+#include <string.h>
+
+// Each side owns one counter, it reads its own one relaxed and the other one
+// with acquire, then publishes its own one with release. That way the data
+// written before a head update is visible to whoever sees the new head, and a
+// slot is never overwritten before the consumer is done reading it.
+
+// Forced inline for the same reason as audio_ring_size, a plain static inline
+// may still end up as a call into flash
+static inline __attribute__((always_inline)) size_t
+split_spans(audio_ring_t *ring, size_t start, size_t len,
+            audio_ring_span_t spans[2]) {
+  size_t offset = start & ring->mask;
+  size_t first = audio_ring_size(ring) - offset;
+  if (first > len) {
+    first = len;
+  }
+
+  spans[0].ptr = ring->data + offset;
+  spans[0].len = first;
+  spans[1].ptr = ring->data;
+  spans[1].len = len - first;
+  return len;
+}
+
+// Only audio_ring_set_head can put the head behind the tail, when the
+// consumer gets past it meanwhile. The counters are free running, so it's the
+// sign of the difference that tells
+static inline __attribute__((always_inline)) bool head_behind(size_t head,
+                                                              size_t tail) {
+  return (ptrdiff_t)(head - tail) < 0;
+}
+
+esp_err_t audio_ring_init(audio_ring_t *ring, uint8_t *storage, size_t size) {
+  if (ring == NULL || storage == NULL || size == 0 ||
+      (size & (size - 1)) != 0) {
+    return ESP_ERR_INVALID_ARG;
+  }
+
+  ring->data = storage;
+  ring->mask = size - 1;
+  audio_ring_reset(ring);
+  return ESP_OK;
+}
+
+void audio_ring_reset(audio_ring_t *ring) {
+  atomic_store_explicit(&ring->head, 0, memory_order_relaxed);
+  atomic_store_explicit(&ring->tail, 0, memory_order_release);
+}
+
+size_t IRAM_ATTR audio_ring_used(audio_ring_t *ring) {
+  size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+  return head_behind(head, tail) ? 0 : head - tail;
+}
+
+size_t audio_ring_free(audio_ring_t *ring) {
+  return audio_ring_size(ring) - audio_ring_used(ring);
+}
+
+size_t audio_ring_write_spans(audio_ring_t *ring, audio_ring_span_t spans[2]) {
+  size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+  if (head_behind(head, tail)) {
+    // The consumer read past a head set back, all it left is free
+    head = tail;
+    atomic_store_explicit(&ring->head, head, memory_order_relaxed);
+  }
+  return split_spans(ring, head, audio_ring_size(ring) - (head - tail), spans);
+}
+
+void audio_ring_write_commit(audio_ring_t *ring, size_t len) {
+  size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  atomic_store_explicit(&ring->head, head + len, memory_order_release);
+}
+
+size_t IRAM_ATTR audio_ring_read_spans(audio_ring_t *ring,
+                                       audio_ring_span_t spans[2]) {
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+  return split_spans(ring, tail, head_behind(head, tail) ? 0 : head - tail,
+                     spans);
+}
+
+void IRAM_ATTR audio_ring_read_commit(audio_ring_t *ring, size_t len) {
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  atomic_store_explicit(&ring->tail, tail + len, memory_order_release);
+}
+
+size_t audio_ring_tail(audio_ring_t *ring) {
+  return atomic_load_explicit(&ring->tail, memory_order_acquire);
+}
+
+size_t audio_ring_head(audio_ring_t *ring) {
+  return atomic_load_explicit(&ring->head, memory_order_relaxed);
+}
+
+void audio_ring_peek_spans(audio_ring_t *ring, size_t start, size_t len,
+                           audio_ring_span_t spans[2]) {
+  split_spans(ring, start, len, spans);
+}
+
+size_t audio_ring_set_head(audio_ring_t *ring, size_t head) {
+  // Never behind the consumer
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+  if (head_behind(head, tail)) {
+    head = tail;
+  }
+  atomic_store_explicit(&ring->head, head, memory_order_release);
+  return head;
+}
+
+size_t audio_ring_write(audio_ring_t *ring, const uint8_t *src, size_t len) {
+  audio_ring_span_t spans[2];
+  size_t avail = audio_ring_write_spans(ring, spans);
+  if (len > avail) {
+    len = avail;
+  }
+
+  size_t first = len < spans[0].len ? len : spans[0].len;
+  memcpy(spans[0].ptr, src, first);
+  memcpy(spans[1].ptr, src + first, len - first);
+
+  audio_ring_write_commit(ring, len);
+  return len;
+}
+
+size_t IRAM_ATTR audio_ring_read(audio_ring_t *ring, uint8_t *dst, size_t len) {
+  audio_ring_span_t spans[2];
+  size_t avail = audio_ring_read_spans(ring, spans);
+  if (len > avail) {
+    len = avail;
+  }
+
+  size_t first = len < spans[0].len ? len : spans[0].len;
+  memcpy(dst, spans[0].ptr, first);
+  memcpy(dst + first, spans[1].ptr, len - first);
+
+  audio_ring_read_commit(ring, len);
+  return len;
+}
@@ -0,0 +1,107 @@
+#include "decoder.h"
+#include "esp_log.h"
+#include "sdkconfig.h"
+#include <inttypes.h>
+#include <string.h>
+#include <strings.h>
+
+static const char *TAG = "DECODER";
+
+// Probed in order, raw accepts almost anything with its extension so it
+// has to stay the last one. Several decoders can share a container (WAV), their open returns
+// ESP_ERR_NOT_SUPPORTED for content they don't handle and the next is tried
+static const decoder_ops_t *const decoders[] = {
+    &decoder_wav,
+    &decoder_ima_adpcm,
+#if CONFIG_MPLAYER_DECODER_MP3
+    &decoder_mp3,
+#endif
+    &decoder_raw,
+};
+
+#define DECODERS (sizeof(decoders) / sizeof(decoders[0]))
+
+static bool has_extension(const decoder_ops_t *ops, const char *path) {
+  const char *slash = strrchr(path, '/');
+  const char *dot = strrchr(slash ? slash : path, '.');
+  if (dot == NULL) {
+    return false;
+  }
+  for (const char *const *ext = ops->extensions; *ext != NULL; ext++) {
+    if (strcasecmp(dot + 1, *ext) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool decoder_is_song(const char *path) {
+  for (size_t i = 0; i < DECODERS; i++) {
+    if (has_extension(decoders[i], path)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+esp_err_t decoder_open(decoder_t *dec, readahead_t *stream, const char *path) {
+  uint8_t header[DECODER_PROBE_SIZE];
+
+  memset(dec, 0, sizeof(*dec));
+  dec->stream = stream;
+
+  size_t len = readahead_read(stream, header, sizeof(header));
+  if (readahead_seek(stream, 0, SEEK_SET) != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to rewind file after probing");
+    return ESP_FAIL;
+  }
+
+  for (size_t i = 0; i < DECODERS; i++) {
+    if (!decoders[i]->probe(header, len)) {
+      continue;
+    }
+    if (decoders[i] == &decoder_raw && !has_extension(decoders[i], path)) {
+      // A picture or a text file would be played as loud noise
+      continue;
+    }
+
+    dec->ops = decoders[i];
+    esp_err_t ret = dec->ops->open(dec);
+    if (ret == ESP_ERR_NOT_SUPPORTED) {
+      dec->ops = NULL;
+      memset(&dec->format, 0, sizeof(dec->format));
+      if (readahead_seek(stream, 0, SEEK_SET) != ESP_OK) {
+        return ESP_FAIL;
+      }
+      continue;
+    }
+    if (ret != ESP_OK) {
+      ESP_LOGE(TAG, "%s decoder failed to open file", dec->ops->name);
+      dec->ops = NULL;
+      return ret;
+    }
+
+    ESP_LOGI(TAG, "Using %s decoder: %" PRIu32 " Hz, %u ch, %u bits",
+             dec->ops->name, dec->format.sample_rate, dec->format.channels,
+             dec->format.bits_per_sample);
+    return ESP_OK;
+  }
+
+  return ESP_ERR_NOT_SUPPORTED;
+}
+
+size_t decoder_decode(decoder_t *dec, int16_t *dst, size_t max_frames) {
+  return dec->ops->decode(dec, dst, max_frames);
+}
+
+esp_err_t decoder_seek(decoder_t *dec, uint32_t frame) {
+  return dec->ops->seek(dec, frame);
+}
+
+void decoder_close(decoder_t *dec) {
+  if (dec->ops) {
+    dec->ops->close(dec);
+    dec->ops = NULL;
+  }
+  dec->priv = NULL;
+}
@@ -0,0 +1,276 @@
+#include "decoder.h"
+#include "esp_log.h"
+#include "riff.h"
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *TAG = "DEC_ADPCM";
+
+// IMA/DVI ADPCM in a WAV container (format tag 0x11), 4 bits per sample so a
+// quarter of the card reads of 16 bit PCM. The data is made of blocks of
+// block_align bytes that start with a 4 byte header per channel (first
+// sample, step index), every block is read with a single read and expanded
+// into a whole block of mono PCM on the producer side.
+
+static const int16_t step_table[89] = {
+    7,     8,     9,     10,    11,    12,    13,    14,    16,    17,
+    19,    21,    23,    25,    28,    31,    34,    37,    41,    45,
+    50,    55,    60,    66,    73,    80,    88,    97,    107,   118,
+    130,   143,   157,   173,   190,   209,   230,   253,   279,   307,
+    337,   371,   408,   449,   494,   544,   598,   658,   724,   796,
+    876,   963,   1060,  1166,  1282,  1411,  1552,  1707,  1878,  2066,
+    2272,  2499,  2749,  3024,  3327,  3660,  4026,  4428,  4871,  5358,
+    5894,  6484,  7132,  7845,  8630,  9493,  10442, 11487, 12635, 13899,
+    15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767};
+
+static const int8_t index_table[16] = {-1, -1, -1, -1, 2, 4, 6, 8,
+                                       -1, -1, -1, -1, 2, 4, 6, 8};
+
+typedef struct {
+    uint16_t channels;
+    uint16_t block_align;       // Bytes per coded block
+    uint16_t samples_per_block; // Frames per coded block
+    uint32_t data_start;        // File offset of the first block
+    uint32_t frames_left;       // Frames until the end of the song
+    uint16_t pcm_len;           // Frames decoded in pcm
+    uint16_t pcm_pos;           // Frames of pcm already handed out
+    uint8_t *block;             // One coded block
+    int16_t *pcm;               // That block decoded and mixed to mono
+} adpcm_state_t;
+
+typedef struct {
+    int32_t predictor;
+    int32_t index;
+} adpcm_channel_t;
+
+static inline int16_t adpcm_expand(adpcm_channel_t *ch, uint8_t nibble) {
+  int32_t step = step_table[ch->index];
+  int32_t diff = step >> 3;
+  if (nibble & 4) {
+    diff += step;
+  }
+  if (nibble & 2) {
+    diff += step >> 1;
+  }
+  if (nibble & 1) {
+    diff += step >> 2;
+  }
+  if (nibble & 8) {
+    diff = -diff;
+  }
+
+  ch->predictor += diff;
+  if (ch->predictor > INT16_MAX) {
+    ch->predictor = INT16_MAX;
+  } else if (ch->predictor < INT16_MIN) {
+    ch->predictor = INT16_MIN;
+  }
+
+  ch->index += index_table[nibble];
+  if (ch->index < 0) {
+    ch->index = 0;
+  } else if (ch->index > 88) {
+    ch->index = 88;
+  }
+  return (int16_t)ch->predictor;
+}
+
+// Decode one channel of the block in `st->block` into `out`, `mix` averages
+// it with what is already there (second channel of a stereo block)
+static void adpcm_decode_channel(adpcm_state_t *st, int c, int16_t *out,
+                                 bool mix) {
+  const uint8_t *hdr = st->block + 4 * c;
+  adpcm_channel_t ch = {
+      .predictor = (int16_t)riff_le16(hdr),
+      .index = hdr[2] > 88 ? 88 : hdr[2],
+  };
+
+  out[0] = mix ? (int16_t)((out[0] + ch.predictor) >> 1)
+               : (int16_t)ch.predictor;
+
+  // After the headers the channels are interleaved in 4 byte groups of 8
+  // samples, low nibble first
+  const uint8_t *data = st->block + 4 * st->channels + 4 * c;
+  size_t stride = 4 * (st->channels - 1);
+  size_t n = 1;
+  while (n < st->samples_per_block) {
+    for (int b = 0; b < 4 && n < st->samples_per_block; b++) {
+      int16_t lo = adpcm_expand(&ch, data[b] & 0x0F);
+      out[n] = mix ? (int16_t)((out[n] + lo) >> 1) : lo;
+      n++;
+      if (n >= st->samples_per_block) {
+        break;
+      }
+      int16_t hi = adpcm_expand(&ch, data[b] >> 4);
+      out[n] = mix ? (int16_t)((out[n] + hi) >> 1) : hi;
+      n++;
+    }
+    data += 4 + stride;
+  }
+}
+
+// Read and decode the next block, false at the end of the data
+static bool adpcm_next_block(adpcm_state_t *st, readahead_t *stream) {
+  size_t got = readahead_read(stream, st->block, st->block_align);
+  if (got < 4u * st->channels) {
+    return false;
+  }
+  // The last block can be short, pad it so it decodes as silence
+  if (got < st->block_align) {
+    memset(st->block + got, 0, st->block_align - got);
+  }
+
+  for (int c = 0; c < st->channels; c++) {
+    adpcm_decode_channel(st, c, st->pcm, c > 0);
+  }
+  st->pcm_len = st->samples_per_block;
+  st->pcm_pos = 0;
+  return true;
+}
+
+static bool adpcm_probe(const uint8_t *header, size_t len) {
+  return riff_is_wave(header, len);
+}
+
+static esp_err_t adpcm_open(decoder_t *dec) {
+  riff_wave_info_t info;
+
+  esp_err_t ret = riff_parse_wave(dec->stream, &info);
+  if (ret != ESP_OK) {
+    return ret;
+  }
+  if (info.format_tag != WAV_FORMAT_IMA_ADPCM) {
+    return ESP_ERR_NOT_SUPPORTED;
+  }
+  if (info.bits_per_sample != 4 || (info.channels != 1 && info.channels != 2)) {
+    ESP_LOGE(TAG, "Unsupported %u bits %u channels", info.bits_per_sample,
+             info.channels);
+    return ESP_ERR_NOT_SUPPORTED;
+  }
+
+  // Every channel has a 4 byte header and then 4 byte groups
+  uint32_t data_bytes = info.block_align - 4u * info.channels;
+  if (info.block_align <= 4u * info.channels ||
+      data_bytes % (4u * info.channels) != 0 || info.sample_rate == 0) {
+    ESP_LOGE(TAG, "Inconsistent block align %u", info.block_align);
+    return ESP_ERR_INVALID_RESPONSE;
+  }
+  uint32_t samples_per_block = data_bytes * 2 / info.channels + 1;
+  if (samples_per_block > UINT16_MAX) {
+    // Mono blocks over 32 KB, the decoded block wouldn't fit the state
+    ESP_LOGE(TAG, "Blocks of %" PRIu32 " samples are too long",
+             samples_per_block);
+    return ESP_ERR_NOT_SUPPORTED;
+  }
+  if (info.samples_per_block != 0 &&
+      info.samples_per_block != samples_per_block) {
+    ESP_LOGW(TAG, "fmt says %u samples per block, using %" PRIu32,
+             info.samples_per_block, samples_per_block);
+  }
+
+  adpcm_state_t *st = calloc(1, sizeof(adpcm_state_t));
+  if (st == NULL) {
+    return ESP_ERR_NO_MEM;
+  }
+  st->channels = info.channels;
+  st->block_align = info.block_align;
+  st->samples_per_block = (uint16_t)samples_per_block;
+  st->data_start = info.data_start;
+  st->block = malloc(info.block_align);
+  st->pcm = malloc(samples_per_block * sizeof(int16_t));
+  if (st->block == NULL || st->pcm == NULL) {
+    free(st->block);
+    free(st->pcm);
+    free(st);
+    return ESP_ERR_NO_MEM;
+  }
+
+  // The fact chunk has the exact length, otherwise the last block counts
+  // as full
+  uint32_t blocks = (info.data_size + info.block_align - 1) / info.block_align;
+  st->frames_left = info.fact_frames ? info.fact_frames
+                                     : blocks * samples_per_block;
+  dec->priv = st;
+
+  dec->format.sample_rate = info.sample_rate;
+  dec->format.channels = info.channels;
+  dec->format.bits_per_sample = 4;
+  dec->format.total_frames = st->frames_left;
+  return ESP_OK;
+}
+
+static size_t adpcm_decode(decoder_t *dec, int16_t *dst, size_t max_frames) {
+  adpcm_state_t *st = dec->priv;
+  size_t done = 0;
+
+  if (max_frames > st->frames_left) {
+    max_frames = st->frames_left;
+  }
+
+  while (done < max_frames) {
+    if (st->pcm_pos == st->pcm_len && !adpcm_next_block(st, dec->stream)) {
+      st->frames_left = 0;
+      break;
+    }
+    size_t n = st->pcm_len - st->pcm_pos;
+    if (n > max_frames - done) {
+      n = max_frames - done;
+    }
+    memcpy(dst + done, st->pcm + st->pcm_pos, n * sizeof(int16_t));
+    st->pcm_pos += n;
+    done += n;
+  }
+
+  st->frames_left -= done < st->frames_left ? done : st->frames_left;
+  return done;
+}
+
+static esp_err_t adpcm_seek(decoder_t *dec, uint32_t frame) {
+  adpcm_state_t *st = dec->priv;
+
+  if (frame > dec->format.total_frames) {
+    frame = dec->format.total_frames;
+  }
+  uint32_t block = frame / st->samples_per_block;
+  long offset = (long)st->data_start + (long)block * st->block_align;
+  if (readahead_seek(dec->stream, offset, SEEK_SET) != ESP_OK) {
+    return ESP_FAIL;
+  }
+
+  // Blocks restart the predictor so decoding can start at any of them
+  st->pcm_len = 0;
+  st->pcm_pos = 0;
+  st->frames_left = dec->format.total_frames - block * st->samples_per_block;
+  uint32_t skip = frame - block * st->samples_per_block;
+  if (skip > 0) {
+    if (!adpcm_next_block(st, dec->stream)) {
+      st->frames_left = 0;
+      return ESP_OK;
+    }
+    st->pcm_pos = (uint16_t)skip;
+    st->frames_left -= skip;
+  }
+  return ESP_OK;
+}
+
+static void adpcm_close(decoder_t *dec) {
+  adpcm_state_t *st = dec->priv;
+  if (st) {
+    free(st->block);
+    free(st->pcm);
+    free(st);
+  }
+}
+
+static const char *const adpcm_extensions[] = {"wav", NULL};
+
+const decoder_ops_t decoder_ima_adpcm = {
+    .name = "ima_adpcm",
+    .extensions = adpcm_extensions,
+    .probe = adpcm_probe,
+    .open = adpcm_open,
+    .decode = adpcm_decode,
+    .seek = adpcm_seek,
+    .close = adpcm_close,
+};
@@ -0,0 +1,383 @@
+#include "decoder.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "mp3dec.h"
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *TAG = "DEC_MP3";
+
+// Streaming MPEG audio layer III decoder on top of the fixed point Helix
+// decoder. Frames are decoded one at a time into a frame sized PCM buffer
+// (mixed down to mono in place) that decode() hands out in pieces. ID3v2 at
+// the start and ID3v1 at the end are skipped, VBR files just work and if they
+// carry a Xing/Info header it gives the length and a seek table.
+//
+// RAM while a song plays: the Helix state (~24 KB), the input buffer and one
+// frame of PCM, all on the heap and freed on close.
+
+// Room for two of the largest frames, so one full frame plus its bit
+// reservoir is always available after a refill
+#define MP3_INBUF_SIZE (2 * MAINBUF_SIZE)
+#define MP3_PCM_SIZE (MAX_NCHAN * MAX_NGRAN * MAX_NSAMP)
+
+#define XING_FLAG_FRAMES 0x01
+#define XING_FLAG_BYTES 0x02
+#define XING_FLAG_TOC 0x04
+
+typedef struct {
+    HMP3Decoder hmp3;
+    uint32_t data_start;      // First byte after the ID3v2 tag
+    uint32_t data_end;        // First byte of the ID3v1 tag or file size
+    uint32_t file_pos;        // Next byte to read into inbuf
+    uint8_t *inbuf;
+    uint8_t *in_ptr;          // Next byte to decode inside inbuf
+    int in_left;              // Bytes left to decode from in_ptr
+    int16_t *pcm;             // Last frame decoded, mono
+    uint16_t pcm_len;
+    uint16_t pcm_pos;
+    uint16_t samples_per_frame;
+    uint32_t bitrate;         // Of the first frame, for CBR seeks
+    bool has_toc;
+    uint8_t toc[100];         // Xing seek table, % of the file per % of time
+    uint32_t frames_decoded;  // To report the decode speed
+    int64_t decode_time_us;
+} mp3_state_t;
+
+static inline uint32_t rd_be32(const uint8_t *p) {
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+         ((uint32_t)p[2] << 8) | p[3];
+}
+
+static bool is_frame_sync(const uint8_t *p) {
+  // 11 bit sync, layer III
+  return p[0] == 0xFF && (p[1] & 0xE0) == 0xE0 && ((p[1] >> 1) & 0x03) == 1;
+}
+
+// ID3v2 tag length including its header (and footer), 0 if there is none
+static uint32_t id3v2_size(const uint8_t *p, size_t len) {
+  if (len < 10 || memcmp(p, "ID3", 3) != 0) {
+    return 0;
+  }
+  uint32_t size = ((uint32_t)(p[6] & 0x7F) << 21) |
+                  ((uint32_t)(p[7] & 0x7F) << 14) |
+                  ((uint32_t)(p[8] & 0x7F) << 7) | (p[9] & 0x7F);
+  return size + 10 + ((p[5] & 0x10) ? 10 : 0);
+}
+
+// Move what is left to the start of inbuf and top it up from the file
+static void mp3_refill(decoder_t *dec, mp3_state_t *st) {
+  if (st->in_left > 0 && st->in_ptr != st->inbuf) {
+    memmove(st->inbuf, st->in_ptr, st->in_left);
+  }
+  st->in_ptr = st->inbuf;
+
+  size_t room = MP3_INBUF_SIZE - st->in_left;
+  if (room > st->data_end - st->file_pos) {
+    room = st->data_end - st->file_pos;
+  }
+  if (room == 0) {
+    return;
+  }
+  size_t got = readahead_read(dec->stream, st->inbuf + st->in_left, room);
+  st->in_left += got;
+  st->file_pos += got;
+  if (got < room) {
+    // Truncated file, behave as if it ended here
+    st->data_end = st->file_pos;
+  }
+}
+
+// Decode the next frame into st->pcm, false once there are no more
+static bool mp3_next_frame(decoder_t *dec, mp3_state_t *st) {
+  while (1) {
+    if (st->in_left < MAINBUF_SIZE) {
+      mp3_refill(dec, st);
+    }
+    bool at_end = st->file_pos >= st->data_end;
+
+    int offset = MP3FindSyncWord(st->in_ptr, st->in_left);
+    if (offset < 0) {
+      if (at_end) {
+        return false;
+      }
+      // Garbage, keep the last byte in case it is half a sync word
+      if (st->in_left > 1) {
+        st->in_ptr += st->in_left - 1;
+        st->in_left = 1;
+      }
+      continue;
+    }
+    st->in_ptr += offset;
+    st->in_left -= offset;
+
+    int64_t start = esp_timer_get_time();
+    int err = MP3Decode(st->hmp3, &st->in_ptr, &st->in_left, st->pcm, 0);
+    st->decode_time_us += esp_timer_get_time() - start;
+
+    if (err == ERR_MP3_INDATA_UNDERFLOW) {
+      if (at_end) {
+        return false;
+      }
+      if (st->in_left >= MP3_INBUF_SIZE / 2) {
+        // Not a real frame, a full buffer should hold any of them
+        st->in_ptr++;
+        st->in_left--;
+      }
+      mp3_refill(dec, st);
+      continue;
+    }
+    if (err == ERR_MP3_MAINDATA_UNDERFLOW) {
+      // Bit reservoir still filling, normal right after a seek
+      continue;
+    }
+    if (err != ERR_MP3_NONE) {
+      // Broken frame or false sync, resync one byte further
+      ESP_LOGD(TAG, "Frame error %d, resyncing", err);
+      st->in_ptr++;
+      st->in_left--;
+      continue;
+    }
+
+    MP3FrameInfo info;
+    MP3GetLastFrameInfo(st->hmp3, &info);
+    if (info.nChans == 2) {
+      size_t frames = info.outputSamps / 2;
+      for (size_t i = 0; i < frames; i++) {
+        st->pcm[i] =
+            (int16_t)(((int32_t)st->pcm[2 * i] + st->pcm[2 * i + 1]) >> 1);
+      }
+      st->pcm_len = (uint16_t)frames;
+    } else {
+      st->pcm_len = (uint16_t)info.outputSamps;
+    }
+    st->pcm_pos = 0;
+    st->frames_decoded++;
+    return true;
+  }
+}
+
+// A Xing/Info frame is a silent first frame carrying the VBR info, parse it
+// and skip it
+static void mp3_parse_xing(decoder_t *dec, mp3_state_t *st,
+                           const MP3FrameInfo *info) {
+  const uint8_t *frame = st->in_ptr;
+  int side_info;
+  if (info->version == MPEG1) {
+    side_info = info->nChans == 2 ? 32 : 17;
+  } else {
+    side_info = info->nChans == 2 ? 17 : 9;
+  }
+
+  const uint8_t *xing = frame + 4 + side_info;
+  if (st->in_left < 4 + side_info + 8 + 4 + 4 + 100 ||
+      (memcmp(xing, "Xing", 4) != 0 && memcmp(xing, "Info", 4) != 0)) {
+    return;
+  }
+
+  uint32_t flags = rd_be32(xing + 4);
+  const uint8_t *p = xing + 8;
+  if (flags & XING_FLAG_FRAMES) {
+    dec->format.total_frames = rd_be32(p) * st->samples_per_frame;
+    p += 4;
+  }
+  if (flags & XING_FLAG_BYTES) {
+    p += 4;
+  }
+  if (flags & XING_FLAG_TOC) {
+    memcpy(st->toc, p, sizeof(st->toc));
+    st->has_toc = true;
+  }
+
+  // Skip the whole frame, its length comes from bitrate and padding
+  uint32_t frame_len =
+      (info->version == MPEG1 ? 144 : 72) * info->bitrate / info->samprate +
+      ((frame[2] >> 1) & 0x01);
+  if ((int)frame_len <= st->in_left) {
+    st->in_ptr += frame_len;
+    st->in_left -= frame_len;
+  }
+}
+
+static bool mp3_probe(const uint8_t *header, size_t len) {
+  return id3v2_size(header, len) > 0 || (len >= 2 && is_frame_sync(header));
+}
+
+static esp_err_t mp3_open(decoder_t *dec) {
+  uint8_t tag[10];
+
+  mp3_state_t *st = calloc(1, sizeof(mp3_state_t));
+  if (st == NULL) {
+    return ESP_ERR_NO_MEM;
+  }
+  st->inbuf = malloc(MP3_INBUF_SIZE);
+  st->pcm = malloc(MP3_PCM_SIZE * sizeof(int16_t));
+  st->hmp3 = MP3InitDecoder();
+  if (st->inbuf == NULL || st->pcm == NULL || st->hmp3 == NULL) {
+    goto no_mem;
+  }
+  dec->priv = st;
+
+  // Data ends before an ID3v1 tag, if any
+  long size = readahead_size(dec->stream);
+  st->data_end = size > 0 ? (uint32_t)size : 0;
+  if (size >= 128 && readahead_seek(dec->stream, -128, SEEK_END) == ESP_OK &&
+      readahead_read(dec->stream, tag, 3) == 3 &&
+      memcmp(tag, "TAG", 3) == 0) {
+    st->data_end -= 128;
+  }
+
+  // And starts after the ID3v2 tag
+  readahead_seek(dec->stream, 0, SEEK_SET);
+  size_t got = readahead_read(dec->stream, tag, sizeof(tag));
+  st->data_start = id3v2_size(tag, got);
+  if (st->data_start >= st->data_end ||
+      readahead_seek(dec->stream, st->data_start, SEEK_SET) != ESP_OK) {
+    ESP_LOGE(TAG, "No audio after the ID3 tag");
+    goto bad_file;
+  }
+  st->file_pos = st->data_start;
+  st->in_ptr = st->inbuf;
+  mp3_refill(dec, st);
+
+  int offset = MP3FindSyncWord(st->in_ptr, st->in_left);
+  MP3FrameInfo info;
+  if (offset < 0 ||
+      MP3GetNextFrameInfo(st->hmp3, &info, st->in_ptr + offset) !=
+          ERR_MP3_NONE ||
+      info.layer != 3) {
+    ESP_LOGE(TAG, "No MPEG layer III frame found");
+    goto bad_file;
+  }
+  st->in_ptr += offset;
+  st->in_left -= offset;
+
+  st->samples_per_frame = info.version == MPEG1 ? 1152 : 576;
+  st->bitrate = info.bitrate;
+  dec->format.sample_rate = info.samprate;
+  dec->format.channels = info.nChans;
+  dec->format.bits_per_sample = 16;
+  mp3_parse_xing(dec, st, &info);
+
+  // Without a Xing header assume CBR for the length
+  if (dec->format.total_frames == 0 && st->bitrate > 0) {
+    uint64_t bytes = st->data_end - st->data_start;
+    dec->format.total_frames =
+        (uint32_t)(bytes * 8 * info.samprate / st->bitrate);
+  }
+
+  ESP_LOGI(TAG, "%d kbps%s, %" PRIu32 " frames", info.bitrate / 1000,
+           st->has_toc ? " VBR" : "", dec->format.total_frames);
+  return ESP_OK;
+
+bad_file:
+  MP3FreeDecoder(st->hmp3);
+  free(st->inbuf);
+  free(st->pcm);
+  free(st);
+  dec->priv = NULL;
+  return ESP_ERR_INVALID_RESPONSE;
+
+no_mem:
+  if (st->hmp3) {
+    MP3FreeDecoder(st->hmp3);
+  }
+  free(st->inbuf);
+  free(st->pcm);
+  free(st);
+  return ESP_ERR_NO_MEM;
+}
+
+static size_t mp3_decode(decoder_t *dec, int16_t *dst, size_t max_frames) {
+  mp3_state_t *st = dec->priv;
+  size_t done = 0;
+
+  while (done < max_frames) {
+    if (st->pcm_pos == st->pcm_len && !mp3_next_frame(dec, st)) {
+      break;
+    }
+    size_t n = st->pcm_len - st->pcm_pos;
+    if (n > max_frames - done) {
+      n = max_frames - done;
+    }
+    memcpy(dst + done, st->pcm + st->pcm_pos, n * sizeof(int16_t));
+    st->pcm_pos += n;
+    done += n;
+  }
+
+  return done;
+}
+
+static esp_err_t mp3_seek(decoder_t *dec, uint32_t frame) {
+  mp3_state_t *st = dec->priv;
+  uint32_t total = dec->format.total_frames;
+  uint32_t span = st->data_end - st->data_start;
+  uint32_t offset = 0;
+
+  if (total == 0) {
+    return ESP_ERR_NOT_SUPPORTED;
+  }
+  if (frame > total) {
+    frame = total;
+  }
+
+  if (st->has_toc) {
+    // The table maps each percent of the time to a 1/256 of the file
+    uint32_t percent = (uint32_t)((uint64_t)frame * 100 / total);
+    if (percent > 99) {
+      percent = 99;
+    }
+    offset = (uint32_t)((uint64_t)st->toc[percent] * span / 256);
+  } else {
+    offset = (uint32_t)((uint64_t)frame * span / total);
+  }
+
+  if (readahead_seek(dec->stream, st->data_start + offset, SEEK_SET) !=
+      ESP_OK) {
+    return ESP_FAIL;
+  }
+  // Decoding resyncs on the next frame header, the first frames may be
+  // dropped until the bit reservoir refills
+  st->file_pos = st->data_start + offset;
+  st->in_ptr = st->inbuf;
+  st->in_left = 0;
+  st->pcm_len = 0;
+  st->pcm_pos = 0;
+  return ESP_OK;
+}
+
+static void mp3_close(decoder_t *dec) {
+  mp3_state_t *st = dec->priv;
+  if (st == NULL) {
+    return;
+  }
+
+  // Real time factor of the decoding itself, audio time per CPU time
+  if (st->decode_time_us > 0 && dec->format.sample_rate > 0) {
+    uint64_t audio_us = (uint64_t)st->frames_decoded * st->samples_per_frame *
+                        1000000 / dec->format.sample_rate;
+    ESP_LOGI(TAG, "%" PRIu32 " frames in %" PRId64 " ms, %" PRIu64
+             ".%02" PRIu64 "x real time",
+             st->frames_decoded, st->decode_time_us / 1000,
+             audio_us / st->decode_time_us,
+             (audio_us * 100 / st->decode_time_us) % 100);
+  }
+
+  MP3FreeDecoder(st->hmp3);
+  free(st->inbuf);
+  free(st->pcm);
+  free(st);
+}
+
+static const char *const mp3_extensions[] = {"mp3", NULL};
+
+const decoder_ops_t decoder_mp3 = {
+    .name = "mp3",
+    .extensions = mp3_extensions,
+    .probe = mp3_probe,
+    .open = mp3_open,
+    .decode = mp3_decode,
+    .seek = mp3_seek,
+    .close = mp3_close,
+};
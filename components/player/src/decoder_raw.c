@@ -0,0 +1,75 @@
+#include "decoder.h"
+#include "sdkconfig.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Headerless 8 bit unsigned mono PCM at the configured output rate, what the
+// player used to assume for every file
+
+#define RAW_CHUNK 256
+
+typedef struct {
+    uint8_t inbuf[RAW_CHUNK];
+} raw_state_t;
+
+// Anything without a known header, except RIFF files a WAV decoder refused,
+// decoder_open only tries it with one of the raw extensions
+static bool raw_probe(const uint8_t *header, size_t len) {
+  return len < 4 || memcmp(header, "RIFF", 4) != 0;
+}
+
+static esp_err_t raw_open(decoder_t *dec) {
+  raw_state_t *st = malloc(sizeof(raw_state_t));
+  if (st == NULL) {
+    return ESP_ERR_NO_MEM;
+  }
+  dec->priv = st;
+
+  long size = readahead_size(dec->stream);
+
+  dec->format.sample_rate = CONFIG_MPLAYER_SAMPLE_RATE;
+  dec->format.channels = 1;
+  dec->format.bits_per_sample = 8;
+  dec->format.total_frames = size > 0 ? (uint32_t)size : 0;
+  return ESP_OK;
+}
+
+static size_t raw_decode(decoder_t *dec, int16_t *dst, size_t max_frames) {
+  raw_state_t *st = dec->priv;
+  size_t done = 0;
+
+  while (done < max_frames) {
+    size_t wanted = max_frames - done;
+    if (wanted > RAW_CHUNK) {
+      wanted = RAW_CHUNK;
+    }
+    size_t got = readahead_read(dec->stream, st->inbuf, wanted);
+    for (size_t i = 0; i < got; i++) {
+      dst[done + i] = (int16_t)((st->inbuf[i] - 128) * 256);
+    }
+    done += got;
+    if (got < wanted) {
+      break;
+    }
+  }
+
+  return done;
+}
+
+static esp_err_t raw_seek(decoder_t *dec, uint32_t frame) {
+  return readahead_seek(dec->stream, (long)frame, SEEK_SET);
+}
+
+static void raw_close(decoder_t *dec) { free(dec->priv); }
+
+static const char *const raw_extensions[] = {"raw", "u8", NULL};
+
+const decoder_ops_t decoder_raw = {
+    .name = "raw",
+    .extensions = raw_extensions,
+    .probe = raw_probe,
+    .open = raw_open,
+    .decode = raw_decode,
+    .seek = raw_seek,
+    .close = raw_close,
+};
@@ -0,0 +1,152 @@
+#include "decoder.h"
+#include "esp_log.h"
+#include "riff.h"
+#include <stdlib.h>
+#include <string.h>
+
+static const char *TAG = "DEC_WAV";
+
+// Streaming RIFF/WAVE decoder for uncompressed PCM: 8 bit unsigned or 16 bit
+// signed, mono or stereo (mixed down), any sample rate
+
+// Raw bytes read per call, 256 stereo 16 bit frames
+#define WAV_INBUF_SIZE 1024
+
+typedef struct {
+    uint16_t block_align;   // Bytes per frame
+    uint32_t data_start;    // File offset of the first frame
+    uint32_t frames_left;   // Frames until the end of the data chunk
+    uint8_t inbuf[WAV_INBUF_SIZE];
+} wav_state_t;
+
+static bool wav_probe(const uint8_t *header, size_t len) {
+  return riff_is_wave(header, len);
+}
+
+static esp_err_t wav_open(decoder_t *dec) {
+  riff_wave_info_t info;
+
+  esp_err_t ret = riff_parse_wave(dec->stream, &info);
+  if (ret != ESP_OK) {
+    return ret;
+  }
+
+  // Other WAV flavours are left to their own decoders
+  if (info.format_tag != WAV_FORMAT_PCM) {
+    return ESP_ERR_NOT_SUPPORTED;
+  }
+  if (info.bits_per_sample != 8 && info.bits_per_sample != 16) {
+    ESP_LOGE(TAG, "Unsupported %u bits per sample", info.bits_per_sample);
+    return ESP_ERR_NOT_SUPPORTED;
+  }
+  if (info.channels != 1 && info.channels != 2) {
+    ESP_LOGE(TAG, "Unsupported %u channels", info.channels);
+    return ESP_ERR_NOT_SUPPORTED;
+  }
+  if (info.sample_rate == 0 ||
+      info.block_align != info.channels * (info.bits_per_sample / 8)) {
+    ESP_LOGE(TAG, "Inconsistent fmt chunk");
+    return ESP_ERR_INVALID_RESPONSE;
+  }
+
+  wav_state_t *st = calloc(1, sizeof(wav_state_t));
+  if (st == NULL) {
+    return ESP_ERR_NO_MEM;
+  }
+  st->block_align = info.block_align;
+  st->data_start = info.data_start;
+  st->frames_left = info.data_size / info.block_align;
+  dec->priv = st;
+
+  dec->format.sample_rate = info.sample_rate;
+  dec->format.channels = info.channels;
+  dec->format.bits_per_sample = info.bits_per_sample;
+  dec->format.total_frames = st->frames_left;
+  return ESP_OK;
+}
+
+static size_t wav_decode(decoder_t *dec, int16_t *dst, size_t max_frames) {
+  wav_state_t *st = dec->priv;
+  size_t done = 0;
+
+  if (max_frames > st->frames_left) {
+    max_frames = st->frames_left;
+  }
+
+  while (done < max_frames) {
+    size_t frames = max_frames - done;
+    if (frames > WAV_INBUF_SIZE / st->block_align) {
+      frames = WAV_INBUF_SIZE / st->block_align;
+    }
+
+    size_t got = readahead_read(dec->stream, st->inbuf,
+                                frames * st->block_align) /
+                 st->block_align;
+    const uint8_t *in = st->inbuf;
+    int16_t *out = dst + done;
+
+    switch (st->block_align) {
+    case 1: // 8 bit mono
+      for (size_t i = 0; i < got; i++) {
+        out[i] = (int16_t)((in[i] - 128) * 256);
+      }
+      break;
+    case 2:
+      if (dec->format.channels == 1) { // 16 bit mono
+        for (size_t i = 0; i < got; i++) {
+          out[i] = (int16_t)riff_le16(in + 2 * i);
+        }
+      } else { // 8 bit stereo
+        for (size_t i = 0; i < got; i++) {
+          out[i] = (int16_t)((in[2 * i] + in[2 * i + 1] - 256) * 128);
+        }
+      }
+      break;
+    case 4: // 16 bit stereo
+      for (size_t i = 0; i < got; i++) {
+        int32_t l = (int16_t)riff_le16(in + 4 * i);
+        int32_t r = (int16_t)riff_le16(in + 4 * i + 2);
+        out[i] = (int16_t)((l + r) >> 1);
+      }
+      break;
+    }
+
+    done += got;
+    st->frames_left -= got;
+    if (got < frames) {
+      // Truncated data chunk, nothing else will come
+      st->frames_left = 0;
+      break;
+    }
+  }
+
+  return done;
+}
+
+static esp_err_t wav_seek(decoder_t *dec, uint32_t frame) {
+  wav_state_t *st = dec->priv;
+
+  if (frame > dec->format.total_frames) {
+    frame = dec->format.total_frames;
+  }
+  long offset = (long)st->data_start + (long)frame * st->block_align;
+  if (readahead_seek(dec->stream, offset, SEEK_SET) != ESP_OK) {
+    return ESP_FAIL;
+  }
+  st->frames_left = dec->format.total_frames - frame;
+  return ESP_OK;
+}
+
+static void wav_close(decoder_t *dec) { free(dec->priv); }
+
+static const char *const wav_extensions[] = {"wav", NULL};
+
+const decoder_ops_t decoder_wav = {
+    .name = "wav",
+    .extensions = wav_extensions,
+    .probe = wav_probe,
+    .open = wav_open,
+    .decode = wav_decode,
+    .seek = wav_seek,
+    .close = wav_close,
+};
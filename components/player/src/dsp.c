@@ -0,0 +1,103 @@
+#include "dsp.h"
+
+// Everything is done on 16 bit values, the 8 bit output being the top byte.
+// Dither is the sum of two uniform values of one 8 bit step each, so it
+// spans +-1 output step with a triangular distribution, and the rounding
+// error of every sample is subtracted from the next one which moves the
+// noise to the top of the band where the DAC filtering and the ear care
+// less.
+
+void dsp_init(dsp_t *dsp, uint32_t gain) {
+  dsp->gain = (int32_t)gain << 8;
+  dsp->target = dsp->gain;
+  dsp->gain_step = 0;
+  dsp->fade_pos = 0;
+  dsp->fade_len = 0;
+  dsp_reset(dsp);
+}
+
+void dsp_reset(dsp_t *dsp) {
+  dsp->error = 0;
+  dsp->seed = 1;
+}
+
+void dsp_set_gain(dsp_t *dsp, uint32_t gain) {
+  int32_t target = (int32_t)gain << 8;
+  if (target == dsp->target) {
+    return;
+  }
+  dsp->target = target;
+  dsp->gain_step = (target - dsp->gain) / DSP_GAIN_RAMP;
+  if (dsp->gain_step == 0) {
+    dsp->gain = target;
+  }
+}
+
+void dsp_fade_in(dsp_t *dsp, uint32_t samples) {
+  dsp->fade_pos = 0;
+  dsp->fade_len = samples;
+}
+
+void dsp_process(dsp_t *dsp, const int16_t *in, size_t frames, uint8_t *out) {
+  int32_t gain = dsp->gain;
+  int32_t error = dsp->error;
+  uint32_t seed = dsp->seed;
+
+  for (size_t i = 0; i < frames; i++) {
+    if (gain != dsp->target) {
+      gain += dsp->gain_step;
+      if ((dsp->gain_step > 0) == (gain > dsp->target)) {
+        gain = dsp->target;
+      }
+    }
+    int32_t x = (in[i] * (gain >> 8)) >> 15;
+
+    if (dsp->fade_len > 0) {
+      int32_t fade = (int32_t)(((uint64_t)dsp->fade_pos << 15) / dsp->fade_len);
+      x = (x * fade) >> 15;
+      if (++dsp->fade_pos == dsp->fade_len) {
+        dsp->fade_len = 0;
+      }
+    }
+
+    x -= error;
+    seed = seed * 1664525 + 1013904223;
+    int32_t dither = (int32_t)(seed >> 24) + (int32_t)((seed >> 16) & 0xFF) -
+                     255;
+    int32_t q = (x + dither + 128) >> 8;
+    if (q > 127) {
+      q = 127;
+      error = 0; // Clipping, feeding that back would only make it worse
+    } else if (q < -128) {
+      q = -128;
+      error = 0;
+    } else {
+      error = q * 256 - x;
+    }
+    out[i] = (uint8_t)(q + 128);
+  }
+
+  dsp->gain = gain;
+  dsp->error = error;
+  dsp->seed = seed;
+}
+
+static inline uint8_t scale_u8(uint8_t sample, int32_t gain) {
+  return (uint8_t)(128 + ((((int32_t)sample - 128) * gain) >> 15));
+}
+
+void dsp_fade_in_u8(uint8_t *buf, size_t len, uint32_t pos,
+                    uint32_t fade_len) {
+  for (size_t i = 0; i < len && pos < fade_len; i++, pos++) {
+    buf[i] = scale_u8(buf[i], (int32_t)(((uint64_t)pos << 15) / fade_len));
+  }
+}
+
+void dsp_fade_out_u8(uint8_t *buf, size_t len, uint32_t pos,
+                     uint32_t fade_len) {
+  for (size_t i = 0; i < len; i++, pos++) {
+    int32_t gain = pos < fade_len ?
+        (int32_t)(((uint64_t)(fade_len - pos) << 15) / fade_len) : 0;
+    buf[i] = scale_u8(buf[i], gain);
+  }
+}
@@ -0,0 +1,543 @@
+#include "library.h"
+#include "decoder.h"
+#include "esp_check.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "ff.h"
+#include "readahead.h"
+#include "sdcard.h"
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *TAG = "LIBRARY";
+
+#define INDEX_MAGIC 0x494c504dU // "MPLI"
+#define INDEX_VERSION 2
+#define TMP_SUFFIX ".tmp"
+#define DIR_PATH_LEN (LIBRARY_PATH_LEN + 64)
+#define LOOKAHEAD 32 // Old records searched for a song that is not in place
+
+// Start of the index file, the records follow it
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t entry_size;
+    uint32_t count;
+    uint32_t names_size;
+} index_header_t;
+
+// An index read one record at a time
+typedef struct {
+    FILE *records;
+    FILE *names;
+    index_header_t hdr;
+} reader_t;
+
+// Everything a walk through the tree needs, allocated once so the memory
+// used does not depend on the size of the library
+typedef struct {
+    const char *dir_path;
+    bool probe;
+    bool writing;       // Writing the new index, else only comparing
+    bool changed;
+    reader_t old;       // Current index, `records` NULL if there is none
+    uint32_t cursor;    // Next old record expected
+    FILE *records;      // New index while writing
+    FILE *names;
+    index_header_t hdr; // Of the new index
+    uint32_t reused;
+    uint32_t probed;
+    int depth;
+    FF_DIR dirs[LIBRARY_MAX_DEPTH];
+    size_t path_len[LIBRARY_MAX_DEPTH]; // Length of `path` at each depth
+    FILINFO info;
+    char root[DIR_PATH_LEN];          // FatFs path of the library
+    char fatfs_path[DIR_PATH_LEN];    // FatFs path of a subdirectory
+    char path[LIBRARY_PATH_LEN];      // Relative path being visited
+    char old_path[LIBRARY_PATH_LEN];  // Path of an old record
+} walk_t;
+
+static void index_path(char *out, size_t len, const char *dir_path,
+                       const char *name, bool tmp) {
+  snprintf(out, len, "%s/%s%s", dir_path, name, tmp ? TMP_SUFFIX : "");
+}
+
+static long file_size(FILE *file) {
+  if (fseek(file, 0, SEEK_END) != 0) {
+    return -1;
+  }
+  return ftell(file);
+}
+
+static void reader_close(reader_t *r) {
+  if (r->records) {
+    fclose(r->records);
+  }
+  if (r->names) {
+    fclose(r->names);
+  }
+  memset(r, 0, sizeof(*r));
+}
+
+// Open an index checking its header against the size of both files, the
+// header is written last so a half written index never passes
+static esp_err_t reader_open(reader_t *r, const char *dir_path) {
+  char path[DIR_PATH_LEN];
+
+  memset(r, 0, sizeof(*r));
+  index_path(path, sizeof(path), dir_path, LIBRARY_INDEX_NAME, false);
+  r->records = fopen(path, "rb");
+  index_path(path, sizeof(path), dir_path, LIBRARY_NAMES_NAME, false);
+  r->names = fopen(path, "rb");
+  if (r->records == NULL || r->names == NULL ||
+      fread(&r->hdr, sizeof(r->hdr), 1, r->records) != 1) {
+    reader_close(r);
+    return ESP_ERR_NOT_FOUND;
+  }
+
+  const index_header_t *hdr = &r->hdr;
+  if (hdr->magic != INDEX_MAGIC || hdr->version != INDEX_VERSION ||
+      hdr->entry_size != sizeof(library_entry_t) ||
+      file_size(r->records) != (long)(sizeof(index_header_t) +
+                                      hdr->count * sizeof(library_entry_t)) ||
+      file_size(r->names) != (long)hdr->names_size) {
+    ESP_LOGW(TAG, "Index of %s is not valid", dir_path);
+    reader_close(r);
+    return ESP_ERR_NOT_FOUND;
+  }
+  return ESP_OK;
+}
+
+static esp_err_t read_name(FILE *names, uint32_t names_size, uint32_t offset,
+                           char *path) {
+  if (offset >= names_size) {
+    return ESP_ERR_INVALID_SIZE;
+  }
+  size_t len = names_size - offset;
+  if (len > LIBRARY_PATH_LEN) {
+    len = LIBRARY_PATH_LEN;
+  }
+  if (fseek(names, offset, SEEK_SET) != 0 ||
+      fread(path, 1, len, names) != len) {
+    return ESP_FAIL;
+  }
+  return memchr(path, '\0', len) ? ESP_OK : ESP_ERR_INVALID_SIZE;
+}
+
+static esp_err_t reader_get(reader_t *r, uint32_t idx, library_entry_t *entry,
+                            char *path) {
+  long pos = sizeof(index_header_t) + (long)idx * sizeof(library_entry_t);
+  if (idx >= r->hdr.count || fseek(r->records, pos, SEEK_SET) != 0 ||
+      fread(entry, sizeof(*entry), 1, r->records) != 1) {
+    return ESP_FAIL;
+  }
+  return read_name(r->names, r->hdr.names_size, entry->name_offset, path);
+}
+
+static library_format_t format_of(const decoder_ops_t *ops) {
+  if (ops == &decoder_wav) {
+    return LIBRARY_FORMAT_WAV;
+  } else if (ops == &decoder_ima_adpcm) {
+    return LIBRARY_FORMAT_IMA_ADPCM;
+#if CONFIG_MPLAYER_DECODER_MP3
+  } else if (ops == &decoder_mp3) {
+    return LIBRARY_FORMAT_MP3;
+#endif
+  } else if (ops == &decoder_raw) {
+    return LIBRARY_FORMAT_RAW;
+  }
+  return LIBRARY_FORMAT_UNSUPPORTED;
+}
+
+// Open the song with the decoders to get its format and duration
+static void probe_song(const char *dir_path, const char *rel_path,
+                       library_entry_t *entry) {
+  char path[DIR_PATH_LEN];
+  if (snprintf(path, sizeof(path), "%s/%s", dir_path, rel_path) >=
+      (int)sizeof(path)) {
+    entry->format = LIBRARY_FORMAT_UNSUPPORTED;
+    return;
+  }
+
+  readahead_t *stream = readahead_open(path);
+  if (stream == NULL) {
+    // Left unknown, it is tried again on the next refresh
+    return;
+  }
+
+  decoder_t dec;
+  if (decoder_open(&dec, stream, path) == ESP_OK) {
+    entry->format = format_of(dec.ops);
+    if (dec.format.sample_rate > 0) {
+      entry->duration_ms = (uint32_t)((uint64_t)dec.format.total_frames *
+                                      1000 / dec.format.sample_rate);
+    }
+    decoder_close(&dec);
+  } else {
+    entry->format = LIBRARY_FORMAT_UNSUPPORTED;
+  }
+  readahead_close(stream);
+}
+
+// Look for the current path a few records ahead in the old index, songs
+// keep their order on the card so it is almost always the next one
+static bool find_old(walk_t *w, library_entry_t *old) {
+  uint32_t end = w->cursor + LOOKAHEAD;
+  if (end > w->old.hdr.count) {
+    end = w->old.hdr.count;
+  }
+  for (uint32_t i = w->cursor; i < end; i++) {
+    if (reader_get(&w->old, i, old, w->old_path) == ESP_OK &&
+        strcmp(w->old_path, w->path) == 0) {
+      w->cursor = i + 1;
+      return true;
+    }
+  }
+  return false;
+}
+
+static esp_err_t visit(walk_t *w) {
+  library_entry_t entry = {
+      .size = (uint32_t)w->info.fsize,
+      .mtime = (uint32_t)w->info.fdate << 16 | w->info.ftime,
+      .format = LIBRARY_FORMAT_UNKNOWN,
+  };
+  library_entry_t old;
+
+  if (!w->writing) {
+    // Only checking, the first difference is enough
+    if (reader_get(&w->old, w->cursor, &old, w->old_path) != ESP_OK ||
+        strcmp(w->old_path, w->path) != 0 || old.size != entry.size ||
+        old.mtime != entry.mtime ||
+        (w->probe && old.format == LIBRARY_FORMAT_UNKNOWN)) {
+      w->changed = true;
+    }
+    w->cursor++;
+    return ESP_OK;
+  }
+
+  if (w->old.records && find_old(w, &old) && old.size == entry.size &&
+      old.mtime == entry.mtime) {
+    entry.format = old.format;
+    entry.duration_ms = old.duration_ms;
+    w->reused++;
+  }
+  if (w->probe && entry.format == LIBRARY_FORMAT_UNKNOWN) {
+    probe_song(w->dir_path, w->path, &entry);
+    w->probed++;
+  }
+
+  size_t len = strlen(w->path) + 1;
+  entry.name_offset = w->hdr.names_size;
+  if (fwrite(&entry, sizeof(entry), 1, w->records) != 1 ||
+      fwrite(w->path, 1, len, w->names) != len) {
+    ESP_LOGE(TAG, "Failed to write the index");
+    return ESP_FAIL;
+  }
+  w->hdr.count++;
+  w->hdr.names_size += len;
+  return ESP_OK;
+}
+
+static esp_err_t open_dir(walk_t *w, int depth) {
+  const char *sep = w->root[strlen(w->root) - 1] == '/' ? "" : "/";
+  if (depth == 0) {
+    snprintf(w->fatfs_path, sizeof(w->fatfs_path), "%s", w->root);
+  } else if (snprintf(w->fatfs_path, sizeof(w->fatfs_path), "%s%s%s",
+                      w->root, sep, w->path) >= (int)sizeof(w->fatfs_path)) {
+    return ESP_ERR_INVALID_SIZE;
+  }
+  return f_opendir(&w->dirs[depth], w->fatfs_path) == FR_OK ? ESP_OK
+                                                            : ESP_FAIL;
+}
+
+// Depth first through the tree, subdirectories are walked as they are
+// found so the order only depends on the order of the directory entries
+static esp_err_t walk(walk_t *w) {
+  esp_err_t ret = ESP_OK;
+
+  w->cursor = 0;
+  w->path[0] = '\0';
+  w->path_len[0] = 0;
+  if (open_dir(w, 0) != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to open directory %s", w->dir_path);
+    return ESP_ERR_NOT_FOUND;
+  }
+  w->depth = 0;
+
+  while (w->depth >= 0 && (w->writing || !w->changed)) {
+    int d = w->depth;
+    if (f_readdir(&w->dirs[d], &w->info) != FR_OK) {
+      ESP_LOGE(TAG, "Failed to read directory %s", w->path);
+      ret = ESP_FAIL;
+      break;
+    }
+    if (w->info.fname[0] == '\0') {
+      // Done with this directory, back to its parent
+      f_closedir(&w->dirs[d]);
+      w->depth--;
+      if (w->depth >= 0) {
+        w->path[w->path_len[w->depth]] = '\0';
+      }
+      continue;
+    }
+    // The index and other hidden or system entries are not songs, nor are
+    // covers, playlists and notes next to them
+    if ((w->info.fattrib & (AM_HID | AM_SYS)) || w->info.fname[0] == '.' ||
+        (!(w->info.fattrib & AM_DIR) && !decoder_is_song(w->info.fname))) {
+      continue;
+    }
+
+    size_t base = w->path_len[d];
+    size_t name_len = strlen(w->info.fname);
+    if (base + (base ? 1 : 0) + name_len + 1 > LIBRARY_PATH_LEN) {
+      ESP_LOGW(TAG, "Path too long, skipping %s", w->info.fname);
+      continue;
+    }
+    char *p = w->path + base;
+    if (base > 0) {
+      *p++ = '/';
+    }
+    memcpy(p, w->info.fname, name_len + 1);
+
+    if (w->info.fattrib & AM_DIR) {
+      if (d + 1 < LIBRARY_MAX_DEPTH && open_dir(w, d + 1) == ESP_OK) {
+        w->path_len[d + 1] = strlen(w->path);
+        w->depth++;
+        continue;
+      }
+      ESP_LOGW(TAG, "Skipping directory %s", w->path);
+    } else {
+      ret = visit(w);
+      if (ret != ESP_OK) {
+        break;
+      }
+    }
+    w->path[base] = '\0';
+  }
+
+  // Left open by an error or by stopping at the first difference
+  for (; w->depth >= 0; w->depth--) {
+    f_closedir(&w->dirs[w->depth]);
+  }
+  return ret;
+}
+
+static esp_err_t open_new(walk_t *w) {
+  char path[DIR_PATH_LEN];
+
+  index_path(path, sizeof(path), w->dir_path, LIBRARY_INDEX_NAME, true);
+  w->records = fopen(path, "wb");
+  index_path(path, sizeof(path), w->dir_path, LIBRARY_NAMES_NAME, true);
+  w->names = fopen(path, "wb");
+
+  // Blank header for now, the real one goes in once all records are there
+  memset(&w->hdr, 0, sizeof(w->hdr));
+  if (w->records == NULL || w->names == NULL ||
+      fwrite(&w->hdr, sizeof(w->hdr), 1, w->records) != 1) {
+    ESP_LOGE(TAG, "Failed to create the index");
+    return ESP_FAIL;
+  }
+  return ESP_OK;
+}
+
+static esp_err_t close_new(walk_t *w, esp_err_t ret) {
+  if (ret == ESP_OK) {
+    w->hdr.magic = INDEX_MAGIC;
+    w->hdr.version = INDEX_VERSION;
+    w->hdr.entry_size = sizeof(library_entry_t);
+    if (fseek(w->records, 0, SEEK_SET) != 0 ||
+        fwrite(&w->hdr, sizeof(w->hdr), 1, w->records) != 1) {
+      ret = ESP_FAIL;
+    }
+  }
+  if (w->records && fclose(w->records) != 0) {
+    ret = ESP_FAIL;
+  }
+  if (w->names && fclose(w->names) != 0) {
+    ret = ESP_FAIL;
+  }
+  w->records = NULL;
+  w->names = NULL;
+
+  if (ret != ESP_OK) {
+    char path[DIR_PATH_LEN];
+    index_path(path, sizeof(path), w->dir_path, LIBRARY_INDEX_NAME, true);
+    remove(path);
+    index_path(path, sizeof(path), w->dir_path, LIBRARY_NAMES_NAME, true);
+    remove(path);
+  }
+  return ret;
+}
+
+esp_err_t library_refresh(const char *dir_path, bool probe, bool *changed) {
+  int64_t start = esp_timer_get_time();
+  esp_err_t ret;
+
+  *changed = false;
+  walk_t *w = calloc(1, sizeof(walk_t));
+  if (w == NULL) {
+    return ESP_ERR_NO_MEM;
+  }
+  w->dir_path = dir_path;
+  w->probe = probe;
+
+  ret = sdcard_fatfs_path(dir_path, w->root, sizeof(w->root));
+  if (ret == ESP_OK && reader_open(&w->old, dir_path) == ESP_OK) {
+    ret = walk(w);
+    if (w->cursor != w->old.hdr.count) {
+      w->changed = true;
+    }
+  } else {
+    w->changed = true;
+  }
+
+  if (ret == ESP_OK && w->changed) {
+    w->writing = true;
+    ret = open_new(w);
+    if (ret == ESP_OK) {
+      ret = walk(w);
+    }
+    ret = close_new(w, ret);
+  }
+  reader_close(&w->old);
+
+  if (ret == ESP_OK) {
+    *changed = w->changed;
+    ESP_LOGI(TAG,
+             "Walked %s in %" PRId64 " ms, %s, %" PRIu32 " songs, %" PRIu32
+             " reused, %" PRIu32 " probed",
+             dir_path, (esp_timer_get_time() - start) / 1000,
+             w->changed ? "changed" : "unchanged",
+             w->changed ? w->hdr.count : w->cursor, w->reused, w->probed);
+  }
+  free(w);
+  return ret;
+}
+
+esp_err_t library_commit(const char *dir_path, library_t *lib) {
+  char path[DIR_PATH_LEN];
+  char tmp_path[DIR_PATH_LEN];
+  const char *files[] = {LIBRARY_NAMES_NAME, LIBRARY_INDEX_NAME};
+
+  library_close(lib);
+  for (int i = 0; i < 2; i++) {
+    index_path(path, sizeof(path), dir_path, files[i], false);
+    index_path(tmp_path, sizeof(tmp_path), dir_path, files[i], true);
+    remove(path);
+    if (rename(tmp_path, path) != 0) {
+      ESP_LOGE(TAG, "Failed to rename %s", tmp_path);
+      return ESP_FAIL;
+    }
+  }
+  return library_open(dir_path, lib);
+}
+
+esp_err_t library_open(const char *dir_path, library_t *lib) {
+  reader_t r;
+
+  memset(lib, 0, sizeof(*lib));
+  if (reader_open(&r, dir_path) != ESP_OK) {
+    ESP_LOGW(TAG, "No index for %s", dir_path);
+    return ESP_ERR_NOT_FOUND;
+  }
+  lib->records = r.records;
+  lib->names = r.names;
+  lib->count = r.hdr.count;
+  lib->names_size = r.hdr.names_size;
+
+  ESP_LOGI(TAG, "Opened library of %" PRIu32 " songs", lib->count);
+  return ESP_OK;
+}
+
+// Read the records around `idx` and their paths, which follow each other
+// in the names file so both are one read
+static esp_err_t load_window(library_t *lib, uint32_t idx) {
+  uint32_t first = idx > LIBRARY_WINDOW / 2 ? idx - LIBRARY_WINDOW / 2 : 0;
+  if (first + LIBRARY_WINDOW > lib->count) {
+    first = lib->count > LIBRARY_WINDOW ? lib->count - LIBRARY_WINDOW : 0;
+  }
+  uint32_t len = lib->count - first;
+  if (len > LIBRARY_WINDOW) {
+    len = LIBRARY_WINDOW;
+  }
+
+  lib->len = 0;
+  long pos = sizeof(index_header_t) + (long)first * sizeof(library_entry_t);
+  if (fseek(lib->records, pos, SEEK_SET) != 0 ||
+      fread(lib->entries, sizeof(library_entry_t), len, lib->records) != len) {
+    return ESP_FAIL;
+  }
+
+  uint32_t start = lib->entries[0].name_offset;
+  if (start >= lib->names_size) {
+    return ESP_ERR_INVALID_SIZE;
+  }
+  size_t got = lib->names_size - start;
+  if (got > sizeof(lib->name_buf)) {
+    got = sizeof(lib->name_buf);
+  }
+  if (fseek(lib->names, start, SEEK_SET) != 0 ||
+      fread(lib->name_buf, 1, got, lib->names) != got) {
+    return ESP_FAIL;
+  }
+  for (uint32_t i = 0; i < len; i++) {
+    uint32_t off = lib->entries[i].name_offset - start;
+    if (lib->entries[i].name_offset < start || off >= got ||
+        memchr(lib->name_buf + off, '\0', got - off) == NULL) {
+      return ESP_ERR_INVALID_SIZE;
+    }
+    lib->name_pos[i] = off;
+  }
+
+  lib->first = first;
+  lib->len = len;
+  return ESP_OK;
+}
+
+esp_err_t library_get(library_t *lib, uint32_t idx,
+                      const library_entry_t **entry, const char **path) {
+  if (lib->records == NULL || idx >= lib->count) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  if (idx < lib->first || idx >= lib->first + lib->len) {
+    ESP_RETURN_ON_ERROR(load_window(lib, idx), TAG,
+                        "Failed to read the index around %" PRIu32, idx);
+  }
+
+  uint32_t i = idx - lib->first;
+  if (entry) {
+    *entry = &lib->entries[i];
+  }
+  if (path) {
+    *path = lib->name_buf + lib->name_pos[i];
+  }
+  return ESP_OK;
+}
+
+int32_t library_find(library_t *lib, const char *path) {
+  const char *name;
+  for (uint32_t i = 0; i < library_count(lib); i++) {
+    if (library_get(lib, i, NULL, &name) != ESP_OK) {
+      return -1;
+    }
+    if (strcmp(name, path) == 0) {
+      return (int32_t)i;
+    }
+  }
+  return -1;
+}
+
+void library_close(library_t *lib) {
+  if (lib->records) {
+    fclose(lib->records);
+  }
+  if (lib->names) {
+    fclose(lib->names);
+  }
+  lib->records = NULL;
+  lib->names = NULL;
+  lib->count = 0;
+  lib->len = 0;
+}
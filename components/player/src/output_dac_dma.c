@@ -0,0 +1,141 @@
+#include "output.h"
+#include "driver/dac_continuous.h"
+#include "esp_attr.h"
+#include "esp_check.h"
+#include "esp_log.h"
+#include <inttypes.h>
+#include <string.h>
+
+static const char *TAG = "OUT_DAC";
+
+// On the ESP32 the DMA moves 16 bits per sample, the driver expands our 8 bit
+// samples into the descriptor so a block holds half the buffer size
+#if CONFIG_SOC_DAC_DMA_16BIT_ALIGN
+#define DMA_BYTES_PER_SAMPLE 2
+#else
+#define DMA_BYTES_PER_SAMPLE 1
+#endif
+
+#define BLOCK_SAMPLES (CONFIG_MPLAYER_DMA_BUF_SIZE / DMA_BYTES_PER_SAMPLE)
+
+static dac_continuous_handle_t dac_handle = NULL;
+static output_pull_cb_t pull_cb = NULL;
+static void *pull_ctx = NULL;
+static uint32_t current_rate = 0;
+static bool is_running = false;
+
+// Staging block, the pull callback fills it and the driver copies (and
+// expands) it into the DMA descriptor that just finished
+static DRAM_ATTR uint8_t block[BLOCK_SAMPLES];
+
+// Called once per DMA descriptor, this is the only interrupt of the output
+static bool IRAM_ATTR on_convert_done(dac_continuous_handle_t handle,
+                                      const dac_event_data_t *event,
+                                      void *user_data) {
+  size_t samples = event->buf_size / DMA_BYTES_PER_SAMPLE;
+  if (samples > BLOCK_SAMPLES) {
+    samples = BLOCK_SAMPLES;
+  }
+
+  bool need_yield = false;
+  pull_cb(block, samples, &need_yield, pull_ctx);
+  dac_continuous_write_asynchronously(handle, event->buf, event->buf_size,
+                                      block, samples, NULL);
+  return need_yield;
+}
+
+static esp_err_t create_channel(uint32_t sample_rate) {
+  dac_continuous_config_t cfg = {
+      .chan_mask = DAC_CHANNEL_MASK_CH1,
+      .desc_num = CONFIG_MPLAYER_DMA_DESC_NUM,
+      .buf_size = CONFIG_MPLAYER_DMA_BUF_SIZE,
+      .freq_hz = sample_rate,
+      .offset = 0,
+      // The APLL can go down to the low audio rates, the default clock can't
+      .clk_src = DAC_DIGI_CLK_SRC_APLL,
+      .chan_mode = DAC_CHANNEL_MODE_SIMUL,
+  };
+  ESP_RETURN_ON_ERROR(dac_continuous_new_channels(&cfg, &dac_handle), TAG,
+                      "Failed to create DAC continuous channel");
+
+  dac_event_callbacks_t cbs = {
+      .on_convert_done = on_convert_done,
+      .on_stop = NULL,
+  };
+  ESP_RETURN_ON_ERROR(
+      dac_continuous_register_event_callback(dac_handle, &cbs, NULL), TAG,
+      "Failed to register DAC callbacks");
+
+  current_rate = sample_rate;
+  return ESP_OK;
+}
+
+static esp_err_t dac_dma_init(uint32_t sample_rate, output_pull_cb_t pull,
+                              void *ctx) {
+  pull_cb = pull;
+  pull_ctx = ctx;
+  memset(block, OUTPUT_SILENCE, sizeof(block));
+
+  ESP_RETURN_ON_ERROR(create_channel(sample_rate), TAG, "DAC init failed");
+  ESP_LOGI(TAG, "DAC DMA output at %" PRIu32 " Hz, %d samples per block",
+           sample_rate, BLOCK_SAMPLES);
+  return ESP_OK;
+}
+
+static esp_err_t dac_dma_set_sample_rate(uint32_t sample_rate) {
+  if (is_running) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  if (sample_rate == current_rate) {
+    return ESP_OK;
+  }
+
+  // The rate is part of the channel config, the only way is to recreate it
+  if (dac_handle) {
+    dac_continuous_del_channels(dac_handle);
+    dac_handle = NULL;
+  }
+  return create_channel(sample_rate);
+}
+
+static esp_err_t dac_dma_start(void) {
+  if (is_running) {
+    return ESP_OK;
+  }
+  ESP_RETURN_ON_ERROR(dac_continuous_enable(dac_handle), TAG,
+                      "Failed to enable DAC");
+  ESP_RETURN_ON_ERROR(dac_continuous_start_async_writing(dac_handle), TAG,
+                      "Failed to start DAC DMA");
+  is_running = true;
+  return ESP_OK;
+}
+
+static esp_err_t dac_dma_stop(void) {
+  if (!is_running) {
+    return ESP_OK;
+  }
+  ESP_RETURN_ON_ERROR(dac_continuous_stop_async_writing(dac_handle), TAG,
+                      "Failed to stop DAC DMA");
+  ESP_RETURN_ON_ERROR(dac_continuous_disable(dac_handle), TAG,
+                      "Failed to disable DAC");
+  is_running = false;
+  return ESP_OK;
+}
+
+static void dac_dma_deinit(void) {
+  dac_dma_stop();
+  if (dac_handle) {
+    dac_continuous_del_channels(dac_handle);
+    dac_handle = NULL;
+  }
+  current_rate = 0;
+}
+
+const output_backend_t output_dac_dma = {
+    .name = "dac_dma",
+    .init = dac_dma_init,
+    .set_sample_rate = dac_dma_set_sample_rate,
+    .start = dac_dma_start,
+    .stop = dac_dma_stop,
+    .deinit = dac_dma_deinit,
+};
@@ -0,0 +1,211 @@
+#include "output.h"
+#include "esp_check.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#if CONFIG_MPLAYER_OUTPUT_SINK_VIRTUAL
+#include "sim.h"
+#endif
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+static const char *TAG = "OUT_SINK";
+
+#define BLOCK_SAMPLES CONFIG_MPLAYER_OUTPUT_SINK_BLOCK_SIZE
+
+#if CONFIG_MPLAYER_OUTPUT_SINK_REALTIME
+#define SINK_PRIORITY 6
+#else
+// Under every other task (app_main included), a block is only pulled once
+// they are all waiting, so the virtual clock only moves then and the fast
+// sink never takes the CPU from the player it measures
+#define SINK_PRIORITY tskIDLE_PRIORITY
+#endif
+
+static output_pull_cb_t pull_cb = NULL;
+static void *pull_ctx = NULL;
+static uint32_t current_rate = 0;
+static TaskHandle_t sink_task_handle = NULL;
+static FILE *sink_file = NULL;
+static volatile bool is_running = false;
+
+static uint8_t block[BLOCK_SAMPLES];
+
+// Per block overhead, what the pull callback costs, measured around it
+static uint64_t blocks_pulled = 0;
+static uint64_t pull_time_total_us = 0;
+static uint32_t pull_time_max_us = 0;
+static uint64_t samples_real = 0;
+
+#if !CONFIG_MPLAYER_OUTPUT_SINK_FAST
+// Samples played at the current rate and the time they account for, kept
+// as a count so the pace doesn't drift with rates that don't divide
+static uint64_t clock_samples = 0;
+static int64_t clock_played_us = 0;
+
+// How long the next block plays
+static uint32_t block_us(void) {
+  clock_samples += BLOCK_SAMPLES;
+  int64_t played = (int64_t)(clock_samples * 1000000 / current_rate);
+  uint32_t us = (uint32_t)(played - clock_played_us);
+  clock_played_us = played;
+  return us;
+}
+#endif
+
+#if CONFIG_MPLAYER_OUTPUT_SINK_REALTIME
+#define TICK_US (portTICK_PERIOD_MS * 1000)
+
+static int64_t deadline = 0;
+
+// Wait for the end of the block, against a deadline in us so the ticks
+// only add jitter and not drift. Like the DMA it never catches up, a block
+// late moves the deadline
+static void wait_block(void) {
+  deadline += block_us();
+  int64_t wait = deadline - esp_timer_get_time();
+  if (wait <= 0) {
+    deadline -= wait;
+    return;
+  }
+  vTaskDelay((TickType_t)((wait + TICK_US - 1) / TICK_US));
+}
+#endif
+
+static void sink_task(void *arg) {
+  while (1) {
+    if (!is_running) {
+#if CONFIG_MPLAYER_OUTPUT_SINK_VIRTUAL
+      // Nothing playing, time goes straight to the next task to wake up
+      if (sim_advance_to_next()) {
+        continue;
+      }
+#endif
+      ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+#if CONFIG_MPLAYER_OUTPUT_SINK_REALTIME
+      deadline = esp_timer_get_time();
+#endif
+      continue;
+    }
+
+    bool need_yield = false;
+    int64_t start = esp_timer_get_time();
+    size_t real = pull_cb(block, BLOCK_SAMPLES, &need_yield, pull_ctx);
+    uint32_t elapsed = (uint32_t)(esp_timer_get_time() - start);
+
+    blocks_pulled++;
+    samples_real += real;
+    pull_time_total_us += elapsed;
+    if (elapsed > pull_time_max_us) {
+      pull_time_max_us = elapsed;
+    }
+
+    if (sink_file) {
+      fwrite(block, 1, BLOCK_SAMPLES, sink_file);
+    }
+
+#if CONFIG_MPLAYER_OUTPUT_SINK_REALTIME
+    // Same cadence a DMA block would have at this rate
+    wait_block();
+#elif CONFIG_MPLAYER_OUTPUT_SINK_VIRTUAL
+    sim_advance_us(block_us());
+    taskYIELD();
+#else
+    taskYIELD();
+#endif
+  }
+}
+
+static esp_err_t sink_init(uint32_t sample_rate, output_pull_cb_t pull,
+                           void *ctx) {
+  pull_cb = pull;
+  pull_ctx = ctx;
+  current_rate = sample_rate;
+
+  const char *path = CONFIG_MPLAYER_OUTPUT_SINK_PATH;
+  if (path[0] != '\0') {
+    sink_file = fopen(path, "wb");
+    if (sink_file == NULL) {
+      ESP_LOGE(TAG, "Failed to open sink file %s", path);
+      return ESP_FAIL;
+    }
+  }
+
+  BaseType_t ret = xTaskCreate(sink_task, "output_sink", 3072, NULL,
+                               SINK_PRIORITY, &sink_task_handle);
+  if (ret != pdPASS) {
+    if (sink_file) {
+      fclose(sink_file);
+      sink_file = NULL;
+    }
+    return ESP_ERR_NO_MEM;
+  }
+
+#if CONFIG_MPLAYER_OUTPUT_SINK_VIRTUAL
+  sim_set_clock_task(sink_task_handle);
+#endif
+
+  ESP_LOGI(TAG, "Sink output at %" PRIu32 " Hz into %s", sample_rate,
+           sink_file ? path : "nothing");
+  return ESP_OK;
+}
+
+static esp_err_t sink_set_sample_rate(uint32_t sample_rate) {
+  if (is_running) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  current_rate = sample_rate;
+#if !CONFIG_MPLAYER_OUTPUT_SINK_FAST
+  clock_samples = 0;
+  clock_played_us = 0;
+#endif
+  return ESP_OK;
+}
+
+static esp_err_t sink_start(void) {
+  is_running = true;
+  xTaskNotifyGive(sink_task_handle);
+  return ESP_OK;
+}
+
+static esp_err_t sink_stop(void) {
+  if (!is_running) {
+    return ESP_OK;
+  }
+  is_running = false;
+  if (sink_file) {
+    fflush(sink_file);
+  }
+
+  if (blocks_pulled > 0) {
+    ESP_LOGI(TAG,
+             "%" PRIu64 " blocks, %" PRIu64 " real samples, pull avg %" PRIu64
+             " us max %" PRIu32 " us",
+             blocks_pulled, samples_real, pull_time_total_us / blocks_pulled,
+             pull_time_max_us);
+  }
+  return ESP_OK;
+}
+
+static void sink_deinit(void) {
+  sink_stop();
+  if (sink_task_handle) {
+    vTaskDelete(sink_task_handle);
+    sink_task_handle = NULL;
+  }
+  if (sink_file) {
+    fclose(sink_file);
+    sink_file = NULL;
+  }
+}
+
+const output_backend_t output_sink = {
+    .name = "sink",
+    .init = sink_init,
+    .set_sample_rate = sink_set_sample_rate,
+    .start = sink_start,
+    .stop = sink_stop,
+    .deinit = sink_deinit,
+};
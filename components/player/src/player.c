@@ -1,259 +1,1321 @@
 #include "player.h"
-#include "driver/dac_oneshot.h"
-#include "driver/gptimer.h"
+#include "esp_attr.h"
 #include "esp_check.h"
 #include "esp_log.h"
+#include "esp_timer.h"
+#if CONFIG_PM_ENABLE
+#include "esp_pm.h"
+#endif
+#if !CONFIG_IDF_TARGET_LINUX
+#include "esp_cpu.h"
+#endif
 #include "freertos/FreeRTOS.h"
-#include "freertos/semphr.h"
+#include "freertos/queue.h"
 #include "freertos/task.h"
-#include "hal/dac_types.h" // For DAC_CHANNEL_1 if needed, usually in dac_oneshot.h
-#include <stdio.h>
+#include "audio_ring.h"
+#include "decoder.h"
+#include "dsp.h"
+#include "output.h"
+#include "readahead.h"
+#include "resampler.h"
+#include <inttypes.h>
 #include <string.h>
 
 static const char *TAG = "PLAYER";
 
 // Audio Configuration
-#define SAMPLE_RATE 8000
-#define TIMER_RESOLUTION_HZ 1000000 // 1MHz resolution
-#define ALARM_COUNT (TIMER_RESOLUTION_HZ / SAMPLE_RATE)
-#define BUFFER_SIZE 4096 // 4KB buffer
+#define SAMPLE_RATE CONFIG_MPLAYER_SAMPLE_RATE
+#define BUFFER_SIZE 4096 // 4KB buffer, must be a power of two
+#define PCM_BLOCK 256    // Frames decoded per decoder call
+#define LOW_WATERMARK (BUFFER_SIZE / 4) // Refill when the ring gets this low
+#define PRELOAD_SLOTS 2 // Next and previous song, the current one makes 3
+#define PRELOAD_PATH_LEN 300
+#define SEEK_PREFILL LOW_WATERMARK // Audio ready before restarting a seek
+#define CMD_QUEUE_LEN 8
+#define CMD_WAIT_MS 100 // Longest a caller waits for room in the queue
+#define FADE_MARGIN LOW_WATERMARK // Fade outs start this far into the ring
+#define PLAYER_PRIORITY CONFIG_MPLAYER_DECODER_PRIORITY
+
+#if defined(CONFIG_MPLAYER_DECODER_CORE) && CONFIG_MPLAYER_DECODER_CORE >= 0
+#define PLAYER_CORE CONFIG_MPLAYER_DECODER_CORE
+#else
+#define PLAYER_CORE tskNO_AFFINITY
+#endif
+
+#if CONFIG_MPLAYER_RESAMPLER_LOW
+#define RESAMPLER_QUALITY RESAMPLER_LOW
+#elif CONFIG_MPLAYER_RESAMPLER_MEDIUM
+#define RESAMPLER_QUALITY RESAMPLER_MEDIUM
+#elif CONFIG_MPLAYER_RESAMPLER_HIGH
+#define RESAMPLER_QUALITY RESAMPLER_HIGH
+#endif
 
 // State
-static dac_oneshot_handle_t dac_handle = NULL;
-static gptimer_handle_t timer_handle = NULL;
+static const output_backend_t *output = NULL;
 static TaskHandle_t player_task_handle = NULL;
-static FILE *current_file = NULL;
+static readahead_t *current_stream = NULL;
+static decoder_t decoder;
+static resampler_t resampler;
+
+// Every control function only queues a command, the player task runs them
+// between blocks so nothing it uses changes under it, and tells how they
+// went through the event callback
+typedef struct {
+    mplayer_cmd_t type;
+    uint32_t ms;                 /**< Play from and seek */
+    int32_t delta_ms;            /**< Relative seek */
+    char path[PRELOAD_PATH_LEN]; /**< Play and preloads, empty for none */
+    int64_t queued_us;           /**< When it was sent */
+} player_cmd_t;
+
+static QueueHandle_t cmd_queue = NULL;
+static mplayer_event_cb_t event_cb = NULL;
+static void *event_ctx = NULL;
+
+// Songs opened ahead of time, `queued` is the one to continue with
+typedef struct {
+    readahead_t *stream;
+    char path[PRELOAD_PATH_LEN];
+} preload_t;
+
+static preload_t preloads[PRELOAD_SLOTS];
+static preload_t *queued = NULL;
+
+// Queued song once the player task opened it at the end of the current one
+static readahead_t *next_stream = NULL;
+static decoder_t next_decoder;
+
+// Decoded block, 16 bit mono at the song rate, and how much of it the
+// resampler already took
+static int16_t pcm_block[PCM_BLOCK];
+static size_t pcm_len = 0;
+static size_t pcm_pos = 0;
+static bool decoder_done = false;
+
+// Resampled block, 16 bit mono at the output rate
+static int16_t out_block[PCM_BLOCK];
+
+// Volume, fades and 8 bit conversion, the volume is only picked up by the
+// producer from block to block
+static dsp_t dsp;
+static volatile uint8_t volume = 100;
+static volatile uint32_t volume_gain = DSP_UNITY_GAIN;
 
 // Buffer (Single Producer - Single Consumer Ring Buffer)
 static uint8_t audio_buffer[BUFFER_SIZE];
-static volatile size_t buf_head = 0; // Write index
-static volatile size_t buf_tail = 0; // Read index
+static audio_ring_t audio_ring;
 static volatile bool is_playing = false;
 static volatile bool is_paused = false;
-static volatile bool song_finished = false;
 
-// Notification for the task
-static SemaphoreHandle_t play_sem = NULL;
+// After a fade out the audio decoded past the fade stays in the ring, out
+// of the output reach, until `hidden_head` is given back on resume
+static bool hidden = false;
+static size_t hidden_head = 0;
 
-// Helper to check buffer fullness
-static inline bool buffer_is_full(void) {
-  return ((buf_head + 1) % BUFFER_SIZE) == buf_tail;
+// The task sleeps on its notification, the output wakes it once the ring
+// goes under the watermark (if it asked for it) or once it is empty while
+// draining the end of the song, a new command on any change
+static volatile bool refill_wanted = false;
+static volatile bool draining = false;
+static volatile bool song_over = false;
+static mplayer_wakeups_t wakeups;
+
+// Song change measurement, samples written to and read from the ring since
+// the last reset, the change starts once the last sample of a song is in the
+// ring at `transition_at` and every silence sample the output plays until it
+// gets past that is part of the gap, as is the time the output was stopped
+static volatile size_t samples_written = 0;
+static volatile size_t samples_read = 0;
+static volatile bool in_transition = false;
+static volatile size_t transition_at = 0;
+static volatile uint32_t transition_silence = 0;
+static int64_t output_stopped_us = 0;
+static mplayer_gaps_t gaps;
+
+// Position in the song, it was `position_ms` when the output had read
+// `position_at` samples. After a gapless switch it starts again once the
+// output gets to the next song
+static uint32_t out_rate = SAMPLE_RATE;
+static volatile uint32_t position_ms = 0;
+static volatile size_t position_at = 0;
+static volatile bool position_switch = false;
+static volatile uint32_t duration_ms = 0;
+static volatile int64_t first_sample_us = 0;
+
+// Power state, the task only keeps the CPU at full speed (and out of light
+// sleep) while it is decoding, while it waits for the output to drain the
+// ring the clock can drop, the output is stopped when paused or stopped
+static portMUX_TYPE power_mux = portMUX_INITIALIZER_UNLOCKED;
+static mplayer_power_t power;
+static int64_t power_since = 0;
+#if CONFIG_PM_ENABLE
+static esp_pm_lock_handle_t decode_lock = NULL;
+#endif
+
+// Playback health, the output side is updated once per block from the pull
+// (a handful of adds in a critical section), averages are kept as sums and
+// only divided when copied out
+static portMUX_TYPE stats_mux = portMUX_INITIALIZER_UNLOCKED;
+static mplayer_stats_t stats = {.fill_min = BUFFER_SIZE};
+static uint64_t fill_sum = 0;
+static uint64_t pull_time_sum = 0;
+static uint64_t pull_cycle_sum = 0;
+static uint64_t cmd_latency_sum = 0;
+static int64_t stats_since = 0;
+static uint32_t underrun_run = 0;
+static uint32_t underruns_logged = 0;
+#if CONFIG_MPLAYER_STATS_LOG_INTERVAL > 0
+static esp_timer_handle_t stats_timer = NULL;
+#endif
+
+static void IRAM_ATTR notify_player_task(bool *need_yield) {
+  if (xPortInIsrContext()) {
+    BaseType_t woken = pdFALSE;
+    vTaskNotifyGiveFromISR(player_task_handle, &woken);
+    if (woken == pdTRUE) {
+      *need_yield = true;
+    }
+  } else {
+    xTaskNotifyGive(player_task_handle);
+  }
 }
 
-static inline bool buffer_is_empty(void) { return buf_head == buf_tail; }
+// CPU cycles, what the pull costs at any clock. The host has no counter
+static inline uint32_t IRAM_ATTR cycle_count(void) {
+#if CONFIG_IDF_TARGET_LINUX
+  return 0;
+#else
+  return esp_cpu_get_cycle_count();
+#endif
+}
 
-static inline size_t buffer_free_space(void) {
-  if (buf_head >= buf_tail) {
-    return BUFFER_SIZE - 1 - (buf_head - buf_tail);
+// Account one block pulled while playing steadily, `missing` samples of it
+// were silence because the ring ran out
+static void IRAM_ATTR count_block(size_t fill, size_t missing,
+                                  int64_t pull_us, uint32_t pull_cycles) {
+  portENTER_CRITICAL_SAFE(&stats_mux);
+  stats.blocks++;
+  fill_sum += fill;
+  if (fill < stats.fill_min) {
+    stats.fill_min = fill;
+  }
+  size_t bucket = fill * MPLAYER_FILL_BUCKETS / BUFFER_SIZE;
+  if (bucket == MPLAYER_FILL_BUCKETS) {
+    bucket--; // Full ring
+  }
+  stats.fill[bucket]++;
+  pull_time_sum += pull_us;
+  if (pull_us > stats.pull_max_us) {
+    stats.pull_max_us = (uint32_t)pull_us;
+  }
+  pull_cycle_sum += pull_cycles;
+  if (pull_cycles > stats.pull_max_cycles) {
+    stats.pull_max_cycles = pull_cycles;
+  }
+  if (missing > 0) {
+    if (underrun_run == 0) {
+      stats.underruns++;
+    }
+    underrun_run += missing;
+    stats.underrun_samples += missing;
+    if (underrun_run > stats.longest_underrun) {
+      stats.longest_underrun = underrun_run;
+    }
   } else {
-    return buf_tail - buf_head - 1;
+    underrun_run = 0;
   }
+  portEXIT_CRITICAL_SAFE(&stats_mux);
 }
 
-// ISR - Executed at 8kHz
-static bool IRAM_ATTR on_timer_alarm(gptimer_handle_t timer,
-                                     const gptimer_alarm_event_data_t *edata,
-                                     void *user_ctx) {
-  bool need_yield = false;
+// Output pull - Executed once per output block, usually from the DMA ISR
+static size_t IRAM_ATTR output_pull(uint8_t *dst, size_t len,
+                                    bool *need_yield, void *ctx) {
+  int64_t pull_start = esp_timer_get_time();
+  uint32_t pull_start_cycles = cycle_count();
+  size_t copied = 0;
+  size_t fill = 0;
+  // Only once the song is going, its start, a change of song and its end
+  // are expected to run short
+  bool steady = samples_read > 0 && !in_transition && !song_over && !draining;
 
   if (is_playing && !is_paused) {
-    if (!buffer_is_empty()) {
-      uint8_t val = audio_buffer[buf_tail];
-      buf_tail = (buf_tail + 1) % BUFFER_SIZE;
-
-      // Output to DAC
-      // Note: dac_oneshot_output_voltage is generally not guaranteed to be IRAM
-      // safe or lock-free in all IDF versions, but for this prototype we assume
-      // it works or overhead is acceptable. If strict real-time is needed,
-      // direct register writing is preferred.
-      dac_oneshot_output_voltage(dac_handle, val);
-    } else {
-      // Buffer Underflow - Output silence (mid-point or 0 depending on
-      // encoding, assuming 8-bit unsigned PCM)
-      // dac_oneshot_output_voltage(dac_handle, DAC_CHAN_1, 128);
+    fill = audio_ring_used(&audio_ring);
+    copied = audio_ring_read(&audio_ring, dst, len);
+    samples_read += copied;
+    if (first_sample_us == 0 && copied > 0) {
+      first_sample_us = esp_timer_get_time();
+    }
+
+    if (in_transition) {
+      if (samples_read > transition_at) {
+        // First samples of the new song
+        in_transition = false;
+        if (position_switch) {
+          position_switch = false;
+          position_ms = 0;
+          position_at = transition_at;
+        }
+        gaps.transitions++;
+        gaps.last_gap = transition_silence;
+        if (transition_silence > gaps.max_gap) {
+          gaps.max_gap = transition_silence;
+        }
+      } else {
+        transition_silence += len - copied;
+      }
+    }
+
+    size_t used = audio_ring_used(&audio_ring);
+    if (refill_wanted && used < LOW_WATERMARK) {
+      refill_wanted = false;
+      wakeups.refill_requests++;
+      notify_player_task(need_yield);
+    } else if (draining && used == 0) {
+      draining = false;
+      wakeups.drain_signals++;
+      notify_player_task(need_yield);
+    }
+  }
+
+  // Buffer Underflow or paused - Output silence (mid-point, 8-bit unsigned)
+  if (copied < len) {
+    memset(dst + copied, OUTPUT_SILENCE, len - copied);
+  }
+
+  if (is_playing && !is_paused && steady) {
+    count_block(fill, len - copied, esp_timer_get_time() - pull_start,
+                cycle_count() - pull_start_cycles);
+  }
+
+  return copied;
+}
+
+// Convert a decoded block to 8 bit unsigned straight into the ring spans
+static void pcm_to_ring(const int16_t *pcm, size_t frames,
+                        const audio_ring_span_t spans[2]) {
+  dsp_set_gain(&dsp, volume_gain);
+  for (int i = 0; i < 2 && frames > 0; i++) {
+    size_t n = frames < spans[i].len ? frames : spans[i].len;
+    dsp_process(&dsp, pcm, n, spans[i].ptr);
+    pcm += n;
+    frames -= n;
+  }
+}
+
+// Fade outs happen in the ring behind FADE_MARGIN, the fade can't be longer
+// than what fits there
+static uint32_t fade_samples(void) {
+  uint32_t len = out_rate * CONFIG_MPLAYER_FADE_MS / 1000;
+  return len < BUFFER_SIZE - FADE_MARGIN ? len : BUFFER_SIZE - FADE_MARGIN;
+}
+
+// Account a command that waited `latency_us` in the queue
+static void count_command(int64_t latency_us) {
+  taskENTER_CRITICAL(&stats_mux);
+  stats.commands++;
+  cmd_latency_sum += latency_us;
+  if (latency_us > stats.cmd_latency_max_us) {
+    stats.cmd_latency_max_us = (uint32_t)latency_us;
+  }
+  taskEXIT_CRITICAL(&stats_mux);
+}
+
+static void count_decode(int64_t elapsed_us) {
+  taskENTER_CRITICAL(&stats_mux);
+  stats.decode_time_us += elapsed_us;
+  taskEXIT_CRITICAL(&stats_mux);
+}
+
+static void emit_event(mplayer_event_type_t type, mplayer_cmd_t cmd,
+                       esp_err_t err) {
+  if (event_cb == NULL) {
+    return;
+  }
+  mplayer_event_t event = {
+      .type = type,
+      .cmd = cmd,
+      .err = err,
+      .position_ms = mplayer_get_position_ms(),
+  };
+  event_cb(&event, event_ctx);
+}
+
+static uint32_t song_duration_ms(void) {
+  if (decoder.format.sample_rate == 0) {
+    return 0;
+  }
+  return (uint32_t)((uint64_t)decoder.format.total_frames * 1000 /
+                    decoder.format.sample_rate);
+}
+
+// The last sample of the song is in the ring, start counting the gap
+static void start_transition(void) {
+  transition_at = samples_written;
+  transition_silence = 0;
+  in_transition = true;
+}
+
+// Count the time the output spent stopped into the gap
+static void add_stopped_time(uint32_t rate) {
+  if (in_transition && output_stopped_us > 0) {
+    int64_t stopped = esp_timer_get_time() - output_stopped_us;
+    transition_silence += (uint32_t)(stopped * rate / 1000000);
+  }
+  output_stopped_us = 0;
+}
+
+// Take the queued song out of the preloads, NULL if there is none
+static readahead_t *take_queued(void) {
+  readahead_t *stream = NULL;
+
+  if (queued != NULL) {
+    stream = queued->stream;
+    queued->stream = NULL;
+    queued = NULL;
+  }
+
+  return stream;
+}
+
+// Take a preloaded song out by its path, NULL if it is not there
+static readahead_t *take_preload(const char *filepath) {
+  for (int i = 0; i < PRELOAD_SLOTS; i++) {
+    preload_t *slot = &preloads[i];
+    if (slot->stream != NULL && strcmp(slot->path, filepath) == 0) {
+      readahead_t *stream = slot->stream;
+      slot->stream = NULL;
+      if (queued == slot) {
+        queued = NULL;
+      }
+      return stream;
+    }
+  }
+  return NULL;
+}
+
+// Open the decoder of the queued song, true if there is one ready
+static bool open_next(void) {
+  if (next_stream != NULL) {
+    return true;
+  }
+
+  // The path stays in the slot until it is used for another preload
+  const char *path = queued ? queued->path : "";
+  readahead_t *stream = take_queued();
+  if (stream == NULL) {
+    return false;
+  }
+  esp_err_t ret = decoder_open(&next_decoder, stream, path);
+  if (ret != ESP_OK) {
+    ESP_LOGE(TAG, "No decoder for next song: %s", esp_err_to_name(ret));
+    readahead_close(stream);
+    return false;
+  }
+  next_stream = stream;
+  return true;
+}
+
+static void close_next(void) {
+  if (next_stream != NULL) {
+    decoder_close(&next_decoder);
+    readahead_close(next_stream);
+    next_stream = NULL;
+  }
+}
+
+// Make the opened next song the current one
+static void switch_to_next(void) {
+  decoder_close(&decoder);
+  readahead_close(current_stream);
+  decoder = next_decoder;
+  current_stream = next_stream;
+  next_stream = NULL;
+
+  pcm_len = 0;
+  pcm_pos = 0;
+  decoder_done = false;
+  position_switch = true;
+  duration_ms = song_duration_ms();
+  dsp_reset(&dsp);
+  ESP_LOGI(TAG, "Continuing with next song");
+  emit_event(MPLAYER_EVENT_ADVANCED, MPLAYER_CMD_NONE, ESP_OK);
+}
+
+// Without a resampler the output follows the song rate, so a next song at
+// another rate means stopping it for a moment
+static esp_err_t restart_with_next(void) {
+  switch_to_next();
+
+  uint32_t rate = decoder.format.sample_rate;
+  esp_err_t ret = output->set_sample_rate(rate);
+  out_rate = rate;
+  if (ret == ESP_OK) {
+    ret = resampler_init(&resampler, rate, rate, RESAMPLER_LOW);
+  }
+  if (ret != ESP_OK) {
+    ESP_LOGE(TAG, "Can't play next song at %" PRIu32 " Hz", rate);
+    return ret;
+  }
+
+  song_over = false;
+  add_stopped_time(rate);
+  return output->start();
+}
+
+// Account the time spent in the current state and move to the one the
+// player is in now, `decoding` tells if the task is working
+static void update_power_state(bool decoding) {
+  mplayer_power_state_t state;
+  if (!is_playing) {
+    state = MPLAYER_POWER_IDLE;
+  } else if (is_paused) {
+    state = MPLAYER_POWER_PAUSED;
+  } else {
+    state = decoding ? MPLAYER_POWER_DECODING : MPLAYER_POWER_WAITING;
+  }
+
+  taskENTER_CRITICAL(&power_mux);
+  int64_t now = esp_timer_get_time();
+  power.time_us[power.state] += now - power_since;
+  power_since = now;
+  power.state = state;
+  taskEXIT_CRITICAL(&power_mux);
+}
+
+// The output can't log from its ISR, tell about new underruns from here
+static void log_underruns(void) {
+  uint32_t underruns = stats.underruns;
+  if (underruns < underruns_logged) {
+    underruns_logged = 0; // The stats were reset
+  }
+  if (underruns != underruns_logged) {
+    ESP_LOGW(TAG, "Output ran out of audio %" PRIu32 " times (%" PRIu32
+                  " in total)",
+             underruns - underruns_logged, underruns);
+    underruns_logged = underruns;
+  }
+}
+
+static void wait_for_event(void) {
+  update_power_state(false);
+#if CONFIG_PM_ENABLE
+  esp_pm_lock_release(decode_lock);
+#endif
+  ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+#if CONFIG_PM_ENABLE
+  esp_pm_lock_acquire(decode_lock);
+#endif
+  wakeups.task_wakeups++;
+  update_power_state(true);
+  log_underruns();
+}
+
+// Fade the ring out FADE_MARGIN ahead of the output, far enough for it not
+// to get there meanwhile, and wait for it to play up to the end of the
+// fade. What was decoded after it is hidden, for fade_in_hidden to give
+// back or for a reset of the ring to drop
+static void fade_out(void) {
+  if (!is_playing || is_paused || CONFIG_MPLAYER_FADE_MS == 0) {
+    return;
+  }
+
+  size_t tail = audio_ring_tail(&audio_ring);
+  size_t head = audio_ring_head(&audio_ring);
+  size_t used = head - tail;
+  size_t len = fade_samples();
+  size_t start = FADE_MARGIN;
+  if (start + len > used) {
+    // Not much left, fade what there is
+    start = used > len ? used - len : 0;
+    len = used - start;
+  }
+
+  audio_ring_span_t spans[2];
+  audio_ring_peek_spans(&audio_ring, tail + start, len, spans);
+  dsp_fade_out_u8(spans[0].ptr, spans[0].len, 0, len);
+  dsp_fade_out_u8(spans[1].ptr, spans[1].len, spans[0].len, len);
+  hidden_head = head;
+  hidden = true;
+  if (audio_ring_set_head(&audio_ring, tail + start + len) !=
+      tail + start + len) {
+    // The output got past the fade meanwhile, it was cut where it was
+    ESP_LOGW(TAG, "Fade out overrun by the output");
+  }
+
+  draining = true;
+  while (audio_ring_used(&audio_ring) > 0) {
+    wait_for_event();
+  }
+  draining = false;
+  refill_wanted = false;
+}
+
+// Give the output back what fade_out hid, fading it in, with the output
+// stopped. Without anything hidden the next audio produced fades in
+static void fade_in_hidden(void) {
+  if (!hidden) {
+    dsp_fade_in(&dsp, fade_samples());
+    return;
+  }
+
+  size_t tail = audio_ring_tail(&audio_ring);
+  uint32_t fade_len = fade_samples();
+  size_t len = hidden_head - tail;
+  if (len < fade_len) {
+    // Short of a whole fade, what comes next goes on with it
+    dsp_fade_in(&dsp, fade_len);
+    dsp.fade_pos = len;
+  } else {
+    len = fade_len;
+  }
+  audio_ring_span_t spans[2];
+  audio_ring_peek_spans(&audio_ring, tail, len, spans);
+  dsp_fade_in_u8(spans[0].ptr, spans[0].len, 0, fade_len);
+  dsp_fade_in_u8(spans[1].ptr, spans[1].len, spans[0].len, fade_len);
+  audio_ring_set_head(&audio_ring, hidden_head);
+  hidden = false;
+}
+
+// Decode, resample and push one block into the ring, false once the song
+// has nothing more to give
+static bool produce_block(audio_ring_span_t spans[2]) {
+  if (pcm_pos == pcm_len && !decoder_done) {
+    pcm_len = decoder_decode(&decoder, pcm_block, PCM_BLOCK);
+    pcm_pos = 0;
+    if (pcm_len == 0 && open_next() &&
+        next_decoder.format.sample_rate == decoder.format.sample_rate) {
+      // Same rate, the resampler goes on into the next song as if it was
+      // the same one
+      switch_to_next();
+      start_transition();
+      pcm_len = decoder_decode(&decoder, pcm_block, PCM_BLOCK);
+    }
+    decoder_done = (pcm_len == 0);
+  }
+
+  size_t frames;
+  if (decoder_done) {
+    frames = resampler_flush(&resampler, out_block, PCM_BLOCK);
+  } else {
+    size_t taken = pcm_len - pcm_pos;
+    frames = resampler_process(&resampler, pcm_block + pcm_pos, &taken,
+                               out_block, PCM_BLOCK);
+    pcm_pos += taken;
+  }
+  pcm_to_ring(out_block, frames, spans);
+  audio_ring_write_commit(&audio_ring, frames);
+  samples_written += frames;
+
+  if (!decoder_done || frames > 0) {
+    return true;
+  }
+
+#ifdef RESAMPLER_QUALITY
+  // The tail of the song is out, the resampler starts again at the rate of
+  // the next one while the output keeps going
+  if (next_stream != NULL) {
+    switch_to_next();
+    if (resampler_init(&resampler, decoder.format.sample_rate, SAMPLE_RATE,
+                       RESAMPLER_QUALITY) == ESP_OK) {
+      start_transition();
+      return true;
+    }
+    ESP_LOGE(TAG, "Can't play next song at %" PRIu32 " Hz",
+             decoder.format.sample_rate);
+  }
+#endif
+  return false;
+}
+
+// Move the current song to `ms` with the output stopped, the ring is
+// emptied and refilled from the new position before it starts again so
+// there is nothing left of the old one
+static esp_err_t do_seek(uint32_t ms) {
+  if (current_stream == NULL) {
+    return ESP_ERR_INVALID_STATE;
+  }
+
+  int64_t start = esp_timer_get_time();
+  uint32_t rate = decoder.format.sample_rate;
+  uint32_t frame = (uint32_t)((uint64_t)ms * rate / 1000);
+  if (decoder.format.total_frames > 0 && frame > decoder.format.total_frames) {
+    frame = decoder.format.total_frames;
+  }
+
+  fade_out();
+  output->stop();
+  esp_err_t ret = decoder_seek(&decoder, frame);
+  if (ret != ESP_OK) {
+    ESP_LOGE(TAG, "Seek to %" PRIu32 " ms failed: %s", ms,
+             esp_err_to_name(ret));
+    if (!is_paused) {
+      fade_in_hidden();
+      output->start();
+    }
+    return ret;
+  }
+#ifdef RESAMPLER_QUALITY
+  resampler_init(&resampler, rate, SAMPLE_RATE, RESAMPLER_QUALITY);
+#else
+  resampler_init(&resampler, rate, rate, RESAMPLER_LOW);
+#endif
+  pcm_len = 0;
+  pcm_pos = 0;
+  decoder_done = false;
+  song_over = false;
+  draining = false;
+  refill_wanted = false;
+  in_transition = false;
+  position_switch = false;
+
+  audio_ring_reset(&audio_ring);
+  hidden = false;
+  dsp_fade_in(&dsp, fade_samples());
+  position_ms = (uint32_t)((uint64_t)frame * 1000 / rate);
+  position_at = samples_read;
+  samples_written = samples_read;
+
+  // Some audio in before the output starts, so it doesn't begin on silence
+  audio_ring_span_t spans[2];
+  while (audio_ring_used(&audio_ring) < SEEK_PREFILL &&
+         audio_ring_write_spans(&audio_ring, spans) >= PCM_BLOCK) {
+    if (!produce_block(spans)) {
+      start_transition();
+      song_over = true;
+      break;
+    }
+  }
+  int64_t ready = esp_timer_get_time();
+  ret = is_paused ? ESP_OK : output->start();
+
+  ESP_LOGI(TAG, "Seek to %" PRIu32 " ms (frame %" PRIu32 ") in %lld us, "
+           "%lld us to refill",
+           position_ms, frame, (long long)(esp_timer_get_time() - start),
+           (long long)(ready - start));
+  return ret;
+}
+
+// Stop whatever is playing and close it, the output stays stopped. If
+// something was playing a song change starts here
+static void stop_song(void) {
+  output->stop();
+  if (is_playing) {
+    transition_silence = 0;
+    in_transition = true;
+    output_stopped_us = esp_timer_get_time();
+  }
+
+  is_playing = false;
+  is_paused = false;
+  refill_wanted = false;
+  draining = false;
+  song_over = false;
+
+  if (current_stream) {
+    decoder_close(&decoder);
+    readahead_close(current_stream);
+    current_stream = NULL;
+  }
+  close_next();
+
+  memset(audio_buffer, 0, BUFFER_SIZE);
+  audio_ring_reset(&audio_ring);
+  hidden = false;
+  update_power_state(false);
+}
+
+// Set the output and resampler up for the current decoder, which is at
+// `frame`, and start playing it
+static esp_err_t start_song(uint32_t frame) {
+#ifdef RESAMPLER_QUALITY
+  // Output stays at its rate, the resampler converts the song to it
+  out_rate = SAMPLE_RATE;
+#else
+  // Output timing follows the song
+  out_rate = decoder.format.sample_rate;
+#endif
+  esp_err_t ret = output->set_sample_rate(out_rate);
+  if (ret == ESP_OK) {
+#ifdef RESAMPLER_QUALITY
+    ret = resampler_init(&resampler, decoder.format.sample_rate, out_rate,
+                         RESAMPLER_QUALITY);
+#else
+    ret = resampler_init(&resampler, out_rate, out_rate, RESAMPLER_LOW);
+#endif
+  }
+  if (ret != ESP_OK) {
+    ESP_LOGE(TAG, "Can't play %" PRIu32 " Hz at %" PRIu32 " Hz",
+             decoder.format.sample_rate, out_rate);
+    decoder_close(&decoder);
+    readahead_close(current_stream);
+    current_stream = NULL;
+    return ret;
+  }
+  pcm_len = 0;
+  pcm_pos = 0;
+  decoder_done = false;
+  song_over = false;
+
+  // Reset buffer, the song fades in from silence so the gain can jump to
+  // the volume and nothing of the last song is left in the dsp
+  audio_ring_reset(&audio_ring);
+  hidden = false;
+  dsp_init(&dsp, volume_gain);
+  dsp_fade_in(&dsp, fade_samples());
+  samples_written = 0;
+  samples_read = 0;
+  transition_at = 0;
+  position_ms = (uint32_t)((uint64_t)frame * 1000 / decoder.format.sample_rate);
+  position_at = 0;
+  first_sample_us = 0;
+  duration_ms = song_duration_ms();
+  add_stopped_time(out_rate);
+  is_paused = false;
+  is_playing = true;
+  update_power_state(false);
+
+  // Start Output
+  return output->start();
+}
+
+static esp_err_t do_play(const char *filepath, uint32_t ms) {
+  fade_out();
+  stop_song();
+
+  // Use the preloaded song if there is one, its beginning is already read
+  current_stream = take_preload(filepath);
+  if (current_stream == NULL) {
+    ESP_LOGI(TAG, "Opening file: %s", filepath);
+    current_stream = readahead_open(filepath);
+  } else {
+    ESP_LOGI(TAG, "Playing preloaded file: %s", filepath);
+  }
+  if (current_stream == NULL) {
+    ESP_LOGE(TAG, "Failed to open file");
+    return ESP_FAIL;
+  }
+
+  esp_err_t ret = decoder_open(&decoder, current_stream, filepath);
+  if (ret != ESP_OK) {
+    ESP_LOGE(TAG, "No decoder for file: %s", esp_err_to_name(ret));
+    readahead_close(current_stream);
+    current_stream = NULL;
+    return ret;
+  }
+
+  // Start further in, before the output runs so nothing of the beginning
+  // is heard
+  uint32_t frame = (uint32_t)((uint64_t)ms * decoder.format.sample_rate / 1000);
+  if (frame > 0 && decoder_seek(&decoder, frame) != ESP_OK) {
+    ESP_LOGW(TAG, "Can't start at %" PRIu32 " ms, playing from the start", ms);
+    frame = 0;
+    decoder_seek(&decoder, 0);
+  }
+  position_switch = false;
+
+  return start_song(frame);
+}
+
+// Skip to the queued song right away, or end the current one if there is
+// none
+static esp_err_t do_next(void) {
+  if (current_stream == NULL) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  fade_out();
+  if (!open_next()) {
+    stop_song();
+    emit_event(MPLAYER_EVENT_FINISHED, MPLAYER_CMD_NEXT, ESP_OK);
+    return ESP_OK;
+  }
+
+  // Like a stop and play, without closing the next song
+  output->stop();
+  transition_silence = 0;
+  in_transition = true;
+  output_stopped_us = esp_timer_get_time();
+  switch_to_next();
+  return start_song(0);
+}
+
+static esp_err_t do_preload(const char *filepath) {
+  preload_t *slot = NULL;
+  for (int i = 0; i < PRELOAD_SLOTS; i++) {
+    if (preloads[i].stream != NULL &&
+        strcmp(preloads[i].path, filepath) == 0) {
+      // Already there
+      return ESP_OK;
+    }
+    if (preloads[i].stream == NULL && slot == NULL) {
+      slot = &preloads[i];
+    }
+  }
+  if (slot == NULL) {
+    // All taken, drop the one that is not going to play next
+    slot = (queued == &preloads[0]) ? &preloads[1] : &preloads[0];
+    readahead_close(slot->stream);
+    slot->stream = NULL;
+    if (queued == slot) {
+      queued = NULL;
+    }
+  }
+
+  slot->stream = readahead_open(filepath);
+  if (slot->stream == NULL) {
+    return ESP_FAIL;
+  }
+  strcpy(slot->path, filepath);
+  return ESP_OK;
+}
+
+static esp_err_t do_set_next(const char *filepath) {
+  queued = NULL;
+  if (filepath[0] == '\0') {
+    return ESP_OK;
+  }
+
+  ESP_RETURN_ON_ERROR(do_preload(filepath), TAG,
+                      "Failed to preload next song");
+  for (int i = 0; i < PRELOAD_SLOTS; i++) {
+    if (preloads[i].stream != NULL &&
+        strcmp(preloads[i].path, filepath) == 0) {
+      queued = &preloads[i];
+    }
+  }
+  return queued != NULL ? ESP_OK : ESP_FAIL;
+}
+
+static void run_command(const player_cmd_t *cmd) {
+  esp_err_t ret = ESP_OK;
+  mplayer_event_type_t done = MPLAYER_EVENT_ERROR;
+
+  count_command(esp_timer_get_time() - cmd->queued_us);
+
+  switch (cmd->type) {
+  case MPLAYER_CMD_PLAY:
+    ret = do_play(cmd->path, cmd->ms);
+    done = MPLAYER_EVENT_STARTED;
+    break;
+
+  case MPLAYER_CMD_STOP:
+    ESP_LOGI(TAG, "Stopping Player...");
+    fade_out();
+    stop_song();
+    ESP_LOGI(TAG, "Player Stopped");
+    done = MPLAYER_EVENT_STOPPED;
+    break;
+
+  case MPLAYER_CMD_PAUSE:
+    if (!is_playing) {
+      ret = ESP_ERR_INVALID_STATE;
+      break;
+    }
+    fade_out();
+    is_paused = true;
+    // Nothing to move out while paused, the DAC and its DMA can rest
+    output->stop();
+    update_power_state(false);
+    ESP_LOGI(TAG, "Paused");
+    done = MPLAYER_EVENT_PAUSED;
+    break;
+
+  case MPLAYER_CMD_RESUME:
+    if (!is_playing) {
+      ret = ESP_ERR_INVALID_STATE;
+      break;
+    }
+    if (is_paused) {
+      fade_in_hidden();
+    }
+    is_paused = false;
+    update_power_state(false);
+    ret = output->start();
+    ESP_LOGI(TAG, "Resumed");
+    done = MPLAYER_EVENT_RESUMED;
+    break;
+
+  case MPLAYER_CMD_SEEK:
+    ret = do_seek(cmd->ms);
+    done = MPLAYER_EVENT_SEEKED;
+    break;
+
+  case MPLAYER_CMD_SEEK_RELATIVE: {
+    // From where the output is now, not where it was when asked
+    int64_t target = (int64_t)mplayer_get_position_ms() + cmd->delta_ms;
+    if (target < 0) {
+      target = 0;
+    }
+    if (duration_ms > 0 && target > duration_ms) {
+      target = duration_ms;
+    }
+    ret = do_seek((uint32_t)target);
+    done = MPLAYER_EVENT_SEEKED;
+    break;
+  }
+
+  case MPLAYER_CMD_NEXT:
+    ret = do_next();
+    // Finished or advanced was already told
+    if (ret == ESP_OK) {
+      return;
     }
+    break;
+
+  case MPLAYER_CMD_PRELOAD:
+    ret = do_preload(cmd->path);
+    break;
+
+  case MPLAYER_CMD_SET_NEXT:
+    ret = do_set_next(cmd->path);
+    break;
+
+  default:
+    ret = ESP_ERR_INVALID_ARG;
+    break;
   }
 
-  return need_yield;
+  if (ret != ESP_OK) {
+    emit_event(MPLAYER_EVENT_ERROR, cmd->type, ret);
+  } else if (done != MPLAYER_EVENT_ERROR) {
+    emit_event(done, cmd->type, ESP_OK);
+  }
+}
+
+static esp_err_t send_command(player_cmd_t *cmd) {
+  if (cmd_queue == NULL) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  cmd->queued_us = esp_timer_get_time();
+  if (xQueueSend(cmd_queue, cmd, pdMS_TO_TICKS(CMD_WAIT_MS)) != pdTRUE) {
+    ESP_LOGE(TAG, "Command queue full");
+    return ESP_ERR_TIMEOUT;
+  }
+  xTaskNotifyGive(player_task_handle);
+  return ESP_OK;
+}
+
+static esp_err_t send_path_command(mplayer_cmd_t type, const char *filepath,
+                                   uint32_t ms) {
+  player_cmd_t cmd = {.type = type, .ms = ms};
+  if (filepath != NULL) {
+    if (strlen(filepath) >= PRELOAD_PATH_LEN) {
+      return ESP_ERR_INVALID_ARG;
+    }
+    strcpy(cmd.path, filepath);
+  }
+  return send_command(&cmd);
 }
 
 // Player Task
 static void player_task(void *arg) {
-  uint8_t temp_chunk[256];
-  size_t chunk_size = sizeof(temp_chunk);
+  audio_ring_span_t spans[2];
+  static player_cmd_t cmd;
+
+#if CONFIG_PM_ENABLE
+  // Held from here on while awake, wait_for_event lets it go
+  esp_pm_lock_acquire(decode_lock);
+#endif
 
   while (1) {
-    // Wait for play signal
-    if (!is_playing) {
-      if (play_sem)
-        xSemaphoreTake(play_sem, portMAX_DELAY);
+    while (xQueueReceive(cmd_queue, &cmd, 0) == pdTRUE) {
+      run_command(&cmd);
+    }
+
+    // Nothing to do until play or resume
+    if (!is_playing || is_paused || current_stream == NULL) {
+      wait_for_event();
+      continue;
     }
 
-    if (is_playing && current_file) {
-      if (is_paused) {
-        vTaskDelay(pdMS_TO_TICKS(100));
+    if (song_over) {
+      // Let the output play what is left, it signals once the ring is empty
+      draining = true;
+      if (audio_ring_used(&audio_ring) > 0) {
+        wait_for_event();
         continue;
       }
+      draining = false;
 
-      size_t free_space = buffer_free_space();
-      if (free_space >= chunk_size) {
-        size_t bytes_read = fread(temp_chunk, 1, chunk_size, current_file);
+      output->stop();
+      output_stopped_us = esp_timer_get_time();
+      if (next_stream != NULL && restart_with_next() == ESP_OK) {
+        continue;
+      }
 
-        if (bytes_read > 0) {
-          for (size_t i = 0; i < bytes_read; i++) {
-            audio_buffer[buf_head] = temp_chunk[i];
-            buf_head = (buf_head + 1) % BUFFER_SIZE;
-          }
-        }
+      is_playing = false;
+      decoder_close(&decoder);
+      readahead_close(current_stream);
+      current_stream = NULL;
+      update_power_state(false);
+      emit_event(MPLAYER_EVENT_FINISHED, MPLAYER_CMD_NONE, ESP_OK);
+      continue;
+    }
 
-        if (bytes_read < chunk_size) {
-          // EOF reached
-          if (feof(current_file)) {
-            ESP_LOGI(TAG, "End of file reached");
-            // Wait for buffer to drain?
-            // For simplicity, we just stop ensuring the last bits are played
-            // Real implementation would wait for buffer_is_empty()
-            while (!buffer_is_empty()) {
-              vTaskDelay(pdMS_TO_TICKS(10));
-            }
-
-            is_playing = false;
-            song_finished = true;
-            fclose(current_file);
-            current_file = NULL;
-            gptimer_stop(timer_handle);
-          }
-        }
-      } else {
-        // Buffer full, wait a bit
-        vTaskDelay(pdMS_TO_TICKS(10));
+    if (audio_ring_write_spans(&audio_ring, spans) < PCM_BLOCK) {
+      // Ring full, sleep until the output drains it under the watermark.
+      // The flag is raised before checking again so a drain in between
+      // can't be missed
+      refill_wanted = true;
+      if (audio_ring_free(&audio_ring) < PCM_BLOCK) {
+        wait_for_event();
       }
-    } else {
-      // Should not happen if logic is correct
-      vTaskDelay(pdMS_TO_TICKS(100));
+      continue;
+    }
+
+    int64_t start = esp_timer_get_time();
+    bool more = produce_block(spans);
+    count_decode(esp_timer_get_time() - start);
+    if (!more) {
+      ESP_LOGI(TAG, "End of file reached");
+      start_transition();
+      song_over = true;
     }
   }
 }
 
+#if CONFIG_MPLAYER_STATS_LOG_INTERVAL > 0
+static void stats_timer_cb(void *arg) { mplayer_log_stats(); }
+#endif
+
 esp_err_t mplayer_setup(void) {
   ESP_LOGI(TAG, "Setting up Player...");
 
-  // 1. DAC Setup
-  dac_oneshot_config_t dac_cfg = {
-      .chan_id = DAC_CHAN_1,
-  };
-  ESP_RETURN_ON_ERROR(dac_oneshot_new_channel(&dac_cfg, &dac_handle), TAG,
-                      "Failed to create DAC channel");
-
-  // 2. Timer Setup
-  gptimer_config_t timer_config = {
-      .clk_src = GPTIMER_CLK_SRC_DEFAULT,
-      .direction = GPTIMER_COUNT_UP,
-      .resolution_hz = TIMER_RESOLUTION_HZ,
-  };
-  ESP_RETURN_ON_ERROR(gptimer_new_timer(&timer_config, &timer_handle), TAG,
-                      "Failed to create timer");
+  ESP_RETURN_ON_ERROR(audio_ring_init(&audio_ring, audio_buffer, BUFFER_SIZE),
+                      TAG, "Failed to setup audio buffer");
+  dsp_init(&dsp, volume_gain);
 
-  gptimer_event_callbacks_t cbs = {
-      .on_alarm = on_timer_alarm,
-  };
-  ESP_RETURN_ON_ERROR(
-      gptimer_register_event_callbacks(timer_handle, &cbs, NULL), TAG,
-      "Failed to register callbacks");
+  // 1. Output Setup
+#if CONFIG_MPLAYER_OUTPUT_DAC_DMA
+  output = &output_dac_dma;
+#else
+  output = &output_sink;
+#endif
+  ESP_RETURN_ON_ERROR(output->init(SAMPLE_RATE, output_pull, NULL), TAG,
+                      "Failed to setup %s output", output->name);
 
-  gptimer_alarm_config_t alarm_config = {
-      .alarm_count = ALARM_COUNT,
-      .reload_count = 0,
-      .flags.auto_reload_on_alarm = true,
-  };
-  ESP_RETURN_ON_ERROR(gptimer_set_alarm_action(timer_handle, &alarm_config),
-                      TAG, "Failed to set alarm");
-  ESP_RETURN_ON_ERROR(gptimer_enable(timer_handle), TAG,
-                      "Failed to enable timer");
-
-  // 3. Task Setup
-  play_sem = xSemaphoreCreateBinary();
-  BaseType_t ret = xTaskCreate(player_task, "player_task", 4096, NULL, 5,
-                               &player_task_handle);
+  // 2. Task Setup
+  ESP_RETURN_ON_ERROR(readahead_setup(), TAG, "Failed to setup read-ahead");
+  cmd_queue = xQueueCreate(CMD_QUEUE_LEN, sizeof(player_cmd_t));
+  if (cmd_queue == NULL) {
+    return ESP_ERR_NO_MEM;
+  }
+#if CONFIG_PM_ENABLE
+  ESP_RETURN_ON_ERROR(esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, "mplayer",
+                                         &decode_lock),
+                      TAG, "Failed to create power lock");
+#endif
+  power_since = esp_timer_get_time();
+  stats_since = power_since;
+  BaseType_t ret = xTaskCreatePinnedToCore(player_task, "player_task", 4096,
+                                           NULL, PLAYER_PRIORITY,
+                                           &player_task_handle, PLAYER_CORE);
   if (ret != pdPASS) {
     return ESP_FAIL;
   }
 
+#if CONFIG_MPLAYER_STATS_LOG_INTERVAL > 0
+  const esp_timer_create_args_t timer_args = {
+      .callback = stats_timer_cb,
+      .name = "mplayer_stats",
+  };
+  ESP_RETURN_ON_ERROR(esp_timer_create(&timer_args, &stats_timer), TAG,
+                      "Failed to create stats timer");
+  ESP_RETURN_ON_ERROR(
+      esp_timer_start_periodic(stats_timer,
+                               CONFIG_MPLAYER_STATS_LOG_INTERVAL * 1000000ULL),
+      TAG, "Failed to start stats timer");
+#endif
+
   ESP_LOGI(TAG, "Player Setup Complete");
   return ESP_OK;
 }
 
-esp_err_t mplayer_play(char *filepath) {
-  if (is_playing) {
-    ESP_LOGW(TAG, "Already playing, stop first");
-    return ESP_ERR_INVALID_STATE;
-  }
+void mplayer_set_event_callback(mplayer_event_cb_t cb, void *ctx) {
+  event_ctx = ctx;
+  event_cb = cb;
+}
 
-  ESP_LOGI(TAG, "Opening file: %s", filepath);
-  current_file = fopen(filepath, "rb");
-  if (current_file == NULL) {
-    ESP_LOGE(TAG, "Failed to open file");
-    return ESP_FAIL;
-  }
+esp_err_t mplayer_play(const char *filepath) {
+  return mplayer_play_from(filepath, 0);
+}
 
-  // Reset buffer
-  buf_head = 0;
-  buf_tail = 0;
-  is_paused = false;
-  is_playing = true;
-  song_finished = false;
+esp_err_t mplayer_play_from(const char *filepath, uint32_t ms) {
+  return send_path_command(MPLAYER_CMD_PLAY, filepath, ms);
+}
+
+esp_err_t mplayer_pause(void) {
+  player_cmd_t cmd = {.type = MPLAYER_CMD_PAUSE};
+  return send_command(&cmd);
+}
+
+esp_err_t mplayer_resume(void) {
+  player_cmd_t cmd = {.type = MPLAYER_CMD_RESUME};
+  return send_command(&cmd);
+}
 
-  // Start Timer
-  ESP_ERROR_CHECK(gptimer_start(timer_handle));
+esp_err_t mplayer_stop(void) {
+  player_cmd_t cmd = {.type = MPLAYER_CMD_STOP};
+  return send_command(&cmd);
+}
 
-  // Notify task
-  xSemaphoreGive(play_sem);
+esp_err_t mplayer_next(void) {
+  player_cmd_t cmd = {.type = MPLAYER_CMD_NEXT};
+  return send_command(&cmd);
+}
 
-  return ESP_OK;
+esp_err_t mplayer_preload(const char *filepath) {
+  return send_path_command(MPLAYER_CMD_PRELOAD, filepath, 0);
 }
 
-esp_err_t mplayer_pause(void) {
-  if (!is_playing)
-    return ESP_FAIL;
-  is_paused = true;
-  ESP_LOGI(TAG, "Paused");
-  return ESP_OK;
+esp_err_t mplayer_set_next(const char *filepath) {
+  return send_path_command(MPLAYER_CMD_SET_NEXT, filepath, 0);
 }
 
-esp_err_t mplayer_resume(void) {
-  if (!is_playing)
-    return ESP_FAIL;
-  is_paused = false;
-  ESP_LOGI(TAG, "Resumed");
+esp_err_t mplayer_seek(uint32_t ms) {
+  player_cmd_t cmd = {.type = MPLAYER_CMD_SEEK, .ms = ms};
+  return send_command(&cmd);
+}
+
+esp_err_t mplayer_seek_relative(int32_t delta_ms) {
+  player_cmd_t cmd = {.type = MPLAYER_CMD_SEEK_RELATIVE, .delta_ms = delta_ms};
+  return send_command(&cmd);
+}
+
+esp_err_t mplayer_set_volume(uint8_t percent) {
+  if (percent > 100) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  volume = percent;
+  volume_gain = (uint32_t)percent * percent * DSP_UNITY_GAIN / 10000;
   return ESP_OK;
 }
 
-esp_err_t mplayer_stop(void) {
-  ESP_LOGI(TAG, "Stopping Player...");
+uint8_t mplayer_get_volume(void) { return volume; }
 
-  // 1. Stop the timer (ISR)
-  if (timer_handle) {
-    gptimer_stop(timer_handle);
-    gptimer_set_raw_count(timer_handle, 0);
+uint32_t mplayer_get_position_ms(void) {
+  if (!is_playing) {
+    return 0;
   }
+  size_t played = samples_read - position_at;
+  return position_ms + (uint32_t)((uint64_t)played * 1000 / out_rate);
+}
 
-  // 2. Stop the logical playback
-  is_playing = false;
-  is_paused = false;
+int64_t mplayer_get_first_sample_time(void) { return first_sample_us; }
+
+uint32_t mplayer_get_duration_ms(void) {
+  return is_playing ? duration_ms : 0;
+}
+
+void mplayer_get_wakeups(mplayer_wakeups_t *out) { *out = wakeups; }
 
-  // 3. Close file
-  if (current_file) {
-    fclose(current_file);
-    current_file = NULL;
+void mplayer_get_gaps(mplayer_gaps_t *out) { *out = gaps; }
+
+void mplayer_get_power(mplayer_power_t *out) {
+  taskENTER_CRITICAL(&power_mux);
+  *out = power;
+  out->time_us[power.state] += esp_timer_get_time() - power_since;
+  taskEXIT_CRITICAL(&power_mux);
+}
+
+void mplayer_get_stats(mplayer_stats_t *out) {
+  taskENTER_CRITICAL(&stats_mux);
+  *out = stats;
+  uint64_t fills = fill_sum;
+  uint64_t pull_time = pull_time_sum;
+  uint64_t pull_cycles = pull_cycle_sum;
+  uint64_t cmd_latency = cmd_latency_sum;
+  int64_t since = stats_since;
+  taskEXIT_CRITICAL(&stats_mux);
+
+  if (out->blocks > 0) {
+    out->fill_avg = (uint32_t)(fills / out->blocks);
+    out->pull_avg_us = (uint32_t)(pull_time / out->blocks);
+    out->pull_avg_cycles = (uint32_t)(pull_cycles / out->blocks);
+  } else {
+    out->fill_min = 0;
   }
+  if (out->commands > 0) {
+    out->cmd_latency_avg_us = (uint32_t)(cmd_latency / out->commands);
+  }
+  out->pull_time_us = (int64_t)pull_time;
+  out->elapsed_us = esp_timer_get_time() - since;
+  out->player_stack_free = uxTaskGetStackHighWaterMark(player_task_handle);
+  readahead_get_stats(&out->reader);
+}
 
-  // 4. Clear Buffer
-  memset(audio_buffer, 0, BUFFER_SIZE);
-  buf_head = 0;
-  buf_tail = 0;
+void mplayer_reset_stats(void) {
+  taskENTER_CRITICAL(&stats_mux);
+  memset(&stats, 0, sizeof(stats));
+  stats.fill_min = BUFFER_SIZE;
+  fill_sum = 0;
+  pull_time_sum = 0;
+  pull_cycle_sum = 0;
+  cmd_latency_sum = 0;
+  underrun_run = 0;
+  stats_since = esp_timer_get_time();
+  taskEXIT_CRITICAL(&stats_mux);
+}
 
-  ESP_LOGI(TAG, "Player Stopped");
-  return ESP_OK;
+// Tenths of a percent of the time since setup
+static uint32_t load_permille(int64_t busy_us, int64_t elapsed_us) {
+  return elapsed_us > 0 ? (uint32_t)(busy_us * 1000 / elapsed_us) : 0;
 }
 
-bool mplayer_has_finished(void) { return song_finished; }
+void mplayer_log_stats(void) {
+  mplayer_stats_t st;
+  mplayer_get_stats(&st);
+
+  ESP_LOGI(TAG,
+           "Stats: %" PRIu32 " blocks, %" PRIu32 " underruns (%" PRIu32
+           " samples, longest %" PRIu32 ")",
+           st.blocks, st.underruns, st.underrun_samples, st.longest_underrun);
+  ESP_LOGI(TAG,
+           "Ring: min %" PRIu32 " avg %" PRIu32 " of %d, by eighths %" PRIu32
+           " %" PRIu32 " %" PRIu32 " %" PRIu32 " %" PRIu32 " %" PRIu32
+           " %" PRIu32 " %" PRIu32,
+           st.fill_min, st.fill_avg, BUFFER_SIZE, st.fill[0], st.fill[1],
+           st.fill[2], st.fill[3], st.fill[4], st.fill[5], st.fill[6],
+           st.fill[7]);
+  ESP_LOGI(TAG,
+           "Reads: %" PRIu32 ", max %" PRIu32 " us, under 0.5/1/2/4/8/16/32 ms+"
+           " %" PRIu32 " %" PRIu32 " %" PRIu32 " %" PRIu32 " %" PRIu32
+           " %" PRIu32 " %" PRIu32 " %" PRIu32 ", %" PRIu32
+           " stalls (%lld ms)",
+           st.reader.reads, st.reader.max_read_us, st.reader.latency[0],
+           st.reader.latency[1], st.reader.latency[2], st.reader.latency[3],
+           st.reader.latency[4], st.reader.latency[5], st.reader.latency[6],
+           st.reader.latency[7], st.reader.stalls,
+           (long long)(st.reader.stall_time_us / 1000));
+  ESP_LOGI(TAG,
+           "Pull: avg %" PRIu32 " us max %" PRIu32 " us (%" PRIu32
+           " / %" PRIu32 " cycles), stack free: player %" PRIu32
+           " reader %" PRIu32,
+           st.pull_avg_us, st.pull_max_us, st.pull_avg_cycles,
+           st.pull_max_cycles, st.player_stack_free, st.reader.stack_free);
+
+  uint32_t reader = load_permille(st.reader.read_time_us, st.elapsed_us);
+  uint32_t decoder = load_permille(st.decode_time_us, st.elapsed_us);
+  uint32_t pull = load_permille(st.pull_time_us, st.elapsed_us);
+  ESP_LOGI(TAG,
+           "Load: reader %" PRIu32 ".%" PRIu32 "%% decoder %" PRIu32 ".%" PRIu32
+           "%% output %" PRIu32 ".%" PRIu32 "%%, %" PRIu32 " commands waited"
+           " avg %" PRIu32 " us max %" PRIu32 " us, ring holds %" PRIu32 " ms",
+           reader / 10, reader % 10, decoder / 10, decoder % 10, pull / 10,
+           pull % 10, st.commands, st.cmd_latency_avg_us, st.cmd_latency_max_us,
+           st.fill_avg * 1000 / out_rate);
+
+  // Per minute of playback, the card may also have been read while idle
+  // (library refresh, preloads)
+  mplayer_power_t pw;
+  mplayer_get_power(&pw);
+  int64_t playing = pw.time_us[MPLAYER_POWER_DECODING] +
+                    pw.time_us[MPLAYER_POWER_WAITING];
+  uint32_t card = load_permille(st.reader.card_busy_us, playing);
+  uint32_t card_wakeups =
+      playing > 0 ? (uint32_t)(st.reader.wakeups * 60000000LL / playing) : 0;
+  ESP_LOGI(TAG,
+           "Card: busy %" PRIu32 ".%" PRIu32 "%% of playback (%" PRIu32
+           " ms per minute), %" PRIu32 " wakeups per minute, %" PRIu32
+           " bursts",
+           card / 10, card % 10, card * 60, card_wakeups, st.reader.bursts);
+}
@@ -0,0 +1,362 @@
+#include "playlist.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include <ctype.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+static const char *TAG = "PLAYLIST";
+
+#define INDEX_MAGIC 0x4c50504dU // "MPPL"
+#define INDEX_VERSION 1
+#define CHUNK 512 // Playlist bytes read at a time
+#define INDEX_PATH_LEN (PLAYLIST_DIR_LEN + 64)
+
+// Start of the index file, the offsets follow it
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t reserved;
+    uint32_t count;
+    uint32_t size;  // Of the playlist it was made from
+    uint32_t mtime; // Same
+} index_header_t;
+
+// Called with every entry of the playlist, where it starts and its line
+// (trimmed), false to stop there
+typedef bool (*entry_cb_t)(playlist_t *pl, uint32_t offset, char *line,
+                           void *ctx);
+
+// Index goes next to the playlist as a hidden file, so the library does
+// not list it
+static void index_path(char *out, size_t len, const char *path) {
+  const char *slash = strrchr(path, '/');
+  const char *name = slash ? slash + 1 : path;
+  snprintf(out, len, "%.*s.%s%s", (int)(name - path), path, name,
+           PLAYLIST_INDEX_SUFFIX);
+}
+
+static long file_size(FILE *file) {
+  if (fseek(file, 0, SEEK_END) != 0) {
+    return -1;
+  }
+  return ftell(file);
+}
+
+static void trim_end(char *s) {
+  size_t len = strlen(s);
+  while (len > 0 && (s[len - 1] == '\r' || s[len - 1] == '\n' ||
+                     s[len - 1] == ' ' || s[len - 1] == '\t')) {
+    s[--len] = '\0';
+  }
+}
+
+// Drop empty and "." segments and apply ".." in place, `path` starts with
+// '/' and never goes above it. Segments only get shorter or go away so
+// the result is always written behind what is left to read
+static void normalize(char *path) {
+  char *out = path;
+  const char *in = path;
+
+  while (*in != '\0') {
+    while (*in == '/') {
+      in++;
+    }
+    const char *seg = in;
+    while (*in != '\0' && *in != '/') {
+      in++;
+    }
+    size_t seg_len = in - seg;
+    if (seg_len == 0 || (seg_len == 1 && seg[0] == '.')) {
+      continue;
+    }
+    if (seg_len == 2 && seg[0] == '.' && seg[1] == '.') {
+      while (out > path && *--out != '/') {
+      }
+      continue;
+    }
+    *out++ = '/';
+    memmove(out, seg, seg_len);
+    out += seg_len;
+  }
+  *out = '\0';
+}
+
+// Turn an entry into a full path, only as a string, nothing is looked up
+// on the card
+static esp_err_t resolve(const playlist_t *pl, char *entry, char *out,
+                         size_t len) {
+  for (char *p = entry; *p != '\0'; p++) {
+    if (*p == '\\') {
+      *p = '/';
+    }
+  }
+  bool absolute = false;
+  if (isalpha((unsigned char)entry[0]) && entry[1] == ':') {
+    // Drive letter, from the card root
+    entry += 2;
+    absolute = true;
+  }
+  if (entry[0] == '/') {
+    absolute = true;
+  }
+
+  const char *dir = absolute ? "" : pl->dir;
+  int n = snprintf(out, len, "%s/%s/%s", pl->root, dir, entry);
+  if (n < 0 || (size_t)n >= len) {
+    return ESP_ERR_INVALID_SIZE;
+  }
+  normalize(out + strlen(pl->root));
+  return ESP_OK;
+}
+
+// A whole line is in `pl->line`, hand it over if it is an entry
+static bool take_line(playlist_t *pl, uint32_t start, bool too_long,
+                      entry_cb_t cb, void *ctx) {
+  char *s = pl->line;
+  uint32_t offset = start;
+
+  if (start == 0 && memcmp(s, "\xEF\xBB\xBF", 3) == 0) {
+    // UTF-8 BOM
+    s += 3;
+    offset += 3;
+  }
+  while (*s == ' ' || *s == '\t') {
+    s++;
+    offset++;
+  }
+  trim_end(s);
+  if (*s == '\0' || *s == '#' || strstr(s, "://") != NULL) {
+    return true;
+  }
+  if (too_long) {
+    ESP_LOGW(TAG, "Entry at byte %" PRIu32 " too long, skipping", start);
+    return true;
+  }
+  return cb(pl, offset, s, ctx);
+}
+
+// Go through the playlist a chunk at a time, lines longer than the line
+// buffer are only kept track of to be skipped
+static esp_err_t parse(playlist_t *pl, entry_cb_t cb, void *ctx) {
+  uint8_t chunk[CHUNK];
+  uint32_t pos = 0;
+  uint32_t line_start = 0;
+  size_t line_len = 0;
+  bool too_long = false;
+  size_t got;
+
+  if (fseek(pl->file, 0, SEEK_SET) != 0) {
+    return ESP_FAIL;
+  }
+  while ((got = fread(chunk, 1, sizeof(chunk), pl->file)) > 0) {
+    for (size_t i = 0; i < got; i++) {
+      if (chunk[i] == '\n') {
+        pl->line[line_len] = '\0';
+        if (!take_line(pl, line_start, too_long, cb, ctx)) {
+          return ESP_OK;
+        }
+        line_start = pos + i + 1;
+        line_len = 0;
+        too_long = false;
+      } else if (line_len < sizeof(pl->line) - 1) {
+        pl->line[line_len++] = (char)chunk[i];
+      } else {
+        too_long = true;
+      }
+    }
+    pos += got;
+  }
+  if (ferror(pl->file)) {
+    return ESP_FAIL;
+  }
+
+  // Last line without a newline
+  if (line_len > 0) {
+    pl->line[line_len] = '\0';
+    take_line(pl, line_start, too_long, cb, ctx);
+  }
+  return ESP_OK;
+}
+
+static bool add_entry(playlist_t *pl, uint32_t offset, char *line,
+                      void *ctx) {
+  if (fwrite(&offset, sizeof(offset), 1, pl->index) != 1) {
+    *(bool *)ctx = true;
+    return false;
+  }
+  pl->count++;
+  return true;
+}
+
+static esp_err_t build_index(playlist_t *pl, const char *path,
+                             const index_header_t *want) {
+  int64_t start = esp_timer_get_time();
+  index_header_t hdr = {0};
+
+  pl->index = fopen(path, "w+b");
+  if (pl->index == NULL) {
+    ESP_LOGE(TAG, "Failed to create %s", path);
+    return ESP_FAIL;
+  }
+  // Blank header for now, the real one goes in once all offsets are there
+  bool failed = fwrite(&hdr, sizeof(hdr), 1, pl->index) != 1;
+  pl->count = 0;
+  if (!failed && parse(pl, add_entry, &failed) != ESP_OK) {
+    failed = true;
+  }
+
+  hdr = *want;
+  hdr.count = pl->count;
+  if (failed || fseek(pl->index, 0, SEEK_SET) != 0 ||
+      fwrite(&hdr, sizeof(hdr), 1, pl->index) != 1 ||
+      fflush(pl->index) != 0) {
+    ESP_LOGE(TAG, "Failed to write %s", path);
+    fclose(pl->index);
+    pl->index = NULL;
+    remove(path);
+    return ESP_FAIL;
+  }
+
+  ESP_LOGI(TAG, "Indexed %" PRIu32 " entries in %" PRId64 " ms", pl->count,
+           (esp_timer_get_time() - start) / 1000);
+  return ESP_OK;
+}
+
+// Open the index if it was made from the playlist as it is now
+static bool open_index(playlist_t *pl, const char *path,
+                       const index_header_t *want) {
+  index_header_t hdr;
+
+  pl->index = fopen(path, "rb");
+  if (pl->index == NULL) {
+    return false;
+  }
+  if (fread(&hdr, sizeof(hdr), 1, pl->index) == 1 &&
+      hdr.magic == want->magic && hdr.version == want->version &&
+      hdr.size == want->size && hdr.mtime == want->mtime &&
+      file_size(pl->index) ==
+          (long)(sizeof(hdr) + hdr.count * sizeof(uint32_t))) {
+    pl->count = hdr.count;
+    return true;
+  }
+  fclose(pl->index);
+  pl->index = NULL;
+  return false;
+}
+
+esp_err_t playlist_open(const char *path, const char *root, playlist_t *pl) {
+  memset(pl, 0, sizeof(*pl));
+
+  // Where the playlist is under the root, relative entries start there
+  size_t root_len = strlen(root);
+  if (root_len >= sizeof(pl->root) || strncmp(path, root, root_len) != 0 ||
+      path[root_len] != '/') {
+    return ESP_ERR_INVALID_ARG;
+  }
+  const char *rel = path + root_len + 1;
+  const char *slash = strrchr(rel, '/');
+  size_t dir_len = slash ? (size_t)(slash - rel) : 0;
+  if (dir_len >= sizeof(pl->dir)) {
+    return ESP_ERR_INVALID_SIZE;
+  }
+  memcpy(pl->root, root, root_len);
+  memcpy(pl->dir, rel, dir_len);
+
+  struct stat st;
+  if (stat(path, &st) != 0) {
+    return ESP_ERR_NOT_FOUND;
+  }
+  pl->file = fopen(path, "rb");
+  if (pl->file == NULL) {
+    ESP_LOGE(TAG, "Failed to open %s", path);
+    return ESP_FAIL;
+  }
+
+  char idx_path[INDEX_PATH_LEN];
+  index_path(idx_path, sizeof(idx_path), path);
+  const index_header_t want = {
+      .magic = INDEX_MAGIC,
+      .version = INDEX_VERSION,
+      .size = (uint32_t)st.st_size,
+      .mtime = (uint32_t)st.st_mtime,
+  };
+  if (!open_index(pl, idx_path, &want) &&
+      build_index(pl, idx_path, &want) != ESP_OK) {
+    playlist_close(pl);
+    return ESP_FAIL;
+  }
+
+  ESP_LOGI(TAG, "Opened %s, %" PRIu32 " entries", path, pl->count);
+  return ESP_OK;
+}
+
+esp_err_t playlist_get(playlist_t *pl, uint32_t idx, char *path, size_t len) {
+  uint32_t offset;
+
+  if (pl->file == NULL || idx >= pl->count) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  long pos = sizeof(index_header_t) + (long)idx * sizeof(offset);
+  if (fseek(pl->index, pos, SEEK_SET) != 0 ||
+      fread(&offset, sizeof(offset), 1, pl->index) != 1 ||
+      fseek(pl->file, offset, SEEK_SET) != 0 ||
+      fgets(pl->line, sizeof(pl->line), pl->file) == NULL) {
+    ESP_LOGE(TAG, "Failed to read entry %" PRIu32, idx);
+    return ESP_FAIL;
+  }
+  trim_end(pl->line);
+  return resolve(pl, pl->line, path, len);
+}
+
+typedef struct {
+    const char *path;
+    char *buf;
+    size_t len;
+    int32_t idx;
+    int32_t found;
+} find_t;
+
+static bool match_entry(playlist_t *pl, uint32_t offset, char *line,
+                        void *ctx) {
+  find_t *f = ctx;
+  if (resolve(pl, line, f->buf, f->len) == ESP_OK &&
+      strcmp(f->buf, f->path) == 0) {
+    f->found = f->idx;
+    return false;
+  }
+  f->idx++;
+  return true;
+}
+
+int32_t playlist_find(playlist_t *pl, const char *path) {
+  if (pl->file == NULL) {
+    return -1;
+  }
+
+  // Room for an entry before it is normalized
+  find_t f = {.path = path, .len = sizeof(pl->root) + sizeof(pl->dir) +
+                                   sizeof(pl->line),
+              .found = -1};
+  f.buf = malloc(f.len);
+  if (f.buf == NULL) {
+    return -1;
+  }
+  parse(pl, match_entry, &f);
+  free(f.buf);
+  return f.found;
+}
+
+void playlist_close(playlist_t *pl) {
+  if (pl->file) {
+    fclose(pl->file);
+  }
+  if (pl->index) {
+    fclose(pl->index);
+  }
+  pl->file = NULL;
+  pl->index = NULL;
+  pl->count = 0;
+}
@@ -0,0 +1,539 @@
+#include "readahead.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#if CONFIG_MPLAYER_OUTPUT_SINK_VIRTUAL
+#include "sim.h"
+#endif
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+static const char *TAG = "READAHEAD";
+
+#define READ_SIZE CONFIG_MPLAYER_READAHEAD_SIZE
+#define MAX_STREAMS 4 // Current, next and previous song and the library
+#define READER_PRIORITY CONFIG_MPLAYER_READER_PRIORITY
+
+#if defined(CONFIG_MPLAYER_PREFETCH_KB) && CONFIG_MPLAYER_PREFETCH_KB > 0
+#define PREFETCH_SIZE (CONFIG_MPLAYER_PREFETCH_KB * 1024)
+#define PREFETCH_REFILL                                                        \
+  (PREFETCH_SIZE / 100 * CONFIG_MPLAYER_PREFETCH_REFILL_PERCENT)
+#else
+#define PREFETCH_SIZE 0
+#define PREFETCH_REFILL 0
+#endif
+// Bursts only start once this much was consumed, so opening a song to look
+// at its header or keeping the next one ready doesn't pull a whole prefetch
+#define PREFETCH_START (2 * READ_SIZE)
+// Reads closer than that keep the card busy in between, after that long
+// without a command it is back to its standby current
+#define IDLE_GAP_US 5000
+
+#if defined(CONFIG_MPLAYER_READER_CORE) && CONFIG_MPLAYER_READER_CORE >= 0
+#define READER_CORE CONFIG_MPLAYER_READER_CORE
+#else
+#define READER_CORE tskNO_AFFINITY
+#endif
+
+// Read times are in virtual time when simulating, the card latency is the
+// one the simulation says
+#if CONFIG_MPLAYER_OUTPUT_SINK_VIRTUAL
+#define now_us() sim_now_us()
+#else
+#define now_us() esp_timer_get_time()
+#endif
+
+typedef enum {
+  BUF_EMPTY = 0, // Free for the reader
+  BUF_LOADING,   // Being read into by the reader
+  BUF_READY,     // Holds `len` bytes from `offset`, only the consumer uses it
+} buf_state_t;
+
+struct readahead {
+    bool in_use;
+    bool closing;
+    FILE *file;
+    long size;
+    long file_pos;      // Where the FILE is, to skip useless fseeks
+    long tell;          // Consumer position
+    long next_offset;   // Next offset the reader loads
+    uint32_t gen;       // Bumped on seek, loads started before are dropped
+    uint8_t *buf[2];
+    long offset[2];
+    size_t len[2];
+    buf_state_t state[2];
+    SemaphoreHandle_t ready; // Given after every load of this stream
+    uint8_t *bulk;      // Prefetch ring, NULL without, byte `o` of the file
+                        // is at `o % PREFETCH_SIZE`
+    long bulk_start;    // File range held in it, only the reader touches
+    long bulk_end;      // these once the stream is open
+    bool filling;       // In a burst
+    bool bulk_loading;  // Reading into it, without the lock
+    uint32_t reads;
+    uint64_t bytes;
+    int64_t read_time_us;
+};
+
+static readahead_t streams[MAX_STREAMS];
+static SemaphoreHandle_t lock = NULL;
+static TaskHandle_t reader_task_handle = NULL;
+static readahead_stats_t stats; // Updated with the lock taken
+static int64_t last_read_end = 0;
+#if PREFETCH_SIZE > 0
+static uint8_t *bounce = NULL; // Card reads of bursts, in DMA capable memory
+#endif
+
+// Called with the lock taken after a card read
+static void count_read(readahead_t *ra, int64_t start, int64_t end,
+                       size_t got) {
+  int64_t elapsed_us = end - start;
+  int bucket = 0;
+  while (bucket < READAHEAD_LATENCY_BUCKETS - 1 &&
+         elapsed_us >= (512LL << bucket)) {
+    bucket++;
+  }
+  stats.latency[bucket]++;
+  stats.reads++;
+  stats.read_time_us += elapsed_us;
+  if (elapsed_us > stats.max_read_us) {
+    stats.max_read_us = (uint32_t)elapsed_us;
+  }
+  if (stats.wakeups > 0 && start - last_read_end < IDLE_GAP_US) {
+    stats.card_busy_us += end - last_read_end;
+  } else {
+    stats.card_busy_us += elapsed_us;
+    stats.wakeups++;
+  }
+  last_read_end = end;
+
+  ra->reads++;
+  ra->bytes += got;
+  ra->read_time_us += elapsed_us;
+}
+
+// Read from the card at `offset`, called without the lock
+static size_t card_read(readahead_t *ra, long offset, uint8_t *dst) {
+  size_t got = 0;
+  if (ra->file_pos == offset || fseek(ra->file, offset, SEEK_SET) == 0) {
+    got = fread(dst, 1, READ_SIZE, ra->file);
+    ra->file_pos = offset + (long)got;
+  } else {
+    ra->file_pos = -1;
+  }
+#if CONFIG_MPLAYER_OUTPUT_SINK_VIRTUAL
+  sim_storage_delay();
+#endif
+  return got;
+}
+
+#if PREFETCH_SIZE > 0
+// Copy between the prefetch ring and `buf`, `to_bulk` for the burst reads
+static void bulk_copy(readahead_t *ra, long offset, uint8_t *buf, size_t len,
+                      bool to_bulk) {
+  size_t pos = (size_t)(offset % PREFETCH_SIZE);
+  size_t first = len < PREFETCH_SIZE - pos ? len : PREFETCH_SIZE - pos;
+  if (to_bulk) {
+    memcpy(ra->bulk + pos, buf, first);
+    memcpy(ra->bulk, buf + first, len - first);
+  } else {
+    memcpy(buf, ra->bulk + pos, first);
+    memcpy(buf + first, ra->bulk, len - first);
+  }
+}
+
+// The block at `offset` is all in the prefetch
+static bool bulk_has(readahead_t *ra, long offset) {
+  long end = offset + READ_SIZE < ra->size ? offset + READ_SIZE : ra->size;
+  return ra->bulk != NULL && offset >= ra->bulk_start && end <= ra->bulk_end;
+}
+#endif
+
+// Load one empty buffer of `ra` if it has one, called with the lock taken
+// and returns with it taken, true if it did something
+static bool load_one(readahead_t *ra) {
+  int i;
+  for (i = 0; i < 2; i++) {
+    if (ra->state[i] == BUF_EMPTY) {
+      break;
+    }
+  }
+  if (i == 2 || ra->next_offset >= ra->size) {
+    return false;
+  }
+
+  long offset = ra->next_offset;
+  uint32_t gen = ra->gen;
+  ra->next_offset += READ_SIZE;
+  ra->state[i] = BUF_LOADING;
+  xSemaphoreGive(lock);
+
+  size_t got;
+#if PREFETCH_SIZE > 0
+  if (bulk_has(ra, offset)) {
+    // Already prefetched, the card stays idle
+    got = (size_t)((offset + READ_SIZE < ra->bulk_end ? offset + READ_SIZE
+                                                      : ra->bulk_end) -
+                   offset);
+    bulk_copy(ra, offset, ra->buf[i], got, false);
+    ra->bulk_start = offset + (long)got;
+    xSemaphoreTake(lock, portMAX_DELAY);
+  } else
+#endif
+  {
+    int64_t start = now_us();
+    got = card_read(ra, offset, ra->buf[i]);
+    int64_t end = now_us();
+#if PREFETCH_SIZE > 0
+    // Not prefetched (a seek or the start of the song), a burst goes on
+    // after it
+    ra->bulk_start = offset + (long)got;
+    ra->bulk_end = ra->bulk_start;
+#endif
+    xSemaphoreTake(lock, portMAX_DELAY);
+    count_read(ra, start, end, got);
+  }
+
+  if (gen == ra->gen) {
+    ra->offset[i] = offset;
+    ra->len[i] = got;
+    ra->state[i] = BUF_READY;
+    if (got < READ_SIZE) {
+      // Short read, the file is shorter than it said or the card failed
+      ra->size = offset + (long)got;
+    }
+  } else {
+    ra->state[i] = BUF_EMPTY;
+  }
+  xSemaphoreGive(ra->ready);
+  return true;
+}
+
+#if PREFETCH_SIZE > 0
+// One read of a prefetch burst, same locking as load_one. A burst starts
+// once less than PREFETCH_REFILL is left ahead of the buffers and goes on
+// until the prefetch is full or the file ends, so the card gets a few long
+// busy spells instead of a read every few ms
+static bool fill_one(readahead_t *ra) {
+  if (ra->bulk == NULL || ra->tell < PREFETCH_START) {
+    return false;
+  }
+
+  // What is behind the buffers is not needed anymore, what is not around
+  // them (after a seek) not at all
+  if (ra->next_offset < ra->bulk_start || ra->next_offset > ra->bulk_end) {
+    ra->bulk_start = ra->next_offset;
+    ra->bulk_end = ra->next_offset;
+  } else {
+    ra->bulk_start = ra->next_offset;
+  }
+
+  long ahead = ra->bulk_end - ra->bulk_start;
+  if (ra->bulk_end >= ra->size || ahead + READ_SIZE > PREFETCH_SIZE) {
+    ra->filling = false;
+    return false;
+  }
+  if (!ra->filling) {
+    if (ahead >= PREFETCH_REFILL) {
+      return false;
+    }
+    ra->filling = true;
+    stats.bursts++;
+  }
+
+  long offset = ra->bulk_end;
+  ra->bulk_loading = true;
+  xSemaphoreGive(lock);
+
+  int64_t start = now_us();
+  size_t got = card_read(ra, offset, bounce);
+  int64_t end = now_us();
+  bulk_copy(ra, offset, bounce, got, true);
+
+  xSemaphoreTake(lock, portMAX_DELAY);
+  count_read(ra, start, end, got);
+  ra->bulk_end = offset + (long)got;
+  ra->bulk_loading = false;
+  if (got < READ_SIZE) {
+    ra->size = ra->bulk_end;
+    ra->filling = false;
+  }
+  if (ra->closing) {
+    xSemaphoreGive(ra->ready);
+  }
+  return true;
+}
+#endif
+
+static void reader_task(void *arg) {
+  while (1) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+    // Keep going round the streams until every buffer is full
+    xSemaphoreTake(lock, portMAX_DELAY);
+    bool loaded;
+    do {
+      loaded = false;
+      for (int s = 0; s < MAX_STREAMS; s++) {
+        readahead_t *ra = &streams[s];
+        if (ra->in_use && !ra->closing && load_one(ra)) {
+          loaded = true;
+        }
+      }
+#if PREFETCH_SIZE > 0
+      // Buffers first, bursts go on a read at a time once they are full
+      for (int s = 0; s < MAX_STREAMS && !loaded; s++) {
+        readahead_t *ra = &streams[s];
+        if (ra->in_use && !ra->closing && fill_one(ra)) {
+          loaded = true;
+        }
+      }
+#endif
+    } while (loaded);
+    xSemaphoreGive(lock);
+  }
+}
+
+static inline bool buf_contains(readahead_t *ra, int i, long pos) {
+  return ra->state[i] == BUF_READY && pos >= ra->offset[i] &&
+         pos < ra->offset[i] + (long)ra->len[i];
+}
+
+esp_err_t readahead_setup(void) {
+  lock = xSemaphoreCreateMutex();
+  if (lock == NULL) {
+    return ESP_ERR_NO_MEM;
+  }
+  BaseType_t ret = xTaskCreatePinnedToCore(reader_task, "reader_task", 3072,
+                                           NULL, READER_PRIORITY,
+                                           &reader_task_handle, READER_CORE);
+  if (ret != pdPASS) {
+    return ESP_FAIL;
+  }
+#if PREFETCH_SIZE > 0
+  bounce = heap_caps_malloc(READ_SIZE, MALLOC_CAP_DMA);
+  if (bounce == NULL) {
+    return ESP_ERR_NO_MEM;
+  }
+  ESP_LOGI(TAG, "Read-ahead ready, %d bytes per read, %d KB prefetch",
+           READ_SIZE, PREFETCH_SIZE / 1024);
+#else
+  ESP_LOGI(TAG, "Read-ahead ready, %d bytes per read", READ_SIZE);
+#endif
+  return ESP_OK;
+}
+
+readahead_t *readahead_open(const char *path) {
+  readahead_t *ra = NULL;
+
+  xSemaphoreTake(lock, portMAX_DELAY);
+  for (int s = 0; s < MAX_STREAMS; s++) {
+    if (!streams[s].in_use) {
+      ra = &streams[s];
+      ra->in_use = true;
+      break;
+    }
+  }
+  xSemaphoreGive(lock);
+  if (ra == NULL) {
+    ESP_LOGE(TAG, "No free stream for %s", path);
+    return NULL;
+  }
+
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) {
+    ESP_LOGE(TAG, "Failed to open %s", path);
+    ra->in_use = false;
+    return NULL;
+  }
+  // Reads are already READ_SIZE blocks into our own buffers, the stdio buffer
+  // would only add a copy and split them into small card transfers
+  setvbuf(file, NULL, _IONBF, 0);
+
+  // Buffers stay allocated with the stream slot, they are reused
+  for (int i = 0; i < 2; i++) {
+    if (ra->buf[i] == NULL) {
+      ra->buf[i] = heap_caps_malloc(READ_SIZE, MALLOC_CAP_DMA);
+    }
+  }
+  if (ra->ready == NULL) {
+    ra->ready = xSemaphoreCreateBinary();
+  }
+#if PREFETCH_SIZE > 0
+  if (ra->bulk == NULL) {
+    ra->bulk = heap_caps_malloc(PREFETCH_SIZE, MALLOC_CAP_SPIRAM);
+    if (ra->bulk == NULL) {
+      // Still works, reading as it goes
+      ESP_LOGW(TAG, "No PSRAM for the prefetch of %s", path);
+    }
+  }
+#endif
+  if (ra->buf[0] == NULL || ra->buf[1] == NULL || ra->ready == NULL) {
+    ESP_LOGE(TAG, "Failed to allocate read-ahead buffers");
+    fclose(file);
+    ra->in_use = false;
+    return NULL;
+  }
+
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+
+  xSemaphoreTake(lock, portMAX_DELAY);
+  ra->file = file;
+  ra->size = size > 0 ? size : 0;
+  ra->file_pos = 0;
+  ra->tell = 0;
+  ra->next_offset = 0;
+  ra->gen++;
+  ra->state[0] = BUF_EMPTY;
+  ra->state[1] = BUF_EMPTY;
+  ra->bulk_start = 0;
+  ra->bulk_end = 0;
+  ra->filling = false;
+  ra->closing = false;
+  ra->reads = 0;
+  ra->bytes = 0;
+  ra->read_time_us = 0;
+  xSemaphoreGive(lock);
+
+  xTaskNotifyGive(reader_task_handle);
+  return ra;
+}
+
+void readahead_close(readahead_t *ra) {
+  if (ra == NULL) {
+    return;
+  }
+
+  // Wait for the reader to give back a buffer it may be loading
+  xSemaphoreTake(lock, portMAX_DELAY);
+  ra->closing = true;
+  while (ra->state[0] == BUF_LOADING || ra->state[1] == BUF_LOADING ||
+         ra->bulk_loading) {
+    xSemaphoreGive(lock);
+    xSemaphoreTake(ra->ready, portMAX_DELAY);
+    xSemaphoreTake(lock, portMAX_DELAY);
+  }
+  xSemaphoreGive(lock);
+
+  if (ra->reads > 0 && ra->read_time_us > 0) {
+    ESP_LOGI(TAG,
+             "%" PRIu32 " reads, %" PRIu64 " KB, %" PRIu64 " KB/s while reading",
+             ra->reads, ra->bytes / 1024,
+             ra->bytes * 1000000 / 1024 / ra->read_time_us);
+  }
+
+  fclose(ra->file);
+  ra->file = NULL;
+  ra->in_use = false;
+}
+
+size_t readahead_read(readahead_t *ra, void *dst, size_t len) {
+  size_t done = 0;
+
+  xSemaphoreTake(lock, portMAX_DELAY);
+  while (done < len && ra->tell < ra->size) {
+    int i = buf_contains(ra, 0, ra->tell) ? 0
+            : buf_contains(ra, 1, ra->tell) ? 1
+                                            : -1;
+    if (i < 0) {
+      // Not loaded yet, wait for the reader
+      xSemaphoreGive(lock);
+      int64_t start = now_us();
+      xTaskNotifyGive(reader_task_handle);
+      xSemaphoreTake(ra->ready, portMAX_DELAY);
+      xSemaphoreTake(lock, portMAX_DELAY);
+      stats.stalls++;
+      stats.stall_time_us += now_us() - start;
+      continue;
+    }
+
+    size_t pos = (size_t)(ra->tell - ra->offset[i]);
+    size_t n = ra->len[i] - pos;
+    if (n > len - done) {
+      n = len - done;
+    }
+    // Ready buffers are only touched by the consumer, no need for the lock
+    xSemaphoreGive(lock);
+    memcpy((uint8_t *)dst + done, ra->buf[i] + pos, n);
+    xSemaphoreTake(lock, portMAX_DELAY);
+
+    done += n;
+    ra->tell += n;
+    if (pos + n == ra->len[i]) {
+      // Used up, hand it back to the reader for the next block
+      ra->state[i] = BUF_EMPTY;
+      xTaskNotifyGive(reader_task_handle);
+    }
+  }
+  xSemaphoreGive(lock);
+
+  return done;
+}
+
+esp_err_t readahead_seek(readahead_t *ra, long offset, int whence) {
+  long target;
+  switch (whence) {
+  case SEEK_SET:
+    target = offset;
+    break;
+  case SEEK_CUR:
+    target = ra->tell + offset;
+    break;
+  case SEEK_END:
+    target = ra->size + offset;
+    break;
+  default:
+    return ESP_ERR_INVALID_ARG;
+  }
+  if (target < 0 || target > ra->size) {
+    return ESP_ERR_INVALID_ARG;
+  }
+
+  xSemaphoreTake(lock, portMAX_DELAY);
+  ra->tell = target;
+
+  int i = buf_contains(ra, 0, target) ? 0 : buf_contains(ra, 1, target) ? 1 : -1;
+  if (i >= 0) {
+    // Keep the buffer with the target and the one following it, if any
+    int j = 1 - i;
+    long follow = ra->offset[i] + (long)ra->len[i];
+    bool keep = (ra->state[j] == BUF_READY && ra->offset[j] == follow) ||
+                (ra->state[j] == BUF_LOADING && ra->next_offset == follow + READ_SIZE);
+    if (!keep) {
+      ra->gen++;
+      if (ra->state[j] == BUF_READY) {
+        ra->state[j] = BUF_EMPTY;
+      }
+      ra->next_offset = follow;
+    }
+  } else {
+    // Nothing useful loaded, restart from the block holding the target
+    ra->gen++;
+    for (int b = 0; b < 2; b++) {
+      if (ra->state[b] == BUF_READY) {
+        ra->state[b] = BUF_EMPTY;
+      }
+    }
+    ra->next_offset = target - target % READ_SIZE;
+  }
+  xSemaphoreGive(lock);
+
+  xTaskNotifyGive(reader_task_handle);
+  return ESP_OK;
+}
+
+long readahead_tell(readahead_t *ra) { return ra->tell; }
+
+long readahead_size(readahead_t *ra) { return ra->size; }
+
+void readahead_get_stats(readahead_stats_t *out) {
+  xSemaphoreTake(lock, portMAX_DELAY);
+  *out = stats;
+  xSemaphoreGive(lock);
+  out->stack_free = uxTaskGetStackHighWaterMark(reader_task_handle);
+}
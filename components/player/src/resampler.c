@@ -0,0 +1,179 @@
+#include "resampler.h"
+#include "esp_log.h"
+#include "resampler_coeffs.h"
+#include <inttypes.h>
+#include <string.h>
+
+static const char *TAG = "RESAMPLER";
+
+// Output frames are produced at input position pos = index + frac, the left
+// wing is applied to buf[index], buf[index - 1]... and the right one to
+// buf[index + 1], buf[index + 2]... Each input frame is `table_step` table
+// entries away from the previous one, that is PHASES per zero crossing when
+// upsampling and proportionally less when downsampling, which widens the
+// filter in time and lowers its cutoff to the output nyquist.
+
+static int16_t filter_one(const resampler_t *rs, const int16_t *center,
+                          uint32_t frac) {
+  const int16_t *coeffs = rs->coeffs;
+  const int16_t *deltas = rs->deltas;
+  int64_t acc = 0;
+
+  // Left wing, distance frac, frac + 1, ...
+  uint32_t hp = (uint32_t)(((uint64_t)frac * rs->table_step) >> 16);
+  for (const int16_t *x = center; hp < rs->wing_len; x--) {
+    uint32_t idx = hp >> 16;
+    int32_t c = coeffs[idx] + ((deltas[idx] * (int32_t)(hp & 0xFFFF)) >> 16);
+    acc += (int32_t)*x * c;
+    hp += rs->table_step;
+  }
+
+  // Right wing, distance 1 - frac, 2 - frac, ...
+  hp = (uint32_t)(((uint64_t)(0x10000 - frac) * rs->table_step) >> 16);
+  for (const int16_t *x = center + 1; hp < rs->wing_len; x++) {
+    uint32_t idx = hp >> 16;
+    int32_t c = coeffs[idx] + ((deltas[idx] * (int32_t)(hp & 0xFFFF)) >> 16);
+    acc += (int32_t)*x * c;
+    hp += rs->table_step;
+  }
+
+  // Coefficients are Q15, and so is the downsampling gain
+  acc = (acc >> 15) * rs->gain;
+  acc = (acc + (1 << 14)) >> 15;
+  if (acc > INT16_MAX) {
+    return INT16_MAX;
+  }
+  if (acc < INT16_MIN) {
+    return INT16_MIN;
+  }
+  return (int16_t)acc;
+}
+
+esp_err_t resampler_init(resampler_t *rs, uint32_t in_rate, uint32_t out_rate,
+                         resampler_quality_t quality) {
+  if (in_rate == 0 || out_rate == 0) {
+    return ESP_ERR_INVALID_ARG;
+  }
+
+  memset(rs, 0, offsetof(resampler_t, buf));
+  if (in_rate == out_rate) {
+    rs->passthrough = true;
+    return ESP_OK;
+  }
+
+  uint32_t zero_crossings;
+  switch (quality) {
+  case RESAMPLER_LOW:
+    rs->coeffs = resampler_low_coeffs;
+    rs->deltas = resampler_low_deltas;
+    zero_crossings = RESAMPLER_LOW_ZERO_CROSSINGS;
+    break;
+  case RESAMPLER_MEDIUM:
+    rs->coeffs = resampler_medium_coeffs;
+    rs->deltas = resampler_medium_deltas;
+    zero_crossings = RESAMPLER_MEDIUM_ZERO_CROSSINGS;
+    break;
+  case RESAMPLER_HIGH:
+  default:
+    rs->coeffs = resampler_high_coeffs;
+    rs->deltas = resampler_high_deltas;
+    zero_crossings = RESAMPLER_HIGH_ZERO_CROSSINGS;
+    break;
+  }
+
+  rs->wing_len = (zero_crossings * RESAMPLER_PHASES) << 16;
+  if (out_rate < in_rate) {
+    rs->table_step = (uint32_t)(((uint64_t)RESAMPLER_PHASES << 16) *
+                                out_rate / in_rate);
+    rs->gain = (int32_t)(((uint64_t)out_rate << 15) / in_rate);
+  } else {
+    rs->table_step = RESAMPLER_PHASES << 16;
+    rs->gain = 1 << 15;
+  }
+  rs->wing_frames = rs->wing_len / rs->table_step + 1;
+  rs->step = ((uint64_t)in_rate << 32) / out_rate;
+
+  // Both wings plus some room to make progress on every call
+  if (2 * rs->wing_frames + 64 > RESAMPLER_BUF_FRAMES) {
+    ESP_LOGE(TAG, "Ratio %" PRIu32 "/%" PRIu32 " too large for the buffer",
+             in_rate, out_rate);
+    return ESP_ERR_NOT_SUPPORTED;
+  }
+
+  // Start with a wing of silence as history so the first frame is centered
+  memset(rs->buf, 0, rs->wing_frames * sizeof(int16_t));
+  rs->len = rs->wing_frames;
+  rs->pos = (uint64_t)rs->wing_frames << 32;
+
+  ESP_LOGI(TAG, "%" PRIu32 " Hz -> %" PRIu32 " Hz, %" PRIu32 " taps",
+           in_rate, out_rate, 2 * rs->wing_frames);
+  return ESP_OK;
+}
+
+size_t resampler_process(resampler_t *rs, const int16_t *in,
+                         size_t *in_frames, int16_t *out, size_t max_out) {
+  if (rs->passthrough) {
+    size_t n = *in_frames < max_out ? *in_frames : max_out;
+    memcpy(out, in, n * sizeof(int16_t));
+    *in_frames = n;
+    return n;
+  }
+
+  size_t take = RESAMPLER_BUF_FRAMES - rs->len;
+  if (take > *in_frames) {
+    take = *in_frames;
+  }
+  if (take > 0) {
+    memcpy(rs->buf + rs->len, in, take * sizeof(int16_t));
+    rs->len += take;
+  }
+  *in_frames = take;
+
+  size_t produced = 0;
+  while (produced < max_out) {
+    size_t index = (size_t)(rs->pos >> 32);
+    // The right wing reaches up to index + wing_frames
+    if (index + rs->wing_frames >= rs->len) {
+      break;
+    }
+    uint32_t frac = (uint32_t)(rs->pos >> 16) & 0xFFFF;
+    out[produced++] = filter_one(rs, rs->buf + index, frac);
+    rs->pos += rs->step;
+  }
+
+  // Drop what is no longer reachable by the left wing
+  size_t index = (size_t)(rs->pos >> 32);
+  if (index > rs->wing_frames) {
+    size_t drop = index - rs->wing_frames;
+    if (drop > rs->len) {
+      drop = rs->len;
+    }
+    memmove(rs->buf, rs->buf + drop, (rs->len - drop) * sizeof(int16_t));
+    rs->len -= drop;
+    rs->pos -= (uint64_t)drop << 32;
+  }
+
+  return produced;
+}
+
+size_t resampler_flush(resampler_t *rs, int16_t *out, size_t max_out) {
+  if (rs->passthrough) {
+    return 0;
+  }
+
+  // Push a wing of silence once so the last real frames reach the center
+  if (!rs->flushed) {
+    size_t pad = rs->wing_frames + 1;
+    if (rs->len + pad > RESAMPLER_BUF_FRAMES) {
+      // Not enough room yet, make some by producing first
+      size_t none = 0;
+      return resampler_process(rs, NULL, &none, out, max_out);
+    }
+    memset(rs->buf + rs->len, 0, pad * sizeof(int16_t));
+    rs->len += pad;
+    rs->flushed = true;
+  }
+
+  size_t none = 0;
+  return resampler_process(rs, NULL, &none, out, max_out);
+}
@@ -0,0 +1,84 @@
+#include "riff.h"
+#include "esp_log.h"
+#include <string.h>
+
+static const char *TAG = "RIFF";
+
+bool riff_is_wave(const uint8_t *header, size_t len) {
+  return len >= 12 && memcmp(header, "RIFF", 4) == 0 &&
+         memcmp(header + 8, "WAVE", 4) == 0;
+}
+
+esp_err_t riff_parse_wave(readahead_t *stream, riff_wave_info_t *info) {
+  uint8_t chunk[24];
+  bool have_fmt = false;
+
+  memset(info, 0, sizeof(*info));
+  if (readahead_read(stream, chunk, 12) != 12 || !riff_is_wave(chunk, 12)) {
+    return ESP_ERR_INVALID_SIZE;
+  }
+
+  // Walk the chunks until "data", "fmt " has to show up before it
+  while (1) {
+    if (readahead_read(stream, chunk, 8) != 8) {
+      ESP_LOGE(TAG, "No data chunk found");
+      return ESP_ERR_INVALID_RESPONSE;
+    }
+    uint32_t size = riff_le32(chunk + 4);
+
+    if (memcmp(chunk, "fmt ", 4) == 0) {
+      if (size < 16 || readahead_read(stream, chunk, 16) != 16) {
+        ESP_LOGE(TAG, "Truncated fmt chunk");
+        return ESP_ERR_INVALID_RESPONSE;
+      }
+      info->format_tag = riff_le16(chunk);
+      info->channels = riff_le16(chunk + 2);
+      info->sample_rate = riff_le32(chunk + 4);
+      info->block_align = riff_le16(chunk + 12);
+      info->bits_per_sample = riff_le16(chunk + 14);
+      size -= 16;
+
+      // cbSize and the first extension word, samples per block for ADPCM
+      // and valid bits for EXTENSIBLE
+      if (size >= 4) {
+        if (readahead_read(stream, chunk, 4) != 4) {
+          return ESP_ERR_INVALID_RESPONSE;
+        }
+        if (info->format_tag == WAV_FORMAT_IMA_ADPCM) {
+          info->samples_per_block = riff_le16(chunk + 2);
+        }
+        size -= 4;
+      }
+
+      // WAVE_FORMAT_EXTENSIBLE keeps the real format tag in the sub format
+      if (info->format_tag == WAV_FORMAT_EXTENSIBLE && size >= 20) {
+        if (readahead_read(stream, chunk, 20) != 20) {
+          return ESP_ERR_INVALID_RESPONSE;
+        }
+        info->format_tag = riff_le16(chunk + 4);
+        size -= 20;
+      }
+      have_fmt = true;
+    } else if (memcmp(chunk, "fact", 4) == 0 && size >= 4) {
+      if (readahead_read(stream, chunk, 4) != 4) {
+        return ESP_ERR_INVALID_RESPONSE;
+      }
+      info->fact_frames = riff_le32(chunk);
+      size -= 4;
+    } else if (memcmp(chunk, "data", 4) == 0) {
+      if (!have_fmt) {
+        ESP_LOGE(TAG, "data chunk before fmt chunk");
+        return ESP_ERR_INVALID_RESPONSE;
+      }
+      info->data_start = (uint32_t)readahead_tell(stream);
+      info->data_size = size;
+      return ESP_OK;
+    }
+
+    // Skip the rest of the chunk, chunks are padded to an even size
+    if (readahead_seek(stream, (long)(size + (size & 1)), SEEK_CUR) !=
+        ESP_OK) {
+      return ESP_ERR_INVALID_RESPONSE;
+    }
+  }
+}
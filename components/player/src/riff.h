@@ -0,0 +1,49 @@
+#ifndef __RIFF_H__
+#define __RIFF_H__
+
+/**
+ * RIFF/WAVE header parsing shared by the decoders reading .wav files
+ */
+
+#include "esp_err.h"
+#include <stdbool.h>
+#include "readahead.h"
+#include <stdint.h>
+
+#define WAV_FORMAT_PCM 0x0001
+#define WAV_FORMAT_IMA_ADPCM 0x0011
+#define WAV_FORMAT_EXTENSIBLE 0xFFFE
+
+typedef struct {
+    uint16_t format_tag;        /**< Real tag, resolved for EXTENSIBLE */
+    uint16_t channels;
+    uint32_t sample_rate;
+    uint16_t block_align;       /**< Bytes per frame, or per block if coded */
+    uint16_t bits_per_sample;
+    uint16_t samples_per_block; /**< From the fmt extension, 0 if none */
+    uint32_t fact_frames;       /**< From the fact chunk, 0 if none */
+    uint32_t data_start;        /**< File offset of the data chunk payload */
+    uint32_t data_size;         /**< Bytes in the data chunk */
+} riff_wave_info_t;
+
+/**
+ * True if the header starts like a RIFF/WAVE file
+ */
+bool riff_is_wave(const uint8_t *header, size_t len);
+
+/**
+ * Walk the chunks of `stream` (positioned at the start) up to the data
+ * chunk and fill `info`, leaves the stream at the first byte of data
+ */
+esp_err_t riff_parse_wave(readahead_t *stream, riff_wave_info_t *info);
+
+static inline uint16_t riff_le16(const uint8_t *p) {
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static inline uint32_t riff_le32(const uint8_t *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) |
+           ((uint32_t)p[3] << 24);
+}
+
+#endif /* __RIFF_H__ */
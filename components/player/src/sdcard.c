@@ -4,34 +4,58 @@
 #include "driver/spi_common.h"
 #include "esp_err.h"
 #include "esp_log.h"
+#include "diskio_impl.h"
 #include "esp_vfs_fat.h"
 #include "hal/spi_types.h"
 #include "sdmmc_cmd.h"
 #include "soc/soc.h"
+#include "soc/soc_caps.h"
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#if SOC_SDMMC_HOST_SUPPORTED
+#include "driver/sdmmc_host.h"
+#endif
 
 #define MOUNT_POINT "/sdcard"
 
 const char *tag = "SDCARD";
 
 sdmmc_card_t *card;
-esp_err_t sdcard_init() {
-  esp_err_t ret;
+static sdcard_bus_t bus_used;
+
+void sdcard_default_bus(sdcard_bus_t *bus) {
+#if CONFIG_MPLAYER_SDCARD_SDMMC
+  bus->backend = SDCARD_BACKEND_SDMMC;
+#else
+  bus->backend = SDCARD_BACKEND_SDSPI;
+#endif
+  bus->width = CONFIG_MPLAYER_SDCARD_BUS_WIDTH;
+  bus->freq_khz = CONFIG_MPLAYER_SDCARD_FREQ_KHZ;
+}
 
-  ESP_LOGI(tag, "Initializing SDCard");
+const char *sdcard_backend_name(sdcard_backend_t backend) {
+  return backend == SDCARD_BACKEND_SDMMC ? "sdmmc" : "sdspi";
+}
+
+static esp_err_t mount_sdspi(const sdcard_bus_t *bus,
+                             const esp_vfs_fat_mount_config_t *mount_cfg) {
+  esp_err_t ret;
 
   // SPI Bus Initialization
-  const spi_bus_config_t bus_cfg = {.max_transfer_sz = 0,
-                                    .mosi_io_num = 21,
-                                    .sclk_io_num = 22,
-                                    .miso_io_num = 23,
-                                    .quadhd_io_num = -1,
-                                    .quadwp_io_num = -1,
-                                    .data4_io_num = -1,
-                                    .data5_io_num = -1,
-                                    .data6_io_num = -1,
-                                    .data7_io_num = -1,
-                                    .isr_cpu_id = PRO_CPU_NUM,
-                                    .flags = 0};
+  const spi_bus_config_t bus_cfg = {
+      .max_transfer_sz = 0,
+      .mosi_io_num = CONFIG_MPLAYER_SDCARD_SPI_MOSI,
+      .sclk_io_num = CONFIG_MPLAYER_SDCARD_SPI_SCLK,
+      .miso_io_num = CONFIG_MPLAYER_SDCARD_SPI_MISO,
+      .quadhd_io_num = -1,
+      .quadwp_io_num = -1,
+      .data4_io_num = -1,
+      .data5_io_num = -1,
+      .data6_io_num = -1,
+      .data7_io_num = -1,
+      .isr_cpu_id = PRO_CPU_NUM,
+      .flags = 0};
 
   ret = spi_bus_initialize(SPI2_HOST, &bus_cfg, SPI_DMA_CH_AUTO);
   if (ret != ESP_OK) {
@@ -41,28 +65,89 @@ esp_err_t sdcard_init() {
 
   // SDSPI Host Initialization
   sdspi_device_config_t spi_dev_config = SDSPI_DEVICE_CONFIG_DEFAULT();
+  spi_dev_config.host_id = SPI2_HOST;
+  spi_dev_config.gpio_cs = CONFIG_MPLAYER_SDCARD_SPI_CS;
 
   // initialize SDMMC Layer
   sdmmc_host_t host = SDSPI_HOST_DEFAULT();
   host.slot = SPI2_HOST;
+  host.max_freq_khz = bus->freq_khz;
+
+  ret = esp_vfs_fat_sdspi_mount(MOUNT_POINT, &host, &spi_dev_config,
+                                mount_cfg, &card);
+  if (ret != ESP_OK) {
+    spi_bus_free(SPI2_HOST);
+  }
+  return ret;
+}
+
+#if SOC_SDMMC_HOST_SUPPORTED
+static esp_err_t mount_sdmmc(const sdcard_bus_t *bus,
+                             const esp_vfs_fat_mount_config_t *mount_cfg) {
+  // Slot 1, the ESP32 has it on fixed pins and the others default to the
+  // same ones
+  sdmmc_host_t host = SDMMC_HOST_DEFAULT();
+  host.max_freq_khz = bus->freq_khz;
+
+  sdmmc_slot_config_t slot_config = SDMMC_SLOT_CONFIG_DEFAULT();
+  slot_config.width = bus->width;
+  // Not enough on their own, but they help when the board pull-ups are weak
+  slot_config.flags |= SDMMC_SLOT_FLAG_INTERNAL_PULLUP;
+
+  return esp_vfs_fat_sdmmc_mount(MOUNT_POINT, &host, &slot_config, mount_cfg,
+                                 &card);
+}
+#endif
+
+esp_err_t sdcard_init() {
+  sdcard_bus_t bus;
+  sdcard_default_bus(&bus);
+  return sdcard_init_bus(&bus);
+}
+
+esp_err_t sdcard_init_bus(const sdcard_bus_t *bus) {
+  esp_err_t ret;
+
+  ESP_LOGI(tag, "Initializing SDCard (%s, %u bit, %" PRIu32 " kHz)",
+           sdcard_backend_name(bus->backend), bus->width, bus->freq_khz);
 
   const esp_vfs_fat_mount_config_t mount_cfg = {.format_if_mount_failed = false,
                                                 .max_files = 5,
                                                 .allocation_unit_size =
                                                     16 * 1024};
 
-  ret = esp_vfs_fat_sdspi_mount(MOUNT_POINT, &host, &spi_dev_config,
-                                          &mount_cfg, &card);
+  bus_used = *bus;
+  if (bus->backend == SDCARD_BACKEND_SDSPI) {
+    bus_used.width = 1;
+    ret = mount_sdspi(bus, &mount_cfg);
+#if SOC_SDMMC_HOST_SUPPORTED
+  } else if (bus->backend == SDCARD_BACKEND_SDMMC &&
+             (bus->width == 1 || bus->width == 4)) {
+    ret = mount_sdmmc(bus, &mount_cfg);
+#endif
+  } else {
+    ret = ESP_ERR_NOT_SUPPORTED;
+  }
   if (ret != ESP_OK) {
     ESP_LOGE(tag, "Failed to mount filesystem! Error: %s", esp_err_to_name(ret));
+    card = NULL;
     return ret;
   }
+  bus_used.freq_khz = card->real_freq_khz;
 
   sdmmc_card_print_info(stdout, card);
 
   return ESP_OK;
 }
 
+esp_err_t sdcard_get_bus(sdcard_bus_t *bus) {
+  if (card == NULL) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  *bus = bus_used;
+  return ESP_OK;
+}
+
 esp_err_t sdcard_detach() {
   ESP_LOGI(tag, "Detaching SDCard");
   esp_err_t ret = esp_vfs_fat_sdcard_unmount(MOUNT_POINT, card);
@@ -70,13 +155,36 @@ esp_err_t sdcard_detach() {
     ESP_LOGE(tag, "Failed to unmount SDCard");
     return ret;
   }
-
-  ret = spi_bus_free(SPI2_HOST);
-  if (ret != ESP_OK) {
-    ESP_LOGE(tag, "Failed to free SPI bus");
-    return ret;
+  card = NULL;
+
+  // The SDMMC host is freed with the card, the SPI bus is ours
+  if (bus_used.backend == SDCARD_BACKEND_SDSPI) {
+    ret = spi_bus_free(SPI2_HOST);
+    if (ret != ESP_OK) {
+      ESP_LOGE(tag, "Failed to free SPI bus");
+      return ret;
+    }
   }
 
   ESP_LOGI(tag, "SDCard Detached");
   return ESP_OK;
 }
+
+esp_err_t sdcard_fatfs_path(const char *path, char *out, size_t len) {
+  size_t mount_len = strlen(MOUNT_POINT);
+  if (strncmp(path, MOUNT_POINT, mount_len) != 0 ||
+      (path[mount_len] != '\0' && path[mount_len] != '/')) {
+    return ESP_ERR_INVALID_ARG;
+  }
+
+  BYTE pdrv = card ? ff_diskio_get_pdrv_card(card) : 0xFF;
+  if (pdrv == 0xFF) {
+    return ESP_ERR_INVALID_STATE;
+  }
+
+  const char *rest = path[mount_len] ? path + mount_len : "/";
+  if (snprintf(out, len, "%u:%s", pdrv, rest) >= (int)len) {
+    return ESP_ERR_INVALID_SIZE;
+  }
+  return ESP_OK;
+}
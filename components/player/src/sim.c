@@ -0,0 +1,153 @@
+#include "sim.h"
+#include "esp_log.h"
+#include "freertos/semphr.h"
+
+static const char *TAG = "SIM";
+
+#define MAX_SLEEPERS 8 // Reader, test driver and some room
+
+typedef struct {
+    bool used;
+    int64_t wake_at;
+    SemaphoreHandle_t wake;
+} sleeper_t;
+
+static portMUX_TYPE sim_mux = portMUX_INITIALIZER_UNLOCKED;
+static TaskHandle_t clock_task = NULL;
+static int64_t now_us = 0;
+static sleeper_t sleepers[MAX_SLEEPERS];
+
+static sim_storage_t storage = {
+    .latency_us = CONFIG_MPLAYER_SIM_READ_LATENCY_US,
+    .jitter_us = CONFIG_MPLAYER_SIM_READ_JITTER_US,
+};
+static uint32_t storage_reads = 0;
+static uint32_t storage_seed = 1;
+
+void sim_set_clock_task(TaskHandle_t clock) {
+  for (int i = 0; i < MAX_SLEEPERS; i++) {
+    if (sleepers[i].wake == NULL) {
+      sleepers[i].wake = xSemaphoreCreateBinary();
+    }
+  }
+  clock_task = clock;
+}
+
+int64_t sim_now_us(void) {
+  taskENTER_CRITICAL(&sim_mux);
+  int64_t now = now_us;
+  taskEXIT_CRITICAL(&sim_mux);
+  return now;
+}
+
+void sim_sleep_us(uint32_t us) {
+  if (us == 0) {
+    return;
+  }
+
+  sleeper_t *slot = NULL;
+  taskENTER_CRITICAL(&sim_mux);
+  for (int i = 0; i < MAX_SLEEPERS; i++) {
+    if (!sleepers[i].used && sleepers[i].wake != NULL) {
+      slot = &sleepers[i];
+      slot->used = true;
+      slot->wake_at = now_us + us;
+      break;
+    }
+  }
+  taskEXIT_CRITICAL(&sim_mux);
+
+  if (slot == NULL) {
+    ESP_LOGE(TAG, "No room for another sleeping task");
+    return;
+  }
+  // The clock may be waiting for something to do
+  xTaskNotifyGive(clock_task);
+  xSemaphoreTake(slot->wake, portMAX_DELAY);
+}
+
+// Wake every task whose time came, semaphores are given out of the
+// critical section as that can switch tasks
+static void wake_due(void) {
+  SemaphoreHandle_t due[MAX_SLEEPERS];
+  int n = 0;
+
+  taskENTER_CRITICAL(&sim_mux);
+  for (int i = 0; i < MAX_SLEEPERS; i++) {
+    if (sleepers[i].used && sleepers[i].wake_at <= now_us) {
+      sleepers[i].used = false;
+      due[n++] = sleepers[i].wake;
+    }
+  }
+  taskEXIT_CRITICAL(&sim_mux);
+
+  for (int i = 0; i < n; i++) {
+    xSemaphoreGive(due[i]);
+  }
+}
+
+// Move the clock to the first wake up not after `limit` and wake who is
+// due, true if somebody was. Otherwise the clock goes to `limit`
+static bool step(int64_t limit) {
+  bool found = false;
+
+  taskENTER_CRITICAL(&sim_mux);
+  int64_t next = limit;
+  for (int i = 0; i < MAX_SLEEPERS; i++) {
+    if (sleepers[i].used && sleepers[i].wake_at <= next) {
+      next = sleepers[i].wake_at;
+      found = true;
+    }
+  }
+  if ((found || limit != INT64_MAX) && next > now_us) {
+    now_us = next;
+  }
+  taskEXIT_CRITICAL(&sim_mux);
+
+  if (found) {
+    wake_due();
+  }
+  return found;
+}
+
+void sim_advance_us(uint32_t us) {
+  int64_t target = sim_now_us() + us;
+  // Stop at every wake up on the way, so a task sleeping less than `us`
+  // runs at its time and not at the end
+  while (step(target)) {
+    taskYIELD();
+  }
+}
+
+bool sim_advance_to_next(void) {
+  if (!step(INT64_MAX)) {
+    return false;
+  }
+  taskYIELD();
+  return true;
+}
+
+void sim_set_storage(const sim_storage_t *new_storage) {
+  taskENTER_CRITICAL(&sim_mux);
+  storage = *new_storage;
+  storage_reads = 0;
+  storage_seed = 1;
+  taskEXIT_CRITICAL(&sim_mux);
+}
+
+void sim_storage_delay(void) {
+  taskENTER_CRITICAL(&sim_mux);
+  uint32_t delay = storage.latency_us;
+  if (storage.jitter_us > 0) {
+    // Same LCG as most libc rand(), so every run sees the same latencies
+    storage_seed = storage_seed * 1103515245 + 12345;
+    delay += (storage_seed >> 16) % (storage.jitter_us + 1);
+  }
+  storage_reads++;
+  if (storage.spike_every > 0 && storage_reads % storage.spike_every == 0) {
+    delay = storage.spike_us;
+  }
+  taskEXIT_CRITICAL(&sim_mux);
+
+  sim_sleep_us(delay);
+}
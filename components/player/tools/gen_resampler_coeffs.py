@@ -0,0 +1,93 @@
+#!/usr/bin/env python3
+"""
+Generate the windowed sinc tables used by the fixed point resampler.
+
+Every quality gets one wing of a Kaiser windowed sinc sampled PHASES times
+per zero crossing in Q15, plus the difference between consecutive entries so
+the resampler can interpolate between phases with a single multiply.
+
+Usage: gen_resampler_coeffs.py <output header>
+"""
+
+import math
+import sys
+
+PHASES = 128
+
+# name, zero crossings per wing, kaiser beta, rolloff (fraction of nyquist)
+QUALITIES = [
+    ("low", 4, 5.0, 0.85),
+    ("medium", 8, 7.0, 0.90),
+    ("high", 16, 9.0, 0.94),
+]
+
+
+def bessel_i0(x):
+    total = 1.0
+    term = 1.0
+    k = 1
+    while term > 1e-12 * total:
+        term *= (x / (2.0 * k)) ** 2
+        total += term
+        k += 1
+    return total
+
+
+def wing(zero_crossings, beta, rolloff):
+    length = zero_crossings * PHASES
+    norm = bessel_i0(beta)
+    coeffs = []
+    for i in range(length + 1):
+        t = i / PHASES
+        if i == 0:
+            sinc = 1.0
+        else:
+            x = math.pi * rolloff * t
+            sinc = math.sin(x) / x
+        ratio = t / zero_crossings
+        window = bessel_i0(beta * math.sqrt(max(0.0, 1.0 - ratio * ratio))) / norm
+        value = rolloff * sinc * window
+        coeffs.append(max(-32768, min(32767, int(round(value * 32768)))))
+    # Last entry is the end of the window, force it so the deltas end there
+    coeffs[-1] = 0
+    return coeffs
+
+
+def format_array(ctype, name, values):
+    lines = ["static const %s %s[%d] = {" % (ctype, name, len(values))]
+    for i in range(0, len(values), 12):
+        chunk = values[i:i + 12]
+        lines.append("    " + ", ".join("%d" % v for v in chunk) + ",")
+    lines.append("};")
+    return "\n".join(lines)
+
+
+def main():
+    if len(sys.argv) != 2:
+        sys.stderr.write(__doc__)
+        return 1
+
+    out = []
+    out.append("// Generated by gen_resampler_coeffs.py, do not edit")
+    out.append("#pragma once")
+    out.append("")
+    out.append("#include <stdint.h>")
+    out.append("")
+    out.append("#define RESAMPLER_PHASES %d" % PHASES)
+    for name, zero_crossings, beta, rolloff in QUALITIES:
+        coeffs = wing(zero_crossings, beta, rolloff)
+        deltas = [coeffs[i + 1] - coeffs[i] for i in range(len(coeffs) - 1)]
+        deltas.append(0)
+        out.append("")
+        out.append("#define RESAMPLER_%s_ZERO_CROSSINGS %d" %
+                   (name.upper(), zero_crossings))
+        out.append(format_array("int16_t", "resampler_%s_coeffs" % name, coeffs))
+        out.append(format_array("int16_t", "resampler_%s_deltas" % name, deltas))
+
+    with open(sys.argv[1], "w") as f:
+        f.write("\n".join(out) + "\n")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
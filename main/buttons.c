@@ -0,0 +1,97 @@
+#include "buttons.h"
+
+#define MS(x) ((int64_t)(x) * 1000)
+
+static void emit(buttons_t *buttons, button_id_t button,
+                 button_gesture_t gesture, int64_t time_us) {
+  button_event_t event = {
+      .button = button, .gesture = gesture, .time_us = time_us};
+  buttons->emit(&event);
+}
+
+// Debounced level change of a button
+static void change(buttons_t *buttons, button_id_t button, int level,
+                   int64_t time_us) {
+  button_tracker_t *t = &buttons->trackers[button];
+  t->level = level;
+
+  if (level == 0) {
+    emit(buttons, button, BTN_GESTURE_PRESS, time_us);
+    t->double_pending = t->released_at != 0 &&
+                        time_us - t->released_at <= MS(BUTTONS_DOUBLE_MS);
+    t->timer_at = time_us + MS(BUTTONS_LONG_MS);
+    t->long_sent = false;
+    return;
+  }
+
+  emit(buttons, button, BTN_GESTURE_RELEASE, time_us);
+  t->timer_at = 0;
+  if (t->long_sent) {
+    t->released_at = 0;
+  } else if (t->double_pending) {
+    emit(buttons, button, BTN_GESTURE_DOUBLE, time_us);
+    t->released_at = 0;
+  } else {
+    emit(buttons, button, BTN_GESTURE_CLICK, time_us);
+    t->released_at = time_us;
+  }
+}
+
+void buttons_init(buttons_t *buttons, buttons_read_t read,
+                  buttons_emit_t emit) {
+  buttons->read = read;
+  buttons->emit = emit;
+  for (int i = 0; i < BTN_COUNT; i++) {
+    buttons->trackers[i] = (button_tracker_t){.level = read(i)};
+  }
+}
+
+void buttons_edge(buttons_t *buttons, button_id_t button, int level,
+                  int64_t time_us) {
+  button_tracker_t *t = &buttons->trackers[button];
+
+  // Bouncing, where it ends up is checked once it settles
+  if (t->settle_at != 0) {
+    return;
+  }
+  // The first edge counts at once, the ones following it are bounces
+  t->settle_at = time_us + MS(BUTTONS_DEBOUNCE_MS);
+  if (level != t->level) {
+    change(buttons, button, level, time_us);
+  }
+}
+
+int64_t buttons_poll(buttons_t *buttons, int64_t now_us) {
+  int64_t next = INT64_MAX;
+
+  for (int i = 0; i < BTN_COUNT; i++) {
+    button_tracker_t *t = &buttons->trackers[i];
+
+    if (t->settle_at != 0 && now_us >= t->settle_at) {
+      // Bounces are over, a press or release shorter than them (or an edge
+      // that never made it here) shows as the level not being what we think
+      t->settle_at = 0;
+      int level = buttons->read(i);
+      if (level != t->level) {
+        t->settle_at = now_us + MS(BUTTONS_DEBOUNCE_MS);
+        change(buttons, i, level, now_us);
+      }
+    }
+
+    if (t->timer_at != 0 && now_us >= t->timer_at) {
+      emit(buttons, i, t->long_sent ? BTN_GESTURE_REPEAT : BTN_GESTURE_LONG,
+           t->timer_at);
+      t->long_sent = true;
+      t->timer_at += MS(BUTTONS_REPEAT_MS);
+    }
+
+    if (t->settle_at != 0 && t->settle_at < next) {
+      next = t->settle_at;
+    }
+    if (t->timer_at != 0 && t->timer_at < next) {
+      next = t->timer_at;
+    }
+  }
+
+  return next;
+}
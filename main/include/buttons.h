@@ -0,0 +1,90 @@
+#ifndef BUTTONS_H
+#define BUTTONS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Timings of the gestures, in ms
+#define BUTTONS_DEBOUNCE_MS  20  // Edges after an accepted one are bounces
+#define BUTTONS_LONG_MS      600 // Held this long is a long press...
+#define BUTTONS_REPEAT_MS    250 // ...repeated this often while still held
+#define BUTTONS_DOUBLE_MS    300 // Release to next press for a double press
+
+// Buttons
+typedef enum {
+    BTN_PREV = 0,
+    BTN_PAUSE,
+    BTN_NEXT,
+    BTN_COUNT
+} button_id_t;
+
+// What a button did
+typedef enum {
+    BTN_GESTURE_PRESS = 0, // Went down, right away
+    BTN_GESTURE_RELEASE,   // Went up, right away
+    BTN_GESTURE_CLICK,     // Released before a long press
+    BTN_GESTURE_DOUBLE,    // Second click soon after another (instead of CLICK)
+    BTN_GESTURE_LONG,      // Held for BUTTONS_LONG_MS
+    BTN_GESTURE_REPEAT     // Still held, every BUTTONS_REPEAT_MS after LONG
+} button_gesture_t;
+
+/**
+ * @brief A gesture and when the edge (or timer) behind it happened.
+ */
+typedef struct {
+    button_id_t button;
+    button_gesture_t gesture;
+    int64_t time_us;
+} button_event_t;
+
+/**
+ * @brief Called for every gesture found.
+ */
+typedef void (*buttons_emit_t)(const button_event_t *event);
+
+/**
+ * @brief Reads the current level of a button (0 pressed, active low).
+ */
+typedef int (*buttons_read_t)(button_id_t button);
+
+/**
+ * @brief State of one button.
+ */
+typedef struct {
+    int level;             /**< Debounced level, 0 pressed */
+    int64_t settle_at;     /**< End of the bounce time of the last edge, 0 if none */
+    int64_t released_at;   /**< Last release that was a click, for doubles */
+    int64_t timer_at;      /**< Next LONG/REPEAT while held, 0 if none */
+    bool double_pending;   /**< This press came soon after a click */
+    bool long_sent;        /**< LONG was sent for this press */
+} button_tracker_t;
+
+/**
+ * @brief Gesture detection of all the buttons, fed with raw timestamped
+ *        edges, it knows nothing of GPIOs so it can run anywhere.
+ */
+typedef struct {
+    button_tracker_t trackers[BTN_COUNT];
+    buttons_read_t read;
+    buttons_emit_t emit;
+} buttons_t;
+
+/**
+ * @brief Starts tracking the buttons at their current levels.
+ */
+void buttons_init(buttons_t *buttons, buttons_read_t read, buttons_emit_t emit);
+
+/**
+ * @brief Feeds a raw edge, `level` being the one read right after it.
+ */
+void buttons_edge(buttons_t *buttons, button_id_t button, int level,
+                  int64_t time_us);
+
+/**
+ * @brief Runs the timers due at `now_us` (end of bounces, long presses and
+ *        repeats).
+ * @return When it has to be called again, INT64_MAX if there's no timer.
+ */
+int64_t buttons_poll(buttons_t *buttons, int64_t now_us);
+
+#endif // BUTTONS_H
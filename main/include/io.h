@@ -1,8 +1,11 @@
 #ifndef IO_H
 #define IO_H
 
+#include "buttons.h"
 #include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
 #include "freertos/task.h"
+#include <stdbool.h>
 
 // GPIO Definitions
 #define GPIO_POWER_BTN  39
@@ -10,13 +13,8 @@
 #define GPIO_BTN_PAUSE  33
 #define GPIO_BTN_NEXT   35
 
-// Button States
-typedef enum {
-    BTN_NONE = 0,
-    BTN_PREV,
-    BTN_PAUSE,
-    BTN_NEXT
-} button_event_t;
+// Button gestures waiting to be read
+#define IO_BUTTON_QUEUE_LEN 16
 
 // Task Handles
 extern TaskHandle_t power_task_handle;
@@ -28,6 +26,14 @@ extern TaskHandle_t buttons_task_handle;
  */
 void io_setup_power_button(void);
 
+/**
+ * @brief Sets a function the power task calls instead of going to deep sleep
+ *        right away. It runs on the small power task stack so it should only
+ *        pass the request on, whoever handles it saves what has to survive
+ *        and calls esp_deep_sleep_start. The power task still does after 2 s.
+ */
+void io_set_sleep_request(void (*callback)(void));
+
 /**
  * @brief Task that monitors GPIO_POWER_BTN. 
  *        If it goes LOW, it puts the ESP32 into deep sleep.
@@ -35,19 +41,31 @@ void io_setup_power_button(void);
 void io_power_task(void *pvParameters);
 
 /**
- * @brief Configures the general purpose buttons (PREV, PAUSE, NEXT) as inputs.
+ * @brief Configures the general purpose buttons (PREV, PAUSE, NEXT) as inputs
+ *        with an interrupt on both edges, which also wakes the ESP32 up
+ *        from light sleep.
  */
 void io_setup_buttons(void);
 
 /**
- * @brief Task that polls the button pins and updates the last button pressed variable.
+ * @brief Task that turns the button edges into gestures (see buttons.h),
+ *        it only wakes up on edges and on the gesture timers.
  */
 void io_buttons_task(void *pvParameters);
 
 /**
- * @brief Returns the last button that was pressed.
- * @return The button event (BTN_PREV, BTN_PAUSE, BTN_NEXT, or BTN_NONE).
+ * @brief Gets the oldest button gesture not read yet, in order, none is lost
+ *        unless IO_BUTTON_QUEUE_LEN pile up.
+ * @param event Where to put it.
+ * @param wait Ticks to wait for one.
+ * @return true if there was one.
+ */
+bool io_get_button_event(button_event_t *event, TickType_t wait);
+
+/**
+ * @brief Queue io_get_button_event reads from, to wait on it along with
+ *        others in a queue set.
  */
-button_event_t io_get_last_button(void);
+QueueHandle_t io_get_button_queue(void);
 
 #endif // IO_H
@@ -0,0 +1,38 @@
+#ifndef RESUME_H
+#define RESUME_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define RESUME_PATH_LEN 256
+
+/**
+ * @brief Everything needed to pick up playback where it was left.
+ */
+typedef struct {
+    char path[RESUME_PATH_LEN]; /**< Song path, relative to the library directory */
+    uint32_t size;              /**< Song file size, with mtime tells it's the same file */
+    uint32_t mtime;             /**< Song FAT date << 16 | FAT time */
+    uint32_t song_idx;          /**< Where the song was in the library */
+    uint32_t position_ms;       /**< Position in the song */
+} resume_point_t;
+
+/**
+ * @brief Prepares NVS, where the resume point is kept in case the RTC memory
+ *        copy is lost (power cut, reset...).
+ */
+void resume_setup(void);
+
+/**
+ * @brief Keeps `point` in RTC slow memory, which survives deep sleep, and in NVS.
+ */
+void resume_save(const resume_point_t *point);
+
+/**
+ * @brief Gets the last saved resume point, from RTC memory when waking from
+ *        deep sleep, else from NVS.
+ * @return true if there is a valid one.
+ */
+bool resume_load(resume_point_t *point);
+
+#endif // RESUME_H
@@ -1,8 +1,9 @@
 #ifndef STATE_H
 #define STATE_H
 
-#include "files.h"
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 /**
  * @brief Enumeration for the current playback status.
@@ -17,7 +18,7 @@ typedef enum {
  * @brief Structure to hold the complete state of the music player.
  */
 typedef struct {
-    file_list_t song_list;      /**< List of songs found on the SD card */
+    size_t song_count;          /**< Number of songs in the playlist or the library index of the SD card */
     int current_idx;            /**< Index of the song currently playing/selected */
     player_status_t status;     /**< Current playback status */
 } player_state_t;
@@ -28,11 +29,51 @@ typedef struct {
 extern player_state_t g_state;
 
 /**
- * @brief Initializes the player state by scanning the SD card for files.
+ * @brief Initializes the player state from the library index of the SD card
+ *        (or by listing the directory the first time). If the directory
+ *        has a playlist.m3u8 or playlist.m3u, the songs are the ones it
+ *        lists, in its order.
  * @param dir_path The directory to scan for music files.
  */
 void state_init(const char *dir_path);
 
+/**
+ * @brief Builds the full path of the song at `idx` in the library.
+ * @param idx Index of the song, wraps around the library in both directions.
+ * @param filepath Buffer for the path.
+ * @param len Size of the buffer.
+ * @return true if the song is there and its path fits.
+ */
+bool state_get_song_path(int idx, char *filepath, size_t len);
+
+/**
+ * @brief Starts going through the music directory in a background task to
+ *        bring the library index up to date.
+ */
+void state_refresh_library(void);
+
+/**
+ * @brief Switches to the refreshed library once the background refresh is
+ *        done, keeping the current song selected if it's still there.
+ * @return true if the song list changed.
+ */
+bool state_apply_library_refresh(void);
+
+/**
+ * @brief Saves the current song and where it is, to go on from there after
+ *        deep sleep (see resume.h).
+ * @param position_ms Position in the current song.
+ */
+void state_save_resume(uint32_t position_ms);
+
+/**
+ * @brief Selects the song saved by state_save_resume if it's still in the
+ *        library, unchanged.
+ * @param position_ms Where to go on playing it.
+ * @return true if there is a song to resume.
+ */
+bool state_restore_resume(uint32_t *position_ms);
+
 /**
  * @brief Moves the state to the next song in the list.
  */
@@ -2,6 +2,8 @@
 #include "driver/gpio.h"
 #include "esp_log.h"
 #include "esp_sleep.h"
+#include "esp_timer.h"
+#include "freertos/queue.h"
 
 static const char *TAG = "IO";
 
@@ -9,8 +11,34 @@ static const char *TAG = "IO";
 TaskHandle_t power_task_handle = NULL;
 TaskHandle_t buttons_task_handle = NULL;
 
-// Variable to store the last button pressed
-static volatile button_event_t last_button_pressed = BTN_NONE;
+// Raw edges from the GPIO interrupt to the buttons task, and the gestures
+// it finds from them to whoever asks with io_get_button_event
+#define EDGE_QUEUE_LEN 32
+
+typedef struct {
+  button_id_t button;
+  int level;
+  int64_t time_us;
+} button_edge_t;
+
+static const gpio_num_t button_gpios[BTN_COUNT] = {
+    [BTN_PREV] = GPIO_BTN_PREV,
+    [BTN_PAUSE] = GPIO_BTN_PAUSE,
+    [BTN_NEXT] = GPIO_BTN_NEXT,
+};
+
+static QueueHandle_t edge_queue = NULL;
+static QueueHandle_t event_queue = NULL;
+static buttons_t buttons;
+static volatile uint32_t edges_dropped = 0;
+static volatile uint32_t events_dropped = 0;
+
+// Asked to save what has to survive and go to deep sleep, by whoever can
+// do it safely
+static void (*sleep_request)(void) = NULL;
+
+// How long the sleep request gets before the power task sleeps anyway
+#define SLEEP_REQUEST_TIMEOUT_MS 2000
 
 // --- Power Management ---
 
@@ -34,6 +62,8 @@ void io_setup_power_button(void) {
            GPIO_POWER_BTN);
 }
 
+void io_set_sleep_request(void (*callback)(void)) { sleep_request = callback; }
+
 void io_power_task(void *pvParameters) {
   ESP_LOGI(TAG, "Power monitoring task started.");
   while (1) {
@@ -44,6 +74,13 @@ void io_power_task(void *pvParameters) {
       // Debounce/Safety delay to ensure it wasn't a glitch
       vTaskDelay(pdMS_TO_TICKS(100));
       if (gpio_get_level(GPIO_POWER_BTN) == 0) {
+        // Saving takes more stack than this task has, and the state is the
+        // main loop's, so it is only asked to do it
+        if (sleep_request) {
+          sleep_request();
+          vTaskDelay(pdMS_TO_TICKS(SLEEP_REQUEST_TIMEOUT_MS));
+          ESP_LOGW(TAG, "Sleep request not handled, sleeping anyway");
+        }
         esp_deep_sleep_start();
       }
     }
@@ -53,6 +90,48 @@ void io_power_task(void *pvParameters) {
 
 // --- General Buttons ---
 
+// The interrupt, and the light sleep wakeup with it, is on the level the
+// button isn't at, so it fires on the next edge whichever way it goes. The
+// ESP32 can only wake up from light sleep on a level, not on an edge
+static void arm_button(button_id_t button, int level) {
+  gpio_wakeup_enable(button_gpios[button],
+                     level ? GPIO_INTR_LOW_LEVEL : GPIO_INTR_HIGH_LEVEL);
+}
+
+// Runs on both edges of every button, only takes the time and the level,
+// the debouncing and the gestures are up to the task
+static void button_isr(void *arg) {
+  button_id_t button = (button_id_t)(intptr_t)arg;
+  button_edge_t edge = {
+      .button = button,
+      .level = gpio_get_level(button_gpios[button]),
+      .time_us = esp_timer_get_time(),
+  };
+  // Waits for the other level now. If it came back meanwhile this fires
+  // again at once, with that level
+  arm_button(button, edge.level);
+
+  BaseType_t woken = pdFALSE;
+  if (xQueueSendFromISR(edge_queue, &edge, &woken) != pdTRUE) {
+    // Only bounces get here this fast, the level is read again once they
+    // settle so no press is lost
+    edges_dropped++;
+  }
+  portYIELD_FROM_ISR(woken);
+}
+
+static int read_button(button_id_t button) {
+  return gpio_get_level(button_gpios[button]);
+}
+
+static void queue_event(const button_event_t *event) {
+  if (xQueueSend(event_queue, event, 0) != pdTRUE) {
+    events_dropped++;
+    ESP_LOGW(TAG, "Button event queue full, %lu dropped",
+             (unsigned long)events_dropped);
+  }
+}
+
 void io_setup_buttons(void) {
   // Configure button GPIOs
   gpio_config_t io_conf = {
@@ -65,55 +144,58 @@ void io_setup_buttons(void) {
       .intr_type = GPIO_INTR_DISABLE};
   gpio_config(&io_conf);
 
+  edge_queue = xQueueCreate(EDGE_QUEUE_LEN, sizeof(button_edge_t));
+  event_queue = xQueueCreate(IO_BUTTON_QUEUE_LEN, sizeof(button_event_t));
+  if (edge_queue == NULL || event_queue == NULL) {
+    ESP_LOGE(TAG, "Failed to create button queues");
+    return;
+  }
+  buttons_init(&buttons, read_button, queue_event);
+
+  // Someone else may have installed the service already
+  esp_err_t ret = gpio_install_isr_service(0);
+  if (ret != ESP_OK && ret != ESP_ERR_INVALID_STATE) {
+    ESP_LOGE(TAG, "Failed to install GPIO ISR service");
+    return;
+  }
+  for (int i = 0; i < BTN_COUNT; i++) {
+    gpio_isr_handler_add(button_gpios[i], button_isr, (void *)(intptr_t)i);
+    arm_button(i, gpio_get_level(button_gpios[i]));
+    gpio_intr_enable(button_gpios[i]);
+  }
+  if (esp_sleep_enable_gpio_wakeup() != ESP_OK) {
+    ESP_LOGW(TAG, "Buttons can't wake it up from light sleep");
+  }
+
   ESP_LOGI(TAG, "Buttons setup complete.");
 }
 
-button_event_t io_get_last_button(void) {
-  button_event_t temp = last_button_pressed;
-  last_button_pressed =
-      BTN_NONE; // Optional: clear after read if desired, or keep it.
-                // User asked to "get the value", standard behavior for
-                // "last pressed" usually implies consuming the event.
-                // I will clear it to avoid repeated actions.
-  return temp;
+QueueHandle_t io_get_button_queue(void) { return event_queue; }
+
+bool io_get_button_event(button_event_t *event, TickType_t wait) {
+  return event_queue != NULL &&
+         xQueueReceive(event_queue, event, wait) == pdTRUE;
 }
 
 void io_buttons_task(void *pvParameters) {
-  ESP_LOGI(TAG, "Button polling task started.");
-
-  // State tracking for debouncing (simple state machine)
-  int prev_state_prev = 1;
-  int prev_state_pause = 1;
-  int prev_state_next = 1;
+  ESP_LOGI(TAG, "Button task started.");
 
   while (1) {
-    int curr_prev = gpio_get_level(GPIO_BTN_PREV);
-    int curr_pause = gpio_get_level(GPIO_BTN_PAUSE);
-    int curr_next = gpio_get_level(GPIO_BTN_NEXT);
-
-    // Logic for PREV Button (Active Low)
-    if (prev_state_prev == 1 && curr_prev == 0) {
-      last_button_pressed = BTN_PREV;
-      ESP_LOGD(TAG, "Button PREV pressed");
-    }
-
-    // Logic for PAUSE Button (Active Low)
-    if (prev_state_pause == 1 && curr_pause == 0) {
-      last_button_pressed = BTN_PAUSE;
-      ESP_LOGD(TAG, "Button PAUSE pressed");
+    // Sleep until an edge comes or the next debounce/long press timer
+    int64_t now = esp_timer_get_time();
+    int64_t next = buttons_poll(&buttons, now);
+    TickType_t wait = portMAX_DELAY;
+    if (next != INT64_MAX) {
+      int64_t tick_us = portTICK_PERIOD_MS * 1000;
+      wait = (TickType_t)((next - now + tick_us - 1) / tick_us);
+      if (wait == 0) {
+        wait = 1;
+      }
     }
 
-    // Logic for NEXT Button (Active Low)
-    if (prev_state_next == 1 && curr_next == 0) {
-      last_button_pressed = BTN_NEXT;
-      ESP_LOGD(TAG, "Button NEXT pressed");
+    button_edge_t edge;
+    if (xQueueReceive(edge_queue, &edge, wait) == pdTRUE) {
+      buttons_edge(&buttons, edge.button, edge.level, edge.time_us);
     }
-
-    // Update states
-    prev_state_prev = curr_prev;
-    prev_state_pause = curr_pause;
-    prev_state_next = curr_next;
-
-    vTaskDelay(pdMS_TO_TICKS(50)); // Poll every 50ms
   }
 }
@@ -1,40 +1,329 @@
 #include "esp_log.h"
+#include "esp_pm.h"
+#include "esp_sleep.h"
+#include "esp_timer.h"
+#include "fail.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
 #include "io.h"
 #include "player.h"
+#include "resume.h"
 #include "sdcard.h"
+#include "soc/soc.h"
 #include "state.h"
 #include <stdio.h> // For snprintf
 
 static const char *TAG = "MY_BGM_PLAYER";
 
+// Jump of every scrub step while PREV/NEXT are held
+#define SCRUB_STEP_MS 5000
+
+// Time from boot to the first sample we aim for when resuming
+#define RESUME_BUDGET_MS 500
+
+// Lowest CPU clock when nothing holds it up (the XTAL one)
+#define PM_MIN_FREQ_MHZ 40
+
+// How often the time spent in each player power state is logged
+#define POWER_LOG_INTERVAL_MS 60000
+
+// Player events waiting for the main loop
+#define PLAYER_EVENT_QUEUE_LEN 16
+
+// Longest wait for the player to fade out and stop before deep sleep, the
+// power task forces it after 2 s anyway
+#define STOP_TIMEOUT_MS 500
+
+static QueueHandle_t player_events = NULL;
+
+// Given by the power task when the switch goes off
+static SemaphoreHandle_t sleep_request = NULL;
+
+// Songs that failed to open in a row, and which way to skip past them (the
+// way the user was going)
+static size_t failed_in_a_row = 0;
+static int skip_step = 1;
+
+/**
+ * @brief Helper to get the songs around the current one ready, the next one
+ * plays right after the current without a gap and both next and previous
+ * start at once when skipping to them
+ */
+static void preload_neighbours(void) {
+  char filepath[300] = "";
+
+  if (!state_get_song_path(g_state.current_idx + 1, filepath,
+                           sizeof(filepath)) ||
+      mplayer_set_next(filepath) != ESP_OK) {
+    ESP_LOGW(TAG, "Failed to preload: %s", filepath);
+  }
+
+  if (!state_get_song_path(g_state.current_idx - 1, filepath,
+                           sizeof(filepath)) ||
+      mplayer_preload(filepath) != ESP_OK) {
+    ESP_LOGW(TAG, "Failed to preload: %s", filepath);
+  }
+}
+
 /**
- * @brief Helper to start playing the song currently selected in g_state
+ * @brief Helper to log the silence of every song change once it's measured
  */
-static void play_current_song(void) {
-  if (g_state.song_list.count == 0)
+static void log_gap(void) {
+  static uint32_t logged = 0;
+  mplayer_gaps_t gaps;
+  mplayer_get_gaps(&gaps);
+  if (gaps.transitions == logged)
     return;
+  logged = gaps.transitions;
+  ESP_LOGI(TAG, "Song change gap: %lu samples (max %lu over %lu changes)",
+           (unsigned long)gaps.last_gap, (unsigned long)gaps.max_gap,
+           (unsigned long)gaps.transitions);
+}
 
-  // 1. Stop if playing
-  mplayer_stop();
+/**
+ * @brief Helper to start playing the song currently selected in g_state,
+ *        `start_ms` into it
+ */
+static void play_current_song_from(uint32_t start_ms) {
+  if (g_state.song_count == 0)
+    return;
 
-  // 2. Construct full path
-  char filepath[256];
-  snprintf(filepath, sizeof(filepath), "%s/%s", MOUNT_POINT,
-           g_state.song_list.filenames[g_state.current_idx]);
+  // 1. Construct full path
+  char filepath[300];
+  if (!state_get_song_path(g_state.current_idx, filepath, sizeof(filepath))) {
+    ESP_LOGE(TAG, "Failed to get song %d", g_state.current_idx);
+    g_state.status = STATE_STOPPED;
+    return;
+  }
 
-  // 3. Play
-  if (mplayer_play(filepath) == ESP_OK) {
+  // 2. Play, it stops the current song first and tells if it failed
+  if (mplayer_play_from(filepath, start_ms) == ESP_OK) {
     g_state.status = STATE_PLAYING;
     ESP_LOGI(TAG, "Playing: %s", filepath);
+    preload_neighbours();
   } else {
     ESP_LOGE(TAG, "Failed to play: %s", filepath);
     g_state.status = STATE_STOPPED;
   }
 }
 
+static void play_current_song(void) { play_current_song_from(0); }
+
+/**
+ * @brief Called by the power task when the switch goes off, the saving is
+ * done by the main loop which owns the state and has the stack for it
+ */
+static void request_sleep(void) { xSemaphoreGive(sleep_request); }
+
+/**
+ * @brief Helper to keep where the music is and put everything to deep sleep
+ */
+static void save_and_sleep(void) {
+  state_save_resume(mplayer_get_position_ms());
+
+  // Stop only queues the command, wait for it so the output fades out
+  // instead of being cut. The events are read past the queue set, it
+  // doesn't matter as the main loop never runs again
+  if (mplayer_stop() == ESP_OK) {
+    TickType_t start = xTaskGetTickCount();
+    TickType_t timeout = pdMS_TO_TICKS(STOP_TIMEOUT_MS);
+    TickType_t waited;
+    mplayer_event_t event;
+    bool stopped = false;
+    while (!stopped && (waited = xTaskGetTickCount() - start) < timeout &&
+           xQueueReceive(player_events, &event, timeout - waited) == pdTRUE) {
+      stopped = event.type == MPLAYER_EVENT_STOPPED;
+    }
+    if (!stopped) {
+      ESP_LOGW(TAG, "Player didn't stop in %d ms", STOP_TIMEOUT_MS);
+    }
+  }
+  ESP_LOGI(TAG, "Going to deep sleep, %u bytes of main stack never used",
+           (unsigned)uxTaskGetStackHighWaterMark(NULL));
+  esp_deep_sleep_start();
+}
+
+/**
+ * @brief Helper to act on a button gesture. PAUSE acts as soon as it goes
+ * down, PREV and NEXT skip when clicked (a double click is one more skip)
+ * and scrub while held
+ */
+static void handle_button(const button_event_t *event) {
+  long long latency_us = (long long)(esp_timer_get_time() - event->time_us);
+
+  switch (event->gesture) {
+  case BTN_GESTURE_PRESS:
+    if (event->button != BTN_PAUSE)
+      break;
+    ESP_LOGI(TAG, "CMD: Pause/Resume (%lld us after press)", latency_us);
+    if (g_state.status == STATE_PLAYING) {
+      mplayer_pause();
+      g_state.status = STATE_PAUSED;
+    } else if (g_state.status == STATE_PAUSED) {
+      mplayer_resume();
+      g_state.status = STATE_PLAYING;
+    } else if (g_state.status == STATE_STOPPED) {
+      // Optional: If stopped, play current
+      play_current_song();
+    }
+    break;
+
+  case BTN_GESTURE_CLICK:
+  case BTN_GESTURE_DOUBLE:
+    if (event->button == BTN_NEXT) {
+      ESP_LOGI(TAG, "CMD: Next Song (%lld us after release)", latency_us);
+      skip_step = 1;
+      if (g_state.status == STATE_STOPPED) {
+        state_next_song();
+        play_current_song();
+      } else {
+        // The next song is already queued in the player, the index
+        // follows once it tells it moved on
+        mplayer_next();
+      }
+    } else if (event->button == BTN_PREV) {
+      ESP_LOGI(TAG, "CMD: Previous Song (%lld us after release)", latency_us);
+      skip_step = -1;
+      state_prev_song();
+      play_current_song();
+    }
+    break;
+
+  case BTN_GESTURE_LONG:
+  case BTN_GESTURE_REPEAT:
+    if (event->button == BTN_PAUSE || g_state.status == STATE_STOPPED)
+      break;
+    mplayer_seek_relative(event->button == BTN_NEXT ? SCRUB_STEP_MS
+                                                    : -SCRUB_STEP_MS);
+    break;
+
+  default:
+    break;
+  }
+}
+
+/**
+ * @brief Called by the player task, the events are handled by the main loop
+ */
+static void on_player_event(const mplayer_event_t *event, void *ctx) {
+  if (xQueueSend(player_events, event, 0) != pdTRUE) {
+    ESP_LOGW(TAG, "Player event queue full, event %d lost", event->type);
+  }
+}
+
+/**
+ * @brief Helper to follow what the player did
+ */
+static void handle_player_event(const mplayer_event_t *event) {
+  switch (event->type) {
+  case MPLAYER_EVENT_STARTED:
+    failed_in_a_row = 0;
+    skip_step = 1;
+    g_state.status = STATE_PLAYING;
+    break;
+
+  case MPLAYER_EVENT_RESUMED:
+    g_state.status = STATE_PLAYING;
+    break;
+
+  case MPLAYER_EVENT_ADVANCED:
+    // The player moved on to the next song by itself (or by a skip), just
+    // follow it and get the ones after ready
+    failed_in_a_row = 0;
+    g_state.status = STATE_PLAYING;
+    state_next_song();
+    preload_neighbours();
+    break;
+
+  case MPLAYER_EVENT_FINISHED:
+    // Without a next song ready (or if it failed to open) the song just
+    // ends and it is started from here
+    state_next_song();
+    play_current_song();
+    break;
+
+  case MPLAYER_EVENT_SEEKED:
+    ESP_LOGI(TAG, "Now at %lu ms", (unsigned long)event->position_ms);
+    break;
+
+  case MPLAYER_EVENT_ERROR:
+    ESP_LOGW(TAG, "Player command %d failed: %s", event->cmd,
+             esp_err_to_name(event->err));
+    if (event->cmd != MPLAYER_CMD_PLAY)
+      break;
+    // Gone from the card or not a song after all (a playlist entry), go on
+    // with the one after it unless none of them can be played
+    if (++failed_in_a_row >= g_state.song_count) {
+      ESP_LOGE(TAG, "None of the %zu songs can be played", g_state.song_count);
+      failed_in_a_row = 0;
+      g_state.status = STATE_STOPPED;
+      break;
+    }
+    if (skip_step < 0) {
+      state_prev_song();
+    } else {
+      state_next_song();
+    }
+    play_current_song();
+    break;
+
+  default:
+    break;
+  }
+}
+
+/**
+ * @brief Helper to log the time spent in each player power state, to see
+ * how long the CPU could run slow or sleep
+ */
+static void log_power(void) {
+  static int64_t last = 0;
+  int64_t now = esp_timer_get_time();
+  if (now - last < POWER_LOG_INTERVAL_MS * 1000LL)
+    return;
+  last = now;
+
+  mplayer_power_t power;
+  mplayer_get_power(&power);
+  ESP_LOGI(TAG, "Power: idle %lld s, paused %lld s, waiting %lld s, "
+                "decoding %lld s",
+           (long long)(power.time_us[MPLAYER_POWER_IDLE] / 1000000),
+           (long long)(power.time_us[MPLAYER_POWER_PAUSED] / 1000000),
+           (long long)(power.time_us[MPLAYER_POWER_WAITING] / 1000000),
+           (long long)(power.time_us[MPLAYER_POWER_DECODING] / 1000000));
+}
+
+/**
+ * @brief Helper to log once how long after boot the first sample played
+ */
+static void log_first_sample(bool resumed) {
+  static bool logged = false;
+  int64_t at = mplayer_get_first_sample_time();
+  if (logged || at == 0)
+    return;
+  logged = true;
+  ESP_LOGI(TAG, "First sample %lld ms after boot%s", (long long)(at / 1000),
+           resumed ? " (resumed)" : "");
+  if (resumed && at / 1000 > RESUME_BUDGET_MS) {
+    ESP_LOGW(TAG, "Resume took longer than %d ms", RESUME_BUDGET_MS);
+  }
+}
+
 void app_main(void) {
   ESP_LOGI(TAG, "Starting BGM Player Initialization...");
 
+#if CONFIG_PM_ENABLE
+  // Full speed only while something asks for it (the player while it
+  // decodes, the drivers while they work), light sleep when nothing does.
+  // The buttons wake it up (see io_setup_buttons)
+  esp_pm_config_t pm_config = {.max_freq_mhz = CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ,
+                               .min_freq_mhz = PM_MIN_FREQ_MHZ,
+                               .light_sleep_enable = true};
+  if (esp_pm_configure(&pm_config) != ESP_OK) {
+    ESP_LOGW(TAG, "Failed to configure power management");
+  }
+#endif
+
   // 1. Setup IO Pins and Wakeup Sources
   io_setup_power_button();
   io_setup_buttons();
@@ -48,67 +337,86 @@ void app_main(void) {
     ESP_LOGE(TAG, "Failed to setup Music Player.");
   }
 
-  // 3. Initialize State (Scan for music)
+  // Buttons, player events and the power switch all wake up the main loop
+  player_events = xQueueCreate(PLAYER_EVENT_QUEUE_LEN, sizeof(mplayer_event_t));
+  sleep_request = xSemaphoreCreateBinary();
+  QueueSetHandle_t events = xQueueCreateSet(PLAYER_EVENT_QUEUE_LEN +
+                                             IO_BUTTON_QUEUE_LEN + 1);
+  if (player_events == NULL || sleep_request == NULL || events == NULL ||
+      xQueueAddToSet(player_events, events) != pdPASS ||
+      xQueueAddToSet(io_get_button_queue(), events) != pdPASS ||
+      xQueueAddToSet(sleep_request, events) != pdPASS) {
+    system_fatal_error("Failed to create the main loop queues");
+  }
+  mplayer_set_event_callback(on_player_event, NULL);
+
+  // 3. Initialize State (Scan for music) and pick up where it was left
+  resume_setup();
   state_init(MOUNT_POINT);
+  uint32_t resume_ms = 0;
+  bool resumed = state_restore_resume(&resume_ms);
+  io_set_sleep_request(request_sleep);
 
-  // 4. Create IO Management Tasks
-  xTaskCreate(io_power_task, "power_task", 2048, NULL, 10, &power_task_handle);
-  xTaskCreate(io_buttons_task, "buttons_task", 2048, NULL, 5,
-              &buttons_task_handle);
+  // 4. Create IO Management Tasks, on PRO_CPU with the card and button
+  // interrupts, the decoder has APP_CPU to itself
+  xTaskCreatePinnedToCore(io_power_task, "power_task", 2048, NULL, 10,
+                          &power_task_handle, PRO_CPU_NUM);
+  xTaskCreatePinnedToCore(io_buttons_task, "buttons_task", 2048, NULL, 5,
+                          &buttons_task_handle, PRO_CPU_NUM);
 
   ESP_LOGI(TAG, "System Initialization Complete. Starting Main Loop...");
 
   // Auto-play first song if available
-  if (g_state.song_list.count > 0) {
-    play_current_song();
+  if (g_state.song_count > 0) {
+    play_current_song_from(resume_ms);
+    ESP_LOGI(TAG, "First song started %lld ms after boot",
+             (long long)(esp_timer_get_time() / 1000));
   }
 
+  // Bring the library index up to date while the music plays. Nothing
+  // cheap tells whether files were renamed or moved while asleep, so it
+  // always runs, but only once the first sample is out
+  bool refresh_pending = true;
+
   // 5. Main Loop
   while (1) {
-    button_event_t btn = io_get_last_button();
+    // Wait for a button or the player for up to 100ms, so both are handled
+    // at once and the rest is looked at ~10 times a second
+    QueueSetMemberHandle_t ready =
+        xQueueSelectFromSet(events, pdMS_TO_TICKS(100));
+    if (ready == sleep_request) {
+      xSemaphoreTake(sleep_request, 0);
+      save_and_sleep();
+    } else if (ready == player_events) {
+      mplayer_event_t event;
+      if (xQueueReceive(player_events, &event, 0) == pdTRUE) {
+        handle_player_event(&event);
+      }
+    } else if (ready != NULL) {
+      button_event_t event;
+      if (io_get_button_event(&event, 0)) {
+        handle_button(&event);
+      }
+    }
 
-    if (btn != BTN_NONE) {
-      switch (btn) {
-      case BTN_NEXT:
-        ESP_LOGI(TAG, "CMD: Next Song");
-        state_next_song();
-        play_current_song();
-        break;
+    if (refresh_pending && (mplayer_get_first_sample_time() != 0 ||
+                            g_state.status == STATE_STOPPED)) {
+      refresh_pending = false;
+      state_refresh_library();
+    }
 
-      case BTN_PREV:
-        ESP_LOGI(TAG, "CMD: Previous Song");
-        state_prev_song();
+    // The list changed under us, the songs around the current one may be
+    // others now (or there was nothing to play before)
+    if (state_apply_library_refresh()) {
+      if (g_state.status == STATE_STOPPED) {
         play_current_song();
-        break;
-
-      case BTN_PAUSE:
-        ESP_LOGI(TAG, "CMD: Pause/Resume");
-        if (g_state.status == STATE_PLAYING) {
-          mplayer_pause();
-          g_state.status = STATE_PAUSED;
-        } else if (g_state.status == STATE_PAUSED) {
-          mplayer_resume();
-          g_state.status = STATE_PLAYING;
-        } else if (g_state.status == STATE_STOPPED) {
-          // Optional: If stopped, play current
-          play_current_song();
-        }
-        break;
-
-      default:
-        break;
+      } else {
+        preload_neighbours();
       }
     }
 
-    // Optional: Check if song finished naturally (polling status or callback)
-    // Since mplayer currently stops on EOF but doesn't auto-update status to
-    // STOPPED in our structure, we might want to add a check here or update
-    // mplayer to notify. For now, we rely on user input.
-    if (mplayer_has_finished()) {
-      state_next_song();
-      play_current_song();
-    }
-
-    vTaskDelay(pdMS_TO_TICKS(100)); // Run loop at ~10Hz
+    log_gap();
+    log_first_sample(resumed);
+    log_power();
   }
 }
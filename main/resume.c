@@ -0,0 +1,101 @@
+#include "resume.h"
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_rom_crc.h"
+#include "esp_sleep.h"
+#include "nvs.h"
+#include "nvs_flash.h"
+#include <stddef.h>
+#include <string.h>
+
+static const char *TAG = "RESUME";
+
+#define RESUME_MAGIC 0x4d505253 // "MPRS"
+#define NVS_NAMESPACE "mplayer"
+#define NVS_KEY "resume"
+
+typedef struct {
+    uint32_t magic;
+    resume_point_t point;
+    uint32_t crc;
+} resume_record_t;
+
+// Kept through deep sleep, lost on a reset or power cut
+static RTC_DATA_ATTR resume_record_t rtc_record;
+
+static bool nvs_ready = false;
+
+static uint32_t record_crc(const resume_record_t *record) {
+  return esp_rom_crc32_le(0, (const uint8_t *)record,
+                          offsetof(resume_record_t, crc));
+}
+
+static bool record_valid(const resume_record_t *record) {
+  return record->magic == RESUME_MAGIC && record->crc == record_crc(record);
+}
+
+void resume_setup(void) {
+  esp_err_t ret = nvs_flash_init();
+  if (ret == ESP_ERR_NVS_NO_FREE_PAGES ||
+      ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
+    // Partition full or from another IDF version, start over
+    nvs_flash_erase();
+    ret = nvs_flash_init();
+  }
+  if (ret != ESP_OK) {
+    ESP_LOGW(TAG, "NVS not available, resume only from deep sleep: %s",
+             esp_err_to_name(ret));
+    return;
+  }
+  nvs_ready = true;
+}
+
+void resume_save(const resume_point_t *point) {
+  rtc_record.magic = RESUME_MAGIC;
+  rtc_record.point = *point;
+  rtc_record.crc = record_crc(&rtc_record);
+
+  if (!nvs_ready) {
+    return;
+  }
+  nvs_handle_t nvs;
+  esp_err_t ret = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &nvs);
+  if (ret == ESP_OK) {
+    ret = nvs_set_blob(nvs, NVS_KEY, &rtc_record, sizeof(rtc_record));
+    if (ret == ESP_OK) {
+      ret = nvs_commit(nvs);
+    }
+    nvs_close(nvs);
+  }
+  if (ret != ESP_OK) {
+    ESP_LOGW(TAG, "Failed to save resume point to NVS: %s",
+             esp_err_to_name(ret));
+  }
+}
+
+bool resume_load(resume_point_t *point) {
+  if (esp_sleep_get_wakeup_cause() != ESP_SLEEP_WAKEUP_UNDEFINED &&
+      record_valid(&rtc_record)) {
+    *point = rtc_record.point;
+    ESP_LOGI(TAG, "Resuming from RTC memory");
+    return true;
+  }
+
+  if (!nvs_ready) {
+    return false;
+  }
+  resume_record_t record;
+  size_t len = sizeof(record);
+  nvs_handle_t nvs;
+  bool found = false;
+  if (nvs_open(NVS_NAMESPACE, NVS_READONLY, &nvs) == ESP_OK) {
+    found = nvs_get_blob(nvs, NVS_KEY, &record, &len) == ESP_OK &&
+            len == sizeof(record) && record_valid(&record);
+    nvs_close(nvs);
+  }
+  if (found) {
+    *point = record.point;
+    ESP_LOGI(TAG, "Resuming from NVS");
+  }
+  return found;
+}
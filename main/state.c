@@ -1,7 +1,14 @@
 #include "state.h"
 #include "esp_log.h"
 #include "fail.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "library.h"
+#include "playlist.h"
+#include "resume.h"
+#include <stdio.h>
 #include <string.h>
+#include <sys/stat.h>
 
 static const char *TAG = "STATE";
 
@@ -11,37 +18,218 @@ player_state_t g_state = {
     .status = STATE_STOPPED
 };
 
+// Library behind g_state.song_count, only read through its window so it
+// takes the same memory whatever the size of the card
+static library_t library;
+static const char *library_dir = NULL;
+static volatile bool refresh_done = false;
+
+// A playlist with one of these names in the library directory gives the
+// songs and their order instead of the library
+static const char *const playlist_names[] = {"playlist.m3u8", "playlist.m3u"};
+static playlist_t playlist;
+static bool use_playlist = false;
+
+static void open_playlist(const char *dir_path) {
+    char path[PLAYLIST_DIR_LEN + 32];
+    for (size_t i = 0; i < sizeof(playlist_names) / sizeof(playlist_names[0]); i++) {
+        snprintf(path, sizeof(path), "%s/%s", dir_path, playlist_names[i]);
+        if (playlist_open(path, dir_path, &playlist) == ESP_OK &&
+            playlist_count(&playlist) > 0) {
+            use_playlist = true;
+            return;
+        }
+        playlist_close(&playlist);
+    }
+}
+
+// Path (relative to the library directory), size and modification time of
+// song `idx`, from the library or for a playlist from the file itself
+static bool song_info(int idx, char *path, size_t len, uint32_t *size,
+                      uint32_t *mtime) {
+    if (!use_playlist) {
+        const library_entry_t *entry;
+        const char *name;
+        if (library_get(&library, idx, &entry, &name) != ESP_OK) return false;
+        *size = entry->size;
+        *mtime = entry->mtime;
+        return snprintf(path, len, "%s", name) < (int)len;
+    }
+
+    char full[PLAYLIST_DIR_LEN + RESUME_PATH_LEN];
+    struct stat st;
+    if (playlist_get(&playlist, idx, full, sizeof(full)) != ESP_OK ||
+        stat(full, &st) != 0) {
+        return false;
+    }
+    *size = (uint32_t)st.st_size;
+    *mtime = (uint32_t)st.st_mtime;
+    return snprintf(path, len, "%s", full + strlen(library_dir) + 1) < (int)len;
+}
+
+static int find_song(const char *path) {
+    if (!use_playlist) return library_find(&library, path);
+
+    char full[PLAYLIST_DIR_LEN + RESUME_PATH_LEN];
+    snprintf(full, sizeof(full), "%s/%s", library_dir, path);
+    return playlist_find(&playlist, full);
+}
+
 void state_init(const char *dir_path) {
     ESP_LOGI(TAG, "Initializing state from directory: %s", dir_path);
     
-    esp_err_t ret = files_get_files_in_directory(dir_path, &g_state.song_list);
-    if (ret != ESP_OK) {
-        system_fatal_error("Failed to read music directory from SD Card");
+    library_dir = dir_path;
+    if (library_open(dir_path, &library) != ESP_OK) {
+        // First time, just list the songs so something can play, their
+        // formats come with the refresh
+        bool changed;
+        if (library_refresh(dir_path, false, &changed) != ESP_OK ||
+            library_commit(dir_path, &library) != ESP_OK) {
+            system_fatal_error("Failed to read music directory from SD Card");
+        }
     }
+    open_playlist(dir_path);
+    g_state.song_count = use_playlist ? playlist_count(&playlist)
+                                      : library_count(&library);
 
-    if (g_state.song_list.count == 0) {
+    if (g_state.song_count == 0) {
         ESP_LOGW(TAG, "No songs found in %s", dir_path);
     } else {
-        ESP_LOGI(TAG, "State initialized with %zu songs.", g_state.song_list.count);
+        ESP_LOGI(TAG, "State initialized with %zu songs%s.", g_state.song_count,
+                 use_playlist ? " from the playlist" : "");
     }
     
     g_state.current_idx = 0;
     g_state.status = STATE_STOPPED;
 }
 
+bool state_get_song_path(int idx, char *filepath, size_t len) {
+    int count = (int)g_state.song_count;
+    if (count == 0) return false;
+
+    const char *path;
+    idx = ((idx % count) + count) % count;
+    if (use_playlist) {
+        return playlist_get(&playlist, idx, filepath, len) == ESP_OK;
+    }
+    if (library_get(&library, idx, NULL, &path) != ESP_OK) return false;
+    return snprintf(filepath, len, "%s/%s", library_dir, path) < (int)len;
+}
+
+static void refresh_task(void *pvParameters) {
+    bool changed = false;
+    if (library_refresh(library_dir, true, &changed) == ESP_OK && changed) {
+        refresh_done = true;
+    }
+    vTaskDelete(NULL);
+}
+
+void state_refresh_library(void) {
+    if (library_dir == NULL) return;
+
+    // Lowest priority, it only matters once nothing else has work to do
+    if (xTaskCreate(refresh_task, "library_task", 4096, NULL, 1, NULL) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to start the library refresh");
+    }
+}
+
+bool state_apply_library_refresh(void) {
+    if (!refresh_done) return false;
+    refresh_done = false;
+
+    if (use_playlist) {
+        // Songs go in playlist order, a new library doesn't move them
+        if (library_commit(library_dir, &library) != ESP_OK) {
+            system_fatal_error("Failed to replace the library index");
+        }
+        return false;
+    }
+
+    // Follow the current song to its new position
+    char current[LIBRARY_PATH_LEN] = "";
+    const char *path;
+    if (library_get(&library, g_state.current_idx, NULL, &path) == ESP_OK) {
+        snprintf(current, sizeof(current), "%s", path);
+    }
+
+    if (library_commit(library_dir, &library) != ESP_OK) {
+        system_fatal_error("Failed to replace the library index");
+    }
+    g_state.song_count = library_count(&library);
+
+    int idx = 0;
+    if (library_get(&library, g_state.current_idx, NULL, &path) == ESP_OK &&
+        strcmp(path, current) == 0) {
+        idx = g_state.current_idx;
+    } else if (current[0] != '\0') {
+        int32_t found = library_find(&library, current);
+        idx = found >= 0 ? found : 0;
+    }
+    g_state.current_idx = idx;
+
+    ESP_LOGI(TAG, "Library refreshed, %zu songs.", g_state.song_count);
+    return true;
+}
+
+void state_save_resume(uint32_t position_ms) {
+    resume_point_t point = {
+        .song_idx = g_state.current_idx,
+        .position_ms = g_state.status == STATE_STOPPED ? 0 : position_ms,
+    };
+    if (g_state.song_count == 0 ||
+        !song_info(g_state.current_idx, point.path, sizeof(point.path),
+                   &point.size, &point.mtime)) {
+        return;
+    }
+    resume_save(&point);
+    ESP_LOGI(TAG, "Saved song %d at %lu ms", g_state.current_idx,
+             (unsigned long)point.position_ms);
+}
+
+bool state_restore_resume(uint32_t *position_ms) {
+    resume_point_t point;
+    if (g_state.song_count == 0 || !resume_load(&point)) return false;
+
+    // Same file where it was, else look for it (the library changed)
+    char path[RESUME_PATH_LEN];
+    uint32_t size, mtime;
+    int idx = -1;
+    if (point.song_idx < g_state.song_count &&
+        song_info(point.song_idx, path, sizeof(path), &size, &mtime) &&
+        strcmp(path, point.path) == 0) {
+        idx = point.song_idx;
+    } else {
+        idx = find_song(point.path);
+        if (idx < 0 || !song_info(idx, path, sizeof(path), &size, &mtime)) {
+            ESP_LOGW(TAG, "Song to resume is gone: %s", point.path);
+            return false;
+        }
+    }
+    if (size != point.size || mtime != point.mtime) {
+        ESP_LOGW(TAG, "Song to resume changed: %s", point.path);
+        return false;
+    }
+
+    g_state.current_idx = idx;
+    *position_ms = point.position_ms;
+    ESP_LOGI(TAG, "Resuming song %d at %lu ms", idx,
+             (unsigned long)point.position_ms);
+    return true;
+}
+
 void state_next_song(void) {
-    if (g_state.song_list.count == 0) return;
+    if (g_state.song_count == 0) return;
     
-    g_state.current_idx = (g_state.current_idx + 1) % g_state.song_list.count;
+    g_state.current_idx = (g_state.current_idx + 1) % g_state.song_count;
     ESP_LOGI(TAG, "Switched to next song, index: %d", g_state.current_idx);
 }
 
 void state_prev_song(void) {
-    if (g_state.song_list.count == 0) return;
+    if (g_state.song_count == 0) return;
     
     g_state.current_idx--;
     if (g_state.current_idx < 0) {
-        g_state.current_idx = g_state.song_list.count - 1;
+        g_state.current_idx = g_state.song_count - 1;
     }
     ESP_LOGI(TAG, "Switched to previous song, index: %d", g_state.current_idx);
 }
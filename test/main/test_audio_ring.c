@@ -0,0 +1,261 @@
+#include "audio_ring.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "test_util.h"
+#include "unity.h"
+#include <inttypes.h>
+#include <string.h>
+
+#define SMALL_SIZE 16
+#define TASKS_SIZE 4096
+#define TASKS_BYTES (512 * 1024)
+#define BENCH_BYTES (8 * 1024 * 1024)
+#define BENCH_CHUNK 512
+
+static void fill_pattern(uint8_t *buf, size_t len, uint8_t start) {
+  for (size_t i = 0; i < len; i++) {
+    buf[i] = (uint8_t)(start + i);
+  }
+}
+
+TEST_CASE("ring rejects sizes that are not a power of two", "[ring]") {
+  static uint8_t storage[SMALL_SIZE];
+  audio_ring_t ring;
+
+  TEST_ASSERT_EQUAL(ESP_ERR_INVALID_ARG, audio_ring_init(&ring, storage, 12));
+  TEST_ASSERT_EQUAL(ESP_ERR_INVALID_ARG, audio_ring_init(&ring, storage, 0));
+  TEST_ASSERT_EQUAL(ESP_ERR_INVALID_ARG, audio_ring_init(&ring, NULL, 16));
+  TEST_ASSERT_EQUAL(ESP_OK, audio_ring_init(&ring, storage, SMALL_SIZE));
+  TEST_ASSERT_EQUAL(SMALL_SIZE, audio_ring_size(&ring));
+}
+
+TEST_CASE("ring fills up and drains", "[ring]") {
+  static uint8_t storage[SMALL_SIZE];
+  audio_ring_t ring;
+  uint8_t in[SMALL_SIZE + 4];
+  uint8_t out[SMALL_SIZE + 4];
+  TEST_ASSERT_EQUAL(ESP_OK, audio_ring_init(&ring, storage, SMALL_SIZE));
+  fill_pattern(in, sizeof(in), 0);
+
+  TEST_ASSERT_EQUAL(0, audio_ring_used(&ring));
+  TEST_ASSERT_EQUAL(0, audio_ring_read(&ring, out, 1));
+
+  // Only as much as fits goes in
+  TEST_ASSERT_EQUAL(SMALL_SIZE, audio_ring_write(&ring, in, sizeof(in)));
+  TEST_ASSERT_EQUAL(SMALL_SIZE, audio_ring_used(&ring));
+  TEST_ASSERT_EQUAL(0, audio_ring_free(&ring));
+  TEST_ASSERT_EQUAL(0, audio_ring_write(&ring, in, 1));
+
+  TEST_ASSERT_EQUAL(5, audio_ring_read(&ring, out, 5));
+  TEST_ASSERT_EQUAL(5, audio_ring_free(&ring));
+  TEST_ASSERT_EQUAL(SMALL_SIZE - 5,
+                    audio_ring_read(&ring, out + 5, sizeof(out)));
+  TEST_ASSERT_EQUAL_MEMORY(in, out, SMALL_SIZE);
+  TEST_ASSERT_EQUAL(0, audio_ring_used(&ring));
+}
+
+TEST_CASE("ring spans split at the end of the storage", "[ring]") {
+  static uint8_t storage[SMALL_SIZE];
+  audio_ring_t ring;
+  audio_ring_span_t spans[2];
+  uint8_t in[12];
+  uint8_t out[12];
+  TEST_ASSERT_EQUAL(ESP_OK, audio_ring_init(&ring, storage, SMALL_SIZE));
+
+  // Move both counters to 10, the free space is then 6 bytes at the end
+  // and 10 at the start
+  TEST_ASSERT_EQUAL(10, audio_ring_write(&ring, in, 10));
+  TEST_ASSERT_EQUAL(10, audio_ring_read(&ring, out, 10));
+  TEST_ASSERT_EQUAL(SMALL_SIZE, audio_ring_write_spans(&ring, spans));
+  TEST_ASSERT_EQUAL_PTR(storage + 10, spans[0].ptr);
+  TEST_ASSERT_EQUAL(6, spans[0].len);
+  TEST_ASSERT_EQUAL_PTR(storage, spans[1].ptr);
+  TEST_ASSERT_EQUAL(10, spans[1].len);
+
+  // Nothing is visible to the consumer before the commit
+  memcpy(spans[0].ptr, "abcdef", 6);
+  TEST_ASSERT_EQUAL(0, audio_ring_used(&ring));
+  audio_ring_write_commit(&ring, 6);
+
+  fill_pattern(in, sizeof(in), 100);
+  TEST_ASSERT_EQUAL(sizeof(in) - 6, audio_ring_write(&ring, in, 6));
+  TEST_ASSERT_EQUAL(12, audio_ring_read_spans(&ring, spans));
+  TEST_ASSERT_EQUAL(6, spans[0].len);
+  TEST_ASSERT_EQUAL_MEMORY("abcdef", spans[0].ptr, 6);
+  TEST_ASSERT_EQUAL(6, spans[1].len);
+  TEST_ASSERT_EQUAL_MEMORY(in, spans[1].ptr, 6);
+
+  // Releasing part of it leaves the rest in place
+  audio_ring_read_commit(&ring, 4);
+  TEST_ASSERT_EQUAL(8, audio_ring_read(&ring, out, sizeof(out)));
+  TEST_ASSERT_EQUAL_MEMORY("ef", out, 2);
+  TEST_ASSERT_EQUAL_MEMORY(in, out + 2, 6);
+}
+
+TEST_CASE("ring counters wrap around", "[ring]") {
+  static uint8_t storage[SMALL_SIZE];
+  audio_ring_t ring;
+  uint8_t in[SMALL_SIZE];
+  uint8_t out[SMALL_SIZE];
+  TEST_ASSERT_EQUAL(ESP_OK, audio_ring_init(&ring, storage, SMALL_SIZE));
+  fill_pattern(in, sizeof(in), 7);
+
+  // Where they are after 4 GB on the ESP32, the next writes overflow them
+  atomic_store(&ring.head, SIZE_MAX - 5);
+  atomic_store(&ring.tail, SIZE_MAX - 5);
+  for (int i = 0; i < 4; i++) {
+    TEST_ASSERT_EQUAL(SMALL_SIZE, audio_ring_write(&ring, in, SMALL_SIZE));
+    TEST_ASSERT_EQUAL(SMALL_SIZE, audio_ring_used(&ring));
+    TEST_ASSERT_EQUAL(SMALL_SIZE, audio_ring_read(&ring, out, SMALL_SIZE));
+    TEST_ASSERT_EQUAL_MEMORY(in, out, SMALL_SIZE);
+  }
+  TEST_ASSERT_EQUAL(0, audio_ring_used(&ring));
+}
+
+TEST_CASE("ring head set back never ends up behind the consumer", "[ring]") {
+  static uint8_t storage[SMALL_SIZE];
+  audio_ring_t ring;
+  uint8_t in[SMALL_SIZE];
+  uint8_t out[SMALL_SIZE];
+  audio_ring_span_t spans[2];
+  TEST_ASSERT_EQUAL(ESP_OK, audio_ring_init(&ring, storage, SMALL_SIZE));
+  fill_pattern(in, sizeof(in), 0);
+
+  // Back to what the consumer has yet to read, as a fade out does
+  TEST_ASSERT_EQUAL(12, audio_ring_write(&ring, in, 12));
+  TEST_ASSERT_EQUAL(3, audio_ring_read(&ring, out, 3));
+  TEST_ASSERT_EQUAL(7, audio_ring_set_head(&ring, 7));
+  TEST_ASSERT_EQUAL(4, audio_ring_used(&ring));
+
+  // Before what it already read it stops at the tail
+  TEST_ASSERT_EQUAL(3, audio_ring_set_head(&ring, 1));
+  TEST_ASSERT_EQUAL(0, audio_ring_used(&ring));
+  TEST_ASSERT_EQUAL(SMALL_SIZE, audio_ring_free(&ring));
+
+  // The consumer read past it meanwhile, the ring is empty and not full
+  TEST_ASSERT_EQUAL(8, audio_ring_write(&ring, in, 8));
+  TEST_ASSERT_EQUAL(8, audio_ring_read_spans(&ring, spans));
+  TEST_ASSERT_EQUAL(5, audio_ring_set_head(&ring, 5));
+  audio_ring_read_commit(&ring, 8);
+  TEST_ASSERT_EQUAL(0, audio_ring_used(&ring));
+  TEST_ASSERT_EQUAL(0, audio_ring_read_spans(&ring, spans));
+  TEST_ASSERT_EQUAL(SMALL_SIZE, audio_ring_write_spans(&ring, spans));
+  TEST_ASSERT_EQUAL(audio_ring_tail(&ring), audio_ring_head(&ring));
+}
+
+typedef struct {
+  audio_ring_t ring;
+  SemaphoreHandle_t done;
+  size_t bad_at; // First byte read wrong, SIZE_MAX if none
+} ring_tasks_t;
+
+// Writes a byte counter in chunks of changing size, straight into the spans
+static void producer_task(void *arg) {
+  ring_tasks_t *t = arg;
+  size_t sent = 0;
+  size_t chunk = 1;
+  while (sent < TASKS_BYTES) {
+    audio_ring_span_t spans[2];
+    size_t len = audio_ring_write_spans(&t->ring, spans);
+    if (len == 0) {
+      taskYIELD();
+      continue;
+    }
+    if (len > chunk) {
+      len = chunk;
+    }
+    if (len > TASKS_BYTES - sent) {
+      len = TASKS_BYTES - sent;
+    }
+    size_t first = len < spans[0].len ? len : spans[0].len;
+    fill_pattern(spans[0].ptr, first, (uint8_t)sent);
+    fill_pattern(spans[1].ptr, len - first, (uint8_t)(sent + first));
+    audio_ring_write_commit(&t->ring, len);
+    sent += len;
+    chunk = chunk * 7 % 1021 + 1;
+  }
+  xSemaphoreGive(t->done);
+  vTaskDelete(NULL);
+}
+
+// Reads it back with the copy helper and checks it
+static void consumer_task(void *arg) {
+  ring_tasks_t *t = arg;
+  uint8_t buf[333];
+  size_t got = 0;
+  while (got < TASKS_BYTES) {
+    size_t len = audio_ring_read(&t->ring, buf, sizeof(buf));
+    if (len == 0) {
+      taskYIELD();
+      continue;
+    }
+    for (size_t i = 0; i < len && t->bad_at == SIZE_MAX; i++) {
+      if (buf[i] != (uint8_t)(got + i)) {
+        t->bad_at = got + i;
+      }
+    }
+    got += len;
+  }
+  xSemaphoreGive(t->done);
+  vTaskDelete(NULL);
+}
+
+TEST_CASE("ring passes a stream between two tasks intact", "[ring]") {
+  static uint8_t storage[TASKS_SIZE];
+  static ring_tasks_t t;
+  TEST_ASSERT_EQUAL(ESP_OK, audio_ring_init(&t.ring, storage, TASKS_SIZE));
+  t.done = xSemaphoreCreateCounting(2, 0);
+  t.bad_at = SIZE_MAX;
+  TEST_ASSERT_NOT_NULL(t.done);
+
+  // One on each core where there are two
+  UBaseType_t prio = uxTaskPriorityGet(NULL);
+  TEST_ASSERT_EQUAL(pdPASS, xTaskCreatePinnedToCore(producer_task, "producer",
+                                                    2048, &t, prio, NULL, 0));
+  TEST_ASSERT_EQUAL(pdPASS,
+                    xTaskCreatePinnedToCore(consumer_task, "consumer", 2048,
+                                            &t, prio, NULL,
+                                            portNUM_PROCESSORS - 1));
+  for (int i = 0; i < 2; i++) {
+    TEST_ASSERT_EQUAL(pdTRUE, xSemaphoreTake(t.done, pdMS_TO_TICKS(10000)));
+  }
+  vSemaphoreDelete(t.done);
+
+  TEST_ASSERT_EQUAL(SIZE_MAX, t.bad_at);
+  TEST_ASSERT_EQUAL(0, audio_ring_used(&t.ring));
+}
+
+TEST_CASE("ring throughput", "[ring][bench]") {
+  static uint8_t storage[TASKS_SIZE];
+  static uint8_t buf[BENCH_CHUNK];
+  audio_ring_t ring;
+  audio_ring_span_t spans[2];
+  TEST_ASSERT_EQUAL(ESP_OK, audio_ring_init(&ring, storage, TASKS_SIZE));
+
+  // The way the player and the output use it, producer and consumer in
+  // turns a block at a time: spans on the write side, a copy on the read
+  // side. Mostly memcpy, what matters is that the ring adds little to it
+  int64_t start = esp_timer_get_time();
+  for (size_t done = 0; done < BENCH_BYTES; done += BENCH_CHUNK) {
+    size_t len = audio_ring_write_spans(&ring, spans);
+    TEST_ASSERT_GREATER_OR_EQUAL(BENCH_CHUNK, len);
+    size_t first = BENCH_CHUNK < spans[0].len ? BENCH_CHUNK : spans[0].len;
+    memset(spans[0].ptr, 0x80, first);
+    memset(spans[1].ptr, 0x80, BENCH_CHUNK - first);
+    audio_ring_write_commit(&ring, BENCH_CHUNK);
+    TEST_ASSERT_EQUAL(BENCH_CHUNK, audio_ring_read(&ring, buf, BENCH_CHUNK));
+  }
+  int64_t elapsed = esp_timer_get_time() - start;
+
+  uint32_t chunks = BENCH_BYTES / BENCH_CHUNK;
+  test_result("ring",
+              "\"bytes\":%d,\"chunk\":%d,\"us\":%lld,\"kb_s\":%lld,"
+              "\"ns_per_chunk\":%lld",
+              BENCH_BYTES, BENCH_CHUNK, (long long)elapsed,
+              (long long)(elapsed > 0 ? (int64_t)BENCH_BYTES * 1000000 /
+                                            1024 / elapsed
+                                      : 0),
+              (long long)(elapsed * 1000 / chunks));
+}
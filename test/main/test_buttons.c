@@ -0,0 +1,227 @@
+#include "buttons.h"
+#include "esp_timer.h"
+#include "test_util.h"
+#include "unity.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define MS(x) ((int64_t)(x) * 1000)
+#define MAX_EDGES 64
+#define MAX_EVENTS 32
+#define FUZZ_PRESSES 5000
+
+typedef struct {
+    int64_t time_us;
+    button_id_t button;
+    int level;
+} edge_t;
+
+static buttons_t buttons;
+static int levels[BTN_COUNT];
+static int64_t next_poll;
+static edge_t edges[MAX_EDGES];
+static size_t edge_count;
+static button_event_t events[MAX_EVENTS];
+static size_t event_count;
+static uint32_t gestures[BTN_GESTURE_REPEAT + 1];
+static bool out_of_order; // A PRESS after a PRESS or a RELEASE after one
+static bool pressed[BTN_COUNT];
+
+static void on_event(const button_event_t *event) {
+  if (event_count < MAX_EVENTS) {
+    events[event_count] = *event;
+  }
+  event_count++;
+  gestures[event->gesture]++;
+  if (event->gesture == BTN_GESTURE_PRESS ||
+      event->gesture == BTN_GESTURE_RELEASE) {
+    bool down = event->gesture == BTN_GESTURE_PRESS;
+    out_of_order |= pressed[event->button] == down;
+    pressed[event->button] = down;
+  }
+}
+
+static int read_level(button_id_t button) { return levels[button]; }
+
+static void start(void) {
+  for (int i = 0; i < BTN_COUNT; i++) {
+    levels[i] = 1;
+    pressed[i] = false;
+  }
+  edge_count = 0;
+  event_count = 0;
+  memset(gestures, 0, sizeof(gestures));
+  out_of_order = false;
+  buttons_init(&buttons, read_level, on_event);
+  next_poll = buttons_poll(&buttons, 0);
+}
+
+// A press at `at_ms` held for `hold_ms`, each edge followed by `bounces`
+// pairs of edges within the next few ms as a real contact does
+static void press(button_id_t button, double at_ms, double hold_ms,
+                  int bounces) {
+  int64_t down = (int64_t)(at_ms * 1000);
+  int64_t up = (int64_t)((at_ms + hold_ms) * 1000);
+  TEST_ASSERT_LESS_OR_EQUAL(MAX_EDGES, edge_count + 2 + 4 * bounces);
+
+  edges[edge_count++] = (edge_t){down, button, 0};
+  for (int i = 0; i < bounces; i++) {
+    edges[edge_count++] = (edge_t){down + 200 + i * 400, button, 1};
+    edges[edge_count++] = (edge_t){down + 400 + i * 400, button, 0};
+  }
+  edges[edge_count++] = (edge_t){up, button, 1};
+  for (int i = 0; i < bounces; i++) {
+    edges[edge_count++] = (edge_t){up + 200 + i * 400, button, 0};
+    edges[edge_count++] = (edge_t){up + 400 + i * 400, button, 1};
+  }
+}
+
+static int by_time(const void *a, const void *b) {
+  const edge_t *x = a;
+  const edge_t *y = b;
+  return x->time_us < y->time_us ? -1 : x->time_us > y->time_us;
+}
+
+// Feed the edges in time order with the polls due between them, as the
+// button task does, then run the timers out
+static void run(void) {
+  qsort(edges, edge_count, sizeof(edge_t), by_time);
+  for (size_t i = 0; i < edge_count; i++) {
+    while (next_poll < edges[i].time_us) {
+      next_poll = buttons_poll(&buttons, next_poll);
+    }
+    levels[edges[i].button] = edges[i].level;
+    buttons_edge(&buttons, edges[i].button, edges[i].level, edges[i].time_us);
+    next_poll = buttons_poll(&buttons, edges[i].time_us);
+  }
+  edge_count = 0;
+  while (next_poll != INT64_MAX) {
+    next_poll = buttons_poll(&buttons, next_poll);
+  }
+}
+
+static void check_event(size_t i, button_id_t button,
+                        button_gesture_t gesture, int64_t time_us) {
+  TEST_ASSERT_LESS_THAN(event_count, i);
+  TEST_ASSERT_EQUAL(button, events[i].button);
+  TEST_ASSERT_EQUAL(gesture, events[i].gesture);
+  TEST_ASSERT_EQUAL(time_us, events[i].time_us);
+}
+
+TEST_CASE("buttons turn a bouncy tap into one click", "[buttons]") {
+  start();
+  press(BTN_NEXT, 10, 120, 5);
+  run();
+
+  // Timed at the first edge of each burst
+  TEST_ASSERT_EQUAL(3, event_count);
+  check_event(0, BTN_NEXT, BTN_GESTURE_PRESS, MS(10));
+  check_event(1, BTN_NEXT, BTN_GESTURE_RELEASE, MS(130));
+  check_event(2, BTN_NEXT, BTN_GESTURE_CLICK, MS(130));
+}
+
+TEST_CASE("buttons catch a tap shorter than the debounce", "[buttons]") {
+  start();
+  press(BTN_NEXT, 10, 8, 0);
+  run();
+
+  // The release is only seen once the bounce time is over
+  TEST_ASSERT_EQUAL(3, event_count);
+  check_event(0, BTN_NEXT, BTN_GESTURE_PRESS, MS(10));
+  check_event(1, BTN_NEXT, BTN_GESTURE_RELEASE, MS(10 + BUTTONS_DEBOUNCE_MS));
+  check_event(2, BTN_NEXT, BTN_GESTURE_CLICK, MS(10 + BUTTONS_DEBOUNCE_MS));
+}
+
+TEST_CASE("buttons tell a double press from two clicks", "[buttons]") {
+  start();
+  press(BTN_PAUSE, 10, 80, 3);
+  press(BTN_PAUSE, 200, 80, 3);
+  run();
+  TEST_ASSERT_EQUAL(6, event_count);
+  check_event(2, BTN_PAUSE, BTN_GESTURE_CLICK, MS(90));
+  check_event(5, BTN_PAUSE, BTN_GESTURE_DOUBLE, MS(280));
+
+  // Too late for a double
+  start();
+  press(BTN_PAUSE, 10, 80, 3);
+  press(BTN_PAUSE, 90 + BUTTONS_DOUBLE_MS + 10, 80, 3);
+  run();
+  TEST_ASSERT_EQUAL(2, gestures[BTN_GESTURE_CLICK]);
+  TEST_ASSERT_EQUAL(0, gestures[BTN_GESTURE_DOUBLE]);
+}
+
+TEST_CASE("buttons repeat a held press and don't click after it",
+          "[buttons]") {
+  start();
+  press(BTN_PREV, 10, 1400, 4);
+  run();
+
+  check_event(0, BTN_PREV, BTN_GESTURE_PRESS, MS(10));
+  check_event(1, BTN_PREV, BTN_GESTURE_LONG, MS(10 + BUTTONS_LONG_MS));
+  size_t i = 2;
+  for (int64_t at = 10 + BUTTONS_LONG_MS + BUTTONS_REPEAT_MS; at < 1410;
+       at += BUTTONS_REPEAT_MS) {
+    check_event(i++, BTN_PREV, BTN_GESTURE_REPEAT, MS(at));
+  }
+  check_event(i++, BTN_PREV, BTN_GESTURE_RELEASE, MS(1410));
+  TEST_ASSERT_EQUAL(i, event_count);
+}
+
+TEST_CASE("buttons pressed together don't mix", "[buttons]") {
+  start();
+  press(BTN_PREV, 10, 100, 3);
+  press(BTN_NEXT, 11, 100, 3);
+  press(BTN_PAUSE, 12, 100, 3);
+  run();
+
+  TEST_ASSERT_EQUAL(9, event_count);
+  TEST_ASSERT_EQUAL(3, gestures[BTN_GESTURE_PRESS]);
+  TEST_ASSERT_EQUAL(3, gestures[BTN_GESTURE_CLICK]);
+  TEST_ASSERT_FALSE(out_of_order);
+  check_event(0, BTN_PREV, BTN_GESTURE_PRESS, MS(10));
+  check_event(1, BTN_NEXT, BTN_GESTURE_PRESS, MS(11));
+  check_event(2, BTN_PAUSE, BTN_GESTURE_PRESS, MS(12));
+}
+
+// Random presses and gaps of at least 25 ms with up to 5 bounce pairs per
+// edge, returns the edges fed
+static uint32_t fuzz(button_id_t button) {
+  uint32_t seed = 1 + button;
+  uint32_t fed = 0;
+  double at = 10;
+  for (int i = 0; i < FUZZ_PRESSES; i++) {
+    seed = seed * 1664525 + 1013904223;
+    double hold = 25 + (seed >> 8) % 400;
+    int bounces = (seed >> 4) % 6;
+    press(button, at, hold, bounces);
+    fed += edge_count;
+    run();
+    at += hold + 25 + (seed >> 16) % 400;
+  }
+  return fed;
+}
+
+TEST_CASE("buttons see every press of a fuzzed sequence once", "[buttons]") {
+  for (int b = 0; b < BTN_COUNT; b++) {
+    start();
+    fuzz(b);
+    TEST_ASSERT_EQUAL(FUZZ_PRESSES, gestures[BTN_GESTURE_PRESS]);
+    TEST_ASSERT_EQUAL(FUZZ_PRESSES, gestures[BTN_GESTURE_RELEASE]);
+    TEST_ASSERT_FALSE(out_of_order);
+  }
+}
+
+TEST_CASE("buttons time per edge", "[buttons][bench]") {
+  start();
+  int64_t elapsed = esp_timer_get_time();
+  uint32_t cycles = test_cycles();
+  uint32_t fed = fuzz(BTN_NEXT);
+  cycles = test_cycles() - cycles;
+  elapsed = esp_timer_get_time() - elapsed;
+
+  test_result("buttons",
+              "\"edges\":%u,\"us\":%lld,\"ns_per_edge\":%lld,"
+              "\"cycles_per_edge\":%u",
+              (unsigned)fed, (long long)elapsed,
+              (long long)(elapsed * 1000 / fed), (unsigned)(cycles / fed));
+}
@@ -0,0 +1,134 @@
+#include "dsp.h"
+#include "esp_timer.h"
+#include "test_util.h"
+#include "unity.h"
+#include <stdlib.h>
+
+#define DSP_RATE 8000
+#define DSP_FREQ 200
+#define DSP_AMPLITUDE 24000
+#define DSP_LEN 400
+#define FADE_LEN 80 // 10 ms at 8 kHz, the default fade
+#define BENCH_BLOCK 256
+#define BENCH_BLOCKS 4000
+
+// Largest step of the sine itself in 8 bit samples, plus the dither and
+// the shaped error it can add on top. A step over this is a click
+#define MAX_STEP                                                               \
+  ((int)(2 * 3.1416 * DSP_FREQ / DSP_RATE * DSP_AMPLITUDE / 256) + 4)
+
+static int max_step(const uint8_t *buf, size_t len, uint8_t before) {
+  int max = 0;
+  int last = before;
+  for (size_t i = 0; i < len; i++) {
+    int step = abs((int)buf[i] - last);
+    if (step > max) {
+      max = step;
+    }
+    last = buf[i];
+  }
+  return max;
+}
+
+// The sine starting on its peak, the worst place for an edge
+static void peak_sine(int16_t *buf, size_t len) {
+  test_sine(buf, len, DSP_FREQ, DSP_RATE, DSP_AMPLITUDE,
+            DSP_RATE / DSP_FREQ / 4);
+}
+
+TEST_CASE("dsp fades in from silence without a click", "[dsp]") {
+  static int16_t in[DSP_LEN];
+  static uint8_t out[DSP_LEN];
+  dsp_t dsp;
+  peak_sine(in, DSP_LEN);
+
+  // Straight in, the first sample jumps from silence to the peak
+  dsp_init(&dsp, DSP_UNITY_GAIN);
+  dsp_process(&dsp, in, DSP_LEN, out);
+  TEST_ASSERT_GREATER_THAN(MAX_STEP, max_step(out, DSP_LEN, 128));
+
+  dsp_init(&dsp, DSP_UNITY_GAIN);
+  dsp_fade_in(&dsp, FADE_LEN);
+  dsp_process(&dsp, in, 30, out);
+  dsp_process(&dsp, in + 30, DSP_LEN - 30, out + 30);
+  TEST_ASSERT_LESS_OR_EQUAL(MAX_STEP, max_step(out, DSP_LEN, 128));
+  TEST_ASSERT_INT_WITHIN(1, 128, out[0]);
+  TEST_ASSERT_EQUAL(0, dsp.fade_len);
+}
+
+TEST_CASE("dsp fades the ring out and back in without a click", "[dsp]") {
+  static int16_t in[DSP_LEN];
+  static uint8_t out[DSP_LEN];
+  dsp_t dsp;
+  peak_sine(in, DSP_LEN);
+  dsp_init(&dsp, DSP_UNITY_GAIN);
+  dsp_process(&dsp, in, DSP_LEN, out);
+
+  // From sample 100 on, split in two spans as the ring end would
+  uint8_t *fade = out + 100;
+  dsp_fade_out_u8(fade, 37, 0, FADE_LEN);
+  dsp_fade_out_u8(fade + 37, DSP_LEN - 137, 37, FADE_LEN);
+  TEST_ASSERT_LESS_OR_EQUAL(MAX_STEP, max_step(out, DSP_LEN, out[0]));
+  for (size_t i = FADE_LEN; i < DSP_LEN - 100; i++) {
+    TEST_ASSERT_EQUAL(128, fade[i]);
+  }
+
+  // What was hidden comes back from silence, past the fade it's untouched
+  dsp_init(&dsp, DSP_UNITY_GAIN);
+  dsp_process(&dsp, in, DSP_LEN, out);
+  uint8_t after = out[FADE_LEN + 10];
+  dsp_fade_in_u8(out, 50, 0, FADE_LEN);
+  dsp_fade_in_u8(out + 50, DSP_LEN - 50, 50, FADE_LEN);
+  TEST_ASSERT_LESS_OR_EQUAL(MAX_STEP, max_step(out, DSP_LEN, 128));
+  TEST_ASSERT_EQUAL(128, out[0]);
+  TEST_ASSERT_EQUAL(after, out[FADE_LEN + 10]);
+}
+
+TEST_CASE("dsp ramps the volume without a step", "[dsp]") {
+  static int16_t in[DSP_LEN];
+  static uint8_t out[DSP_LEN];
+  dsp_t dsp;
+  for (size_t i = 0; i < DSP_LEN; i++) {
+    in[i] = DSP_AMPLITUDE;
+  }
+
+  // Full to a tenth of it on a constant level, a drop of about 80 steps
+  // that has to spread over the ramp
+  dsp_init(&dsp, DSP_UNITY_GAIN);
+  dsp_process(&dsp, in, 50, out);
+  dsp_set_gain(&dsp, DSP_UNITY_GAIN / 10);
+  dsp_process(&dsp, in + 50, DSP_LEN - 50, out + 50);
+  TEST_ASSERT_LESS_OR_EQUAL(3, max_step(out, DSP_LEN, out[0]));
+  TEST_ASSERT_INT_WITHIN(2, 128 + DSP_AMPLITUDE / 10 / 256, out[DSP_LEN - 1]);
+}
+
+TEST_CASE("dsp cycles per sample", "[dsp][bench]") {
+  static int16_t in[BENCH_BLOCK];
+  static uint8_t out[BENCH_BLOCK];
+  dsp_t dsp;
+  test_sine(in, BENCH_BLOCK, 440, DSP_RATE, DSP_AMPLITUDE, 0);
+  dsp_init(&dsp, DSP_UNITY_GAIN);
+
+  // Steady, then with the gain ramping and fades in all the time
+  for (int fading = 0; fading < 2; fading++) {
+    int64_t start = esp_timer_get_time();
+    uint32_t cycles = test_cycles();
+    for (int i = 0; i < BENCH_BLOCKS; i++) {
+      if (fading) {
+        dsp_set_gain(&dsp, i & 1 ? DSP_UNITY_GAIN : DSP_UNITY_GAIN / 4);
+        dsp_fade_in(&dsp, i & 2 ? FADE_LEN : 0);
+      }
+      dsp_process(&dsp, in, BENCH_BLOCK, out);
+    }
+    cycles = test_cycles() - cycles;
+    int64_t elapsed = esp_timer_get_time() - start;
+
+    uint32_t samples = BENCH_BLOCK * BENCH_BLOCKS;
+    test_result("dsp",
+                "\"fading\":%d,\"samples\":%u,\"us\":%lld,"
+                "\"ns_per_sample\":%lld,\"cycles_per_sample\":%u",
+                fading, (unsigned)samples, (long long)elapsed,
+                (long long)(elapsed * 1000 / samples),
+                (unsigned)(cycles / samples));
+  }
+}
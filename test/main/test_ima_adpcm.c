@@ -0,0 +1,271 @@
+#include "decoder.h"
+#include "esp_timer.h"
+#include "readahead.h"
+#include "test_util.h"
+#include "unity.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define WAV_FORMAT_IMA_ADPCM 0x11
+#define BLOCK_ALIGN 256
+#define DECODE_CHUNK 300
+#define BENCH_SECONDS 10
+
+static const int16_t step_table[89] = {
+    7,     8,     9,     10,    11,    12,    13,    14,    16,    17,
+    19,    21,    23,    25,    28,    31,    34,    37,    41,    45,
+    50,    55,    60,    66,    73,    80,    88,    97,    107,   118,
+    130,   143,   157,   173,   190,   209,   230,   253,   279,   307,
+    337,   371,   408,   449,   494,   544,   598,   658,   724,   796,
+    876,   963,   1060,  1166,  1282,  1411,  1552,  1707,  1878,  2066,
+    2272,  2499,  2749,  3024,  3327,  3660,  4026,  4428,  4871,  5358,
+    5894,  6484,  7132,  7845,  8630,  9493,  10442, 11487, 12635, 13899,
+    15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767};
+
+static const int8_t index_table[8] = {-1, -1, -1, -1, 2, 4, 6, 8};
+
+typedef struct {
+    int32_t predictor;
+    int32_t index;
+} encoder_t;
+
+// The usual IMA encoder, it tracks what the decoder will rebuild so the
+// output can be checked sample for sample
+static uint8_t encode_sample(encoder_t *e, int16_t sample, int16_t *rebuilt) {
+  int32_t step = step_table[e->index];
+  int32_t diff = sample - e->predictor;
+  uint8_t nibble = 0;
+  if (diff < 0) {
+    nibble = 8;
+    diff = -diff;
+  }
+
+  int32_t delta = step >> 3;
+  if (diff >= step) {
+    nibble |= 4;
+    diff -= step;
+    delta += step;
+  }
+  if (diff >= step >> 1) {
+    nibble |= 2;
+    diff -= step >> 1;
+    delta += step >> 1;
+  }
+  if (diff >= step >> 2) {
+    nibble |= 1;
+    delta += step >> 2;
+  }
+
+  e->predictor += nibble & 8 ? -delta : delta;
+  if (e->predictor > INT16_MAX) {
+    e->predictor = INT16_MAX;
+  } else if (e->predictor < INT16_MIN) {
+    e->predictor = INT16_MIN;
+  }
+  e->index += index_table[nibble & 7];
+  if (e->index < 0) {
+    e->index = 0;
+  } else if (e->index > 88) {
+    e->index = 88;
+  }
+  *rebuilt = (int16_t)e->predictor;
+  return nibble;
+}
+
+// Encodes `frames` interleaved frames into blocks, the last one padded with
+// silence. `rebuilt` gets the decoder output for each channel, interleaved
+static size_t encode(const int16_t *in, size_t frames, uint16_t channels,
+                     uint8_t *out, int16_t *rebuilt) {
+  size_t spb = (BLOCK_ALIGN - 4 * channels) * 2 / channels + 1;
+  encoder_t enc[2] = {0};
+  size_t len = 0;
+
+  for (size_t start = 0; start < frames; start += spb) {
+    uint8_t *block = out + len;
+    memset(block, 0, BLOCK_ALIGN);
+    for (int c = 0; c < channels; c++) {
+      // The first sample goes in the header as it is
+      int16_t first = in[start * channels + c];
+      enc[c].predictor = first;
+      rebuilt[start * channels + c] = first;
+      block[4 * c] = (uint8_t)first;
+      block[4 * c + 1] = (uint8_t)(first >> 8);
+      block[4 * c + 2] = (uint8_t)enc[c].index;
+
+      // Then groups of 4 bytes, 8 samples, for each channel in turn
+      uint8_t *data = block + 4 * channels + 4 * c;
+      for (size_t n = 1; n < spb; n++) {
+        size_t frame = start + n;
+        int16_t sample = frame < frames ? in[frame * channels + c] : 0;
+        int16_t out_sample;
+        uint8_t nibble = encode_sample(&enc[c], sample, &out_sample);
+        if (frame < frames) {
+          rebuilt[frame * channels + c] = out_sample;
+        }
+        size_t k = n - 1;
+        uint8_t *byte = data + (k / 8) * 4 * channels + (k % 8) / 2;
+        *byte |= k % 2 ? nibble << 4 : nibble;
+      }
+    }
+    len += BLOCK_ALIGN;
+  }
+  return len;
+}
+
+// Writes `frames` of a tone with some noise on it as an ADPCM WAV, returns
+// what the decoder should give back, mono
+static int16_t *write_adpcm(const char *path, uint32_t rate,
+                            uint16_t channels, uint32_t frames) {
+  size_t spb = (BLOCK_ALIGN - 4 * channels) * 2 / channels + 1;
+  size_t blocks = (frames + spb - 1) / spb;
+  int16_t *in = malloc(frames * channels * sizeof(int16_t));
+  int16_t *rebuilt = malloc(frames * channels * sizeof(int16_t));
+  uint8_t *coded = malloc(blocks * BLOCK_ALIGN);
+  TEST_ASSERT_NOT_NULL(in);
+  TEST_ASSERT_NOT_NULL(rebuilt);
+  TEST_ASSERT_NOT_NULL(coded);
+
+  int16_t *tone = malloc(frames * sizeof(int16_t));
+  TEST_ASSERT_NOT_NULL(tone);
+  test_sine(tone, frames, 440, rate, 12000, 0);
+  uint32_t noise = 1;
+  for (size_t i = 0; i < frames; i++) {
+    noise = noise * 1664525 + 1013904223;
+    for (int c = 0; c < channels; c++) {
+      in[i * channels + c] =
+          (int16_t)(tone[i] / (c + 1) + (int16_t)(noise >> 16) / 16);
+    }
+  }
+  free(tone);
+
+  size_t len = encode(in, frames, channels, coded, rebuilt);
+  test_wav_t wav = {
+      .format_tag = WAV_FORMAT_IMA_ADPCM,
+      .channels = channels,
+      .sample_rate = rate,
+      .bits_per_sample = 4,
+      .block_align = BLOCK_ALIGN,
+      .samples_per_block = (uint16_t)spb,
+      .fact_frames = frames,
+  };
+  TEST_ASSERT_EQUAL(ESP_OK, test_write_wav(path, &wav, coded, len));
+  free(coded);
+  free(in);
+
+  // Stereo comes out as the average of both
+  for (size_t i = 0; channels == 2 && i < frames; i++) {
+    rebuilt[i] = (int16_t)((rebuilt[2 * i] + rebuilt[2 * i + 1]) >> 1);
+  }
+  return rebuilt;
+}
+
+static void check_decode(uint16_t channels) {
+  const char *path = TEST_FILE("adpcm.wav");
+  const uint32_t frames = 11025 + 123;
+  int16_t *expected = write_adpcm(path, 11025, channels, frames);
+  int16_t *out = malloc(frames * sizeof(int16_t));
+  TEST_ASSERT_NOT_NULL(out);
+
+  readahead_t *stream = readahead_open(path);
+  TEST_ASSERT_NOT_NULL(stream);
+  decoder_t dec;
+  TEST_ASSERT_EQUAL(ESP_OK, decoder_open(&dec, stream, path));
+  TEST_ASSERT_EQUAL_PTR(&decoder_ima_adpcm, dec.ops);
+  TEST_ASSERT_EQUAL(11025, dec.format.sample_rate);
+  TEST_ASSERT_EQUAL(channels, dec.format.channels);
+  TEST_ASSERT_EQUAL(frames, dec.format.total_frames);
+
+  // The fact chunk cuts the padding of the last block
+  size_t got = 0;
+  size_t len;
+  while ((len = decoder_decode(&dec, out + got,
+                               frames - got < DECODE_CHUNK ? frames - got
+                                                           : DECODE_CHUNK))) {
+    got += len;
+  }
+  TEST_ASSERT_EQUAL(frames, got);
+  TEST_ASSERT_EQUAL_INT16_ARRAY(expected, out, frames);
+  TEST_ASSERT_EQUAL(0, decoder_decode(&dec, out, DECODE_CHUNK));
+
+  // Seeking into the middle of a block gives the same samples again
+  TEST_ASSERT_EQUAL(ESP_OK, decoder_seek(&dec, 1000));
+  TEST_ASSERT_EQUAL(DECODE_CHUNK, decoder_decode(&dec, out, DECODE_CHUNK));
+  TEST_ASSERT_EQUAL_INT16_ARRAY(expected + 1000, out, DECODE_CHUNK);
+
+  decoder_close(&dec);
+  readahead_close(stream);
+  free(out);
+  free(expected);
+}
+
+TEST_CASE("ima adpcm decodes mono sample for sample", "[adpcm]") {
+  check_decode(1);
+}
+
+TEST_CASE("ima adpcm decodes stereo to the average", "[adpcm]") {
+  check_decode(2);
+}
+
+TEST_CASE("ima adpcm turns down blocks too long to decode", "[adpcm]") {
+  // Mono blocks of 32780 bytes hold 65553 samples each, more than the fmt
+  // chunk can even say
+  static uint8_t block[32780];
+  const char *path = TEST_FILE("adpcm_long.wav");
+  test_wav_t wav = {.format_tag = WAV_FORMAT_IMA_ADPCM,
+                    .channels = 1,
+                    .sample_rate = 11025,
+                    .bits_per_sample = 4,
+                    .block_align = sizeof(block),
+                    .samples_per_block = UINT16_MAX};
+  TEST_ASSERT_EQUAL(ESP_OK, test_write_wav(path, &wav, block, sizeof(block)));
+
+  readahead_t *stream = readahead_open(path);
+  TEST_ASSERT_NOT_NULL(stream);
+  decoder_t dec;
+  TEST_ASSERT_EQUAL(ESP_ERR_NOT_SUPPORTED, decoder_open(&dec, stream, path));
+  TEST_ASSERT_NULL(dec.ops);
+  readahead_close(stream);
+}
+
+TEST_CASE("ima adpcm decode speed", "[adpcm][bench]") {
+  static int16_t out[DECODE_CHUNK];
+  static const struct {
+    uint32_t rate;
+    uint16_t channels;
+  } cases[] = {{11025, 1}, {22050, 1}, {22050, 2}};
+
+  for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+    const char *path = TEST_FILE("adpcm_bench.wav");
+    uint32_t frames = cases[i].rate * BENCH_SECONDS;
+    free(write_adpcm(path, cases[i].rate, cases[i].channels, frames));
+
+    readahead_t *stream = readahead_open(path);
+    TEST_ASSERT_NOT_NULL(stream);
+    decoder_t dec;
+    TEST_ASSERT_EQUAL(ESP_OK, decoder_open(&dec, stream, path));
+
+    // Card reads included, they go through the read-ahead as when playing
+    size_t got = 0;
+    size_t len;
+    int64_t start = esp_timer_get_time();
+    uint32_t cycles = test_cycles();
+    while ((len = decoder_decode(&dec, out, DECODE_CHUNK))) {
+      got += len;
+    }
+    cycles = test_cycles() - cycles;
+    int64_t elapsed = esp_timer_get_time() - start;
+    decoder_close(&dec);
+    readahead_close(stream);
+
+    TEST_ASSERT_EQUAL(frames, got);
+    test_result("adpcm_decode",
+                "\"rate\":%u,\"channels\":%u,\"frames\":%u,\"us\":%lld,"
+                "\"ns_per_frame\":%lld,\"cycles_per_frame\":%u,"
+                "\"realtime_x\":%lld",
+                (unsigned)cases[i].rate, (unsigned)cases[i].channels,
+                (unsigned)got, (long long)elapsed,
+                (long long)(elapsed * 1000 / got), (unsigned)(cycles / got),
+                (long long)(elapsed > 0 ? BENCH_SECONDS * 1000000LL / elapsed
+                                        : 0));
+  }
+}
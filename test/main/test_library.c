@@ -0,0 +1,311 @@
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "library.h"
+#include "player.h"
+#include "test_util.h"
+#include "unity.h"
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define LIBRARY_DIR TEST_FILE("library")
+#define ODD_DIR TEST_FILE("odd")
+#define CHANGES_DIR TEST_FILE("changes")
+#define SONG_RATE 8000
+#define SONG_MS 100
+#define ALBUMS 5
+#define TRACKS 20
+#define FIRST_SAMPLE_TIMEOUT_US 5000000
+#define RANDOM_GETS 2000
+
+static library_t lib; // Too big for the stack with its window
+
+// Path of song `i` of a tree of artists, albums and tracks
+static void song_path(char *path, size_t len, int i) {
+  snprintf(path, len, "%s/Artist %03d/Album %d/%02d - Track.wav", LIBRARY_DIR,
+           i / (ALBUMS * TRACKS), i / TRACKS % ALBUMS, i % TRACKS);
+}
+
+static void write_song(const char *path, uint32_t ms) {
+  static int16_t silence[SONG_RATE * SONG_MS * 4 / 1000];
+  test_wav_t wav = {
+      .format_tag = 1,
+      .channels = 1,
+      .sample_rate = SONG_RATE,
+      .bits_per_sample = 16,
+      .block_align = 2,
+  };
+  size_t len = SONG_RATE * ms / 1000 * sizeof(int16_t);
+  TEST_ASSERT_LESS_OR_EQUAL(sizeof(silence), len);
+  TEST_ASSERT_EQUAL(ESP_OK, test_write_wav(path, &wav, silence, len));
+}
+
+// Fill the library directory with `count` short WAVs, unless a previous run
+// already did, making them is most of the test time on a card
+static void make_tree(int count) {
+  char path[LIBRARY_PATH_LEN + 64];
+  struct stat st;
+  song_path(path, sizeof(path), count - 1);
+  if (stat(path, &st) == 0) {
+    return;
+  }
+
+  mkdir(LIBRARY_DIR, 0755);
+  for (int i = 0; i < count; i++) {
+    int artist = i / (ALBUMS * TRACKS);
+    if (i % TRACKS == 0) {
+      snprintf(path, sizeof(path), "%s/Artist %03d", LIBRARY_DIR, artist);
+      mkdir(path, 0755);
+      snprintf(path, sizeof(path), "%s/Artist %03d/Album %d", LIBRARY_DIR,
+               artist, i / TRACKS % ALBUMS);
+      mkdir(path, 0755);
+    }
+    song_path(path, sizeof(path), i);
+    write_song(path, SONG_MS);
+  }
+}
+
+static void remove_index(const char *dir) {
+  char path[LIBRARY_PATH_LEN + 64];
+  snprintf(path, sizeof(path), "%s/%s", dir, LIBRARY_INDEX_NAME);
+  remove(path);
+  snprintf(path, sizeof(path), "%s/%s", dir, LIBRARY_NAMES_NAME);
+  remove(path);
+}
+
+static void refresh(const char *dir, bool expect_changed) {
+  bool changed;
+  TEST_ASSERT_EQUAL(ESP_OK, library_refresh(dir, true, &changed));
+  TEST_ASSERT_EQUAL(expect_changed, changed);
+  if (changed) {
+    TEST_ASSERT_EQUAL(ESP_OK, library_commit(dir, &lib));
+  } else {
+    TEST_ASSERT_EQUAL(ESP_OK, library_open(dir, &lib));
+  }
+}
+
+// What the app does at boot up to the first sample out: open the index or
+// make one, take the first song and play it
+static int64_t boot_to_first_sample(void) {
+  char path[LIBRARY_PATH_LEN + 64];
+  const char *name;
+  bool changed;
+
+  int64_t start = esp_timer_get_time();
+  if (library_open(LIBRARY_DIR, &lib) != ESP_OK) {
+    TEST_ASSERT_EQUAL(ESP_OK, library_refresh(LIBRARY_DIR, false, &changed));
+    TEST_ASSERT_EQUAL(ESP_OK, library_commit(LIBRARY_DIR, &lib));
+  }
+  TEST_ASSERT_EQUAL(ESP_OK, library_get(&lib, 0, NULL, &name));
+  snprintf(path, sizeof(path), "%s/%s", LIBRARY_DIR, name);
+  TEST_ASSERT_EQUAL(ESP_OK, mplayer_play(path));
+  while (mplayer_get_first_sample_time() == 0) {
+    TEST_ASSERT_LESS_THAN(FIRST_SAMPLE_TIMEOUT_US,
+                          esp_timer_get_time() - start);
+    vTaskDelay(1);
+  }
+  int64_t elapsed = mplayer_get_first_sample_time() - start;
+
+  TEST_ASSERT_EQUAL(ESP_OK, mplayer_stop());
+  library_close(&lib);
+  return elapsed;
+}
+
+TEST_CASE("library index is made once and found unchanged", "[library]") {
+  bool changed;
+  make_tree(CONFIG_TEST_LIBRARY_FILES);
+  remove_index(LIBRARY_DIR);
+  TEST_ASSERT_EQUAL(ESP_ERR_NOT_FOUND, library_open(LIBRARY_DIR, &lib));
+
+  // Probing fills in the format and length of every song
+  TEST_ASSERT_EQUAL(ESP_OK, library_refresh(LIBRARY_DIR, true, &changed));
+  TEST_ASSERT_TRUE(changed);
+  TEST_ASSERT_EQUAL(ESP_OK, library_commit(LIBRARY_DIR, &lib));
+  TEST_ASSERT_EQUAL(CONFIG_TEST_LIBRARY_FILES, library_count(&lib));
+  for (uint32_t i = 0; i < library_count(&lib); i += 97) {
+    const library_entry_t *entry;
+    const char *name;
+    TEST_ASSERT_EQUAL(ESP_OK, library_get(&lib, i, &entry, &name));
+    TEST_ASSERT_EQUAL(LIBRARY_FORMAT_WAV, entry->format);
+    TEST_ASSERT_EQUAL(SONG_MS, entry->duration_ms);
+  }
+  library_close(&lib);
+
+  TEST_ASSERT_EQUAL(ESP_OK, library_refresh(LIBRARY_DIR, true, &changed));
+  TEST_ASSERT_FALSE(changed);
+  TEST_ASSERT_EQUAL(ESP_OK, library_open(LIBRARY_DIR, &lib));
+  TEST_ASSERT_EQUAL(CONFIG_TEST_LIBRARY_FILES, library_count(&lib));
+  library_close(&lib);
+}
+
+TEST_CASE("library boot to first sample", "[library][bench]") {
+  make_tree(CONFIG_TEST_LIBRARY_FILES);
+
+  // A new card, then every boot after it
+  remove_index(LIBRARY_DIR);
+  int64_t first_us = boot_to_first_sample();
+  int64_t indexed_us = boot_to_first_sample();
+
+  test_result("boot_to_first_sample",
+              "\"files\":%d,\"first_boot_us\":%lld,\"boot_us\":%lld",
+              CONFIG_TEST_LIBRARY_FILES, (long long)first_us,
+              (long long)indexed_us);
+}
+
+// Path in `dir` of a song whose name is `len` x plus ".wav"
+static void long_name(char *path, size_t size, const char *dir, int len) {
+  int n = snprintf(path, size, "%s/", dir);
+  memset(path + n, 'x', len);
+  strcpy(path + n + len, ".wav");
+}
+
+static void touch(const char *path) {
+  FILE *file = fopen(path, "wb");
+  TEST_ASSERT_NOT_NULL(file);
+  fclose(file);
+}
+
+TEST_CASE("library skips what is not a song", "[library]") {
+  char path[LIBRARY_PATH_LEN * 2];
+  char deep[LIBRARY_PATH_LEN];
+  char kept[LIBRARY_PATH_LEN];
+  char dropped[LIBRARY_PATH_LEN];
+
+  mkdir(ODD_DIR, 0755);
+  remove_index(ODD_DIR);
+  write_song(ODD_DIR "/song.wav", SONG_MS);
+  touch(ODD_DIR "/cover.jpg");
+  touch(ODD_DIR "/notes.txt");
+  write_song(ODD_DIR "/.dotted.wav", SONG_MS);
+  mkdir(ODD_DIR "/.hidden", 0755);
+  write_song(ODD_DIR "/.hidden/song.wav", SONG_MS);
+
+  // The library directory is depth 1, one song as deep as it goes and one
+  // a level deeper
+  int n = snprintf(deep, sizeof(deep), "%s", ODD_DIR);
+  for (int d = 2; d <= LIBRARY_MAX_DEPTH + 1; d++) {
+    n += snprintf(deep + n, sizeof(deep) - n, "/d%d", d);
+    mkdir(deep, 0755);
+    snprintf(path, sizeof(path), "%s/depth%d.wav", deep, d);
+    if (d == LIBRARY_MAX_DEPTH) {
+      write_song(path, SONG_MS);
+      strcpy(kept, path + strlen(ODD_DIR) + 1);
+    } else if (d == LIBRARY_MAX_DEPTH + 1) {
+      write_song(path, SONG_MS);
+      strcpy(dropped, path + strlen(ODD_DIR) + 1);
+    }
+  }
+
+  // Relative paths have to fit in LIBRARY_PATH_LEN with their NUL, the
+  // longest FAT name does but not once in a subdirectory
+  long_name(path, sizeof(path), ODD_DIR, LIBRARY_PATH_LEN - 5);
+  write_song(path, SONG_MS);
+  mkdir(ODD_DIR "/long", 0755);
+  long_name(path, sizeof(path), ODD_DIR "/long", LIBRARY_PATH_LEN - 9);
+  write_song(path, SONG_MS);
+
+  refresh(ODD_DIR, true);
+  TEST_ASSERT_EQUAL(3, library_count(&lib));
+  TEST_ASSERT_GREATER_OR_EQUAL(0, library_find(&lib, "song.wav"));
+  TEST_ASSERT_GREATER_OR_EQUAL(0, library_find(&lib, kept));
+  TEST_ASSERT_EQUAL(-1, library_find(&lib, dropped));
+  long_name(path, sizeof(path), ".", LIBRARY_PATH_LEN - 5);
+  TEST_ASSERT_GREATER_OR_EQUAL(0, library_find(&lib, path + 2));
+  TEST_ASSERT_EQUAL(-1, library_find(&lib, ".hidden/song.wav"));
+  TEST_ASSERT_EQUAL(-1, library_find(&lib, ".dotted.wav"));
+  TEST_ASSERT_EQUAL(-1, library_find(&lib, "cover.jpg"));
+  library_close(&lib);
+}
+
+TEST_CASE("library refresh picks up added, removed and changed songs",
+          "[library]") {
+  const library_entry_t *entry;
+  mkdir(CHANGES_DIR, 0755);
+  write_song(CHANGES_DIR "/a.wav", SONG_MS);
+  write_song(CHANGES_DIR "/b.wav", SONG_MS);
+  remove(CHANGES_DIR "/c.wav");
+  remove_index(CHANGES_DIR);
+  refresh(CHANGES_DIR, true);
+  TEST_ASSERT_EQUAL(2, library_count(&lib));
+  library_close(&lib);
+  refresh(CHANGES_DIR, false);
+  library_close(&lib);
+
+  // A size change is enough, FAT times only have 2 s steps
+  write_song(CHANGES_DIR "/c.wav", SONG_MS);
+  remove(CHANGES_DIR "/a.wav");
+  write_song(CHANGES_DIR "/b.wav", 3 * SONG_MS);
+  refresh(CHANGES_DIR, true);
+  TEST_ASSERT_EQUAL(2, library_count(&lib));
+  TEST_ASSERT_EQUAL(-1, library_find(&lib, "a.wav"));
+  int32_t idx = library_find(&lib, "b.wav");
+  TEST_ASSERT_GREATER_OR_EQUAL(0, idx);
+  TEST_ASSERT_EQUAL(ESP_OK, library_get(&lib, idx, &entry, NULL));
+  TEST_ASSERT_EQUAL(3 * SONG_MS, entry->duration_ms);
+  idx = library_find(&lib, "c.wav");
+  TEST_ASSERT_GREATER_OR_EQUAL(0, idx);
+  TEST_ASSERT_EQUAL(ESP_OK, library_get(&lib, idx, &entry, NULL));
+  TEST_ASSERT_EQUAL(LIBRARY_FORMAT_WAV, entry->format);
+  TEST_ASSERT_EQUAL(SONG_MS, entry->duration_ms);
+  library_close(&lib);
+}
+
+TEST_CASE("library browses a large tree in constant memory", "[library]") {
+  static uint8_t seen[CONFIG_TEST_LIBRARY_FILES];
+  const char *name;
+  make_tree(CONFIG_TEST_LIBRARY_FILES);
+  memset(seen, 0, sizeof(seen));
+  if (library_open(LIBRARY_DIR, &lib) != ESP_OK) {
+    refresh(LIBRARY_DIR, true);
+  }
+  TEST_ASSERT_EQUAL(CONFIG_TEST_LIBRARY_FILES, library_count(&lib));
+  size_t heap = test_heap_used();
+
+  // Forward over every song, each one a different file of the tree
+  int64_t start = esp_timer_get_time();
+  for (uint32_t i = 0; i < library_count(&lib); i++) {
+    int artist, album, track;
+    TEST_ASSERT_EQUAL(ESP_OK, library_get(&lib, i, NULL, &name));
+    TEST_ASSERT_EQUAL(3, sscanf(name, "Artist %d/Album %d/%d - Track.wav",
+                                &artist, &album, &track));
+    int song = (artist * ALBUMS + album) * TRACKS + track;
+    TEST_ASSERT_TRUE(song >= 0 && song < CONFIG_TEST_LIBRARY_FILES);
+    TEST_ASSERT_EQUAL(0, seen[song]);
+    seen[song] = 1;
+  }
+  int64_t next_us = esp_timer_get_time() - start;
+
+  // Back and at random, as prev and shuffle would
+  start = esp_timer_get_time();
+  for (uint32_t i = library_count(&lib); i-- > 0;) {
+    TEST_ASSERT_EQUAL(ESP_OK, library_get(&lib, i, NULL, &name));
+  }
+  int64_t prev_us = esp_timer_get_time() - start;
+  uint32_t seed = 1;
+  start = esp_timer_get_time();
+  for (int i = 0; i < RANDOM_GETS; i++) {
+    seed = seed * 1664525 + 1013904223;
+    uint32_t idx = (seed >> 8) % library_count(&lib);
+    TEST_ASSERT_EQUAL(ESP_OK, library_get(&lib, idx, NULL, &name));
+  }
+  int64_t random_us = esp_timer_get_time() - start;
+
+  // Nothing was allocated on the way
+  size_t grown = test_heap_used() - heap;
+  char path[LIBRARY_PATH_LEN + 64];
+  song_path(path, sizeof(path), CONFIG_TEST_LIBRARY_FILES - 1);
+  TEST_ASSERT_GREATER_OR_EQUAL(
+      0, library_find(&lib, path + strlen(LIBRARY_DIR) + 1));
+  library_close(&lib);
+  TEST_ASSERT_EQUAL(0, grown);
+
+  uint32_t count = CONFIG_TEST_LIBRARY_FILES;
+  test_result("library_browse",
+              "\"files\":%u,\"library_t_bytes\":%u,\"heap_grown\":%u,"
+              "\"next_us_per_song\":%lld,\"prev_us_per_song\":%lld,"
+              "\"random_us_per_song\":%lld",
+              (unsigned)count, (unsigned)sizeof(library_t), (unsigned)grown,
+              (long long)(next_us / count), (long long)(prev_us / count),
+              (long long)(random_us / RANDOM_GETS));
+}
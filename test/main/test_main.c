@@ -0,0 +1,40 @@
+#include "esp_log.h"
+#include "player.h"
+#include "unity.h"
+#if !CONFIG_IDF_TARGET_LINUX
+#include "sdcard.h"
+#endif
+#include <stdlib.h>
+#include <sys/stat.h>
+
+static const char *TAG = "TEST";
+
+void app_main(void) {
+#if !CONFIG_IDF_TARGET_LINUX
+  if (sdcard_init() != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to mount the SD card");
+    return;
+  }
+#endif
+  mkdir(CONFIG_TEST_DIR, 0755);
+
+  // Set up once for every test, the read-ahead streams come with it
+  if (mplayer_setup() != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to setup the player");
+    return;
+  }
+
+  UNITY_BEGIN();
+#if CONFIG_TEST_BENCHES
+  unity_run_all_tests();
+#else
+  unity_run_tests_by_tag("[bench]", true);
+#endif
+  int failures = UNITY_END();
+
+#if CONFIG_IDF_TARGET_LINUX
+  exit(failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+#else
+  (void)failures;
+#endif
+}
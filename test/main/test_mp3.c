@@ -0,0 +1,158 @@
+#include "decoder.h"
+#include "esp_timer.h"
+#include "readahead.h"
+#include "test_util.h"
+#include "unity.h"
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define DECODE_CHUNK 576
+#define BENCH_MHZ 160 // The ESP32 default clock
+
+// MPEG 1 layer III at 32 kHz, 32 kbps and mono makes frames of exactly 144
+// bytes without padding. All zero side info is a frame of silence
+#define MP3_RATE 32000
+#define MP3_FRAME_LEN 144
+#define MP3_FRAME_SAMPLES 1152
+#define MP3_SIDE_INFO 17
+#define MP3_FRAMES 50
+#define ID3V2_BODY 64
+#define ID3V1_LEN 128
+
+static const uint8_t frame_header[4] = {0xFF, 0xFB, 0x18, 0xC0};
+
+static void put_be32(uint8_t *p, uint32_t v) {
+  p[0] = (uint8_t)(v >> 24);
+  p[1] = (uint8_t)(v >> 16);
+  p[2] = (uint8_t)(v >> 8);
+  p[3] = (uint8_t)v;
+}
+
+// Silent frames after an ID3v2 tag and a Xing frame with their count, then
+// an ID3v1 tag. The ID3v2 tag holds a frame header of its own, played it
+// would throw the count off
+static void write_fixture(const char *path) {
+  uint8_t buf[MP3_FRAME_LEN];
+  FILE *file = fopen(path, "wb");
+  TEST_ASSERT_NOT_NULL(file);
+
+  memset(buf, 0, sizeof(buf));
+  memcpy(buf, "ID3\x03\x00\x00", 6);
+  buf[9] = ID3V2_BODY;
+  memcpy(buf + 10, frame_header, sizeof(frame_header));
+  TEST_ASSERT_EQUAL(10 + ID3V2_BODY, fwrite(buf, 1, 10 + ID3V2_BODY, file));
+
+  memset(buf, 0, sizeof(buf));
+  memcpy(buf, frame_header, sizeof(frame_header));
+  uint8_t *xing = buf + 4 + MP3_SIDE_INFO;
+  memcpy(xing, "Xing", 4);
+  put_be32(xing + 4, 0x01);
+  put_be32(xing + 8, MP3_FRAMES);
+  TEST_ASSERT_EQUAL(MP3_FRAME_LEN, fwrite(buf, 1, MP3_FRAME_LEN, file));
+
+  memset(buf, 0, sizeof(buf));
+  memcpy(buf, frame_header, sizeof(frame_header));
+  for (int i = 0; i < MP3_FRAMES; i++) {
+    TEST_ASSERT_EQUAL(MP3_FRAME_LEN, fwrite(buf, 1, MP3_FRAME_LEN, file));
+  }
+
+  memset(buf, 0, sizeof(buf));
+  memcpy(buf, "TAG", 3);
+  memcpy(buf + 3, "Fixture", 7);
+  TEST_ASSERT_EQUAL(ID3V1_LEN, fwrite(buf, 1, ID3V1_LEN, file));
+  int err = fclose(file);
+  TEST_ASSERT_EQUAL(0, err);
+}
+
+TEST_CASE("mp3 skips the tags and takes the length from the Xing frame",
+          "[mp3]") {
+  static int16_t out[DECODE_CHUNK];
+  const char *path = TEST_FILE("fixture.mp3");
+  write_fixture(path);
+
+  readahead_t *stream = readahead_open(path);
+  TEST_ASSERT_NOT_NULL(stream);
+  decoder_t dec;
+  TEST_ASSERT_EQUAL(ESP_OK, decoder_open(&dec, stream, path));
+  TEST_ASSERT_EQUAL_PTR(&decoder_mp3, dec.ops);
+  TEST_ASSERT_EQUAL(MP3_RATE, dec.format.sample_rate);
+  TEST_ASSERT_EQUAL(1, dec.format.channels);
+  TEST_ASSERT_EQUAL(MP3_FRAMES * MP3_FRAME_SAMPLES, dec.format.total_frames);
+  TEST_ASSERT_EQUAL(MP3_FRAMES * 36,
+                    (uint64_t)dec.format.total_frames * 1000 / MP3_RATE);
+
+  // The first samples come from the first silent frame, not from the
+  // header in the tag or the Xing frame
+  uint32_t frames = decoder_decode(&dec, out, DECODE_CHUNK);
+  TEST_ASSERT_EQUAL(DECODE_CHUNK, frames);
+  for (size_t i = 0; i < DECODE_CHUNK; i++) {
+    TEST_ASSERT_EQUAL(0, out[i]);
+  }
+  size_t len;
+  while ((len = decoder_decode(&dec, out, DECODE_CHUNK)) > 0) {
+    frames += len;
+  }
+  decoder_close(&dec);
+  readahead_close(stream);
+  TEST_ASSERT_EQUAL(MP3_FRAMES * MP3_FRAME_SAMPLES, frames);
+}
+
+TEST_CASE("mp3 decode speed", "[mp3][bench]") {
+  static int16_t out[DECODE_CHUNK];
+  const char *path = CONFIG_TEST_MP3_PATH;
+  struct stat st;
+  bool silent = stat(path, &st) != 0;
+  if (silent) {
+    // Silence is the cheap case, the number only compares builds
+    path = TEST_FILE("fixture.mp3");
+    write_fixture(path);
+    TEST_ASSERT_EQUAL(0, stat(path, &st));
+  }
+
+  readahead_t *stream = readahead_open(path);
+  TEST_ASSERT_NOT_NULL(stream);
+  decoder_t dec;
+  TEST_ASSERT_EQUAL(ESP_OK, decoder_open(&dec, stream, path));
+  TEST_ASSERT_EQUAL_PTR(&decoder_mp3, dec.ops);
+  TEST_ASSERT_GREATER_THAN(0, dec.format.sample_rate);
+
+  // The whole file with its card reads, as when playing it. Cycles are
+  // summed per call, the counter wraps every 18 s at 240 MHz
+  uint64_t frames = 0;
+  uint64_t cycles = 0;
+  size_t len;
+  int64_t start = esp_timer_get_time();
+  do {
+    uint32_t before = test_cycles();
+    len = decoder_decode(&dec, out, DECODE_CHUNK);
+    cycles += test_cycles() - before;
+    frames += len;
+  } while (len);
+  int64_t elapsed = esp_timer_get_time() - start;
+  decoder_format_t format = dec.format;
+  decoder_close(&dec);
+  readahead_close(stream);
+
+  // The length from the headers is an estimate without a Xing frame
+  TEST_ASSERT_GREATER_THAN(0, frames);
+  if (format.total_frames) {
+    TEST_ASSERT_UINT32_WITHIN(format.total_frames / 50 + 1152,
+                              format.total_frames, frames);
+  }
+
+  // Audio time over decode time in hundredths, as if each cycle counted
+  // was one at BENCH_MHZ, so host runs compare with the chip
+  uint64_t rtf_x100 =
+      cycles ? frames * BENCH_MHZ * 1000000 * 100 / format.sample_rate / cycles
+             : 0;
+  test_result("mp3_decode",
+              "\"silent\":%d,\"rate\":%u,\"channels\":%u,\"bytes\":%ld,"
+              "\"frames\":%llu,\"us\":%lld,\"ns_per_frame\":%lld,"
+              "\"cycles_per_frame\":%llu,\"rtf_x100_at_%dmhz\":%llu",
+              silent, (unsigned)format.sample_rate, (unsigned)format.channels,
+              (long)st.st_size, (unsigned long long)frames,
+              (long long)elapsed, (long long)(elapsed * 1000 / frames),
+              (unsigned long long)(cycles / frames), BENCH_MHZ,
+              (unsigned long long)rtf_x100);
+}
@@ -0,0 +1,136 @@
+#include "esp_timer.h"
+#include "readahead.h"
+#include "test_util.h"
+#include "unity.h"
+#if CONFIG_MPLAYER_OUTPUT_SINK_VIRTUAL
+#include "sim.h"
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+
+#define CHECK_SIZE 100000
+#define CHECK_READS 2000
+#define BENCH_SIZE (1024 * 1024)
+#define STREAM_CHUNK 256
+
+// Reads wait on the virtual clock when there is one
+#if CONFIG_MPLAYER_OUTPUT_SINK_VIRTUAL
+#define now_us() sim_now_us()
+#else
+#define now_us() esp_timer_get_time()
+#endif
+
+static uint8_t pattern(long pos) { return (uint8_t)(pos * 7 + pos / 256); }
+
+static void write_file(const char *path, size_t size) {
+  static uint8_t buf[1024];
+  FILE *file = fopen(path, "wb");
+  TEST_ASSERT_NOT_NULL(file);
+  for (size_t pos = 0; pos < size; pos += sizeof(buf)) {
+    size_t len = size - pos < sizeof(buf) ? size - pos : sizeof(buf);
+    for (size_t i = 0; i < len; i++) {
+      buf[i] = pattern(pos + i);
+    }
+    TEST_ASSERT_EQUAL(len, fwrite(buf, 1, len, file));
+  }
+  TEST_ASSERT_EQUAL(0, fclose(file));
+}
+
+TEST_CASE("readahead gives back every byte across reads and seeks",
+          "[readahead]") {
+  static uint8_t buf[3000];
+  const char *path = TEST_FILE("readahead.bin");
+  write_file(path, CHECK_SIZE);
+
+  readahead_t *ra = readahead_open(path);
+  TEST_ASSERT_NOT_NULL(ra);
+  TEST_ASSERT_EQUAL(CHECK_SIZE, readahead_size(ra));
+
+  // Reads of any size from anywhere, some cross the buffers and the end
+  long pos = 0;
+  uint32_t seed = 1;
+  for (int i = 0; i < CHECK_READS; i++) {
+    seed = seed * 1664525 + 1013904223;
+    if ((seed >> 16) % 5 == 0) {
+      pos = (long)((seed >> 8) % CHECK_SIZE);
+      TEST_ASSERT_EQUAL(ESP_OK, readahead_seek(ra, pos, SEEK_SET));
+    }
+    size_t len = (seed >> 4) % sizeof(buf);
+    size_t expected = pos + len > CHECK_SIZE ? CHECK_SIZE - pos : len;
+    TEST_ASSERT_EQUAL(expected, readahead_read(ra, buf, len));
+    for (size_t j = 0; j < expected; j++) {
+      if (buf[j] != pattern(pos + j)) {
+        TEST_FAIL_MESSAGE("Wrong byte");
+      }
+    }
+    pos += expected;
+    TEST_ASSERT_EQUAL(pos, readahead_tell(ra));
+  }
+
+  // Relative seeks and the end
+  TEST_ASSERT_EQUAL(ESP_OK, readahead_seek(ra, -10, SEEK_END));
+  TEST_ASSERT_EQUAL(10, readahead_read(ra, buf, sizeof(buf)));
+  TEST_ASSERT_EQUAL(pattern(CHECK_SIZE - 10), buf[0]);
+  TEST_ASSERT_EQUAL(0, readahead_read(ra, buf, sizeof(buf)));
+  TEST_ASSERT_EQUAL(ESP_OK, readahead_seek(ra, -CHECK_SIZE / 2, SEEK_CUR));
+  TEST_ASSERT_EQUAL(1, readahead_read(ra, buf, 1));
+  TEST_ASSERT_EQUAL(pattern(CHECK_SIZE / 2), buf[0]);
+
+  readahead_close(ra);
+}
+
+TEST_CASE("read throughput by block size", "[readahead][bench]") {
+  static const size_t sizes[] = {512, 1024, 2048, 4096, 8192, 16384, 32768};
+  const char *path = TEST_FILE("throughput.bin");
+  write_file(path, BENCH_SIZE);
+  uint8_t *buf = malloc(sizes[sizeof(sizes) / sizeof(sizes[0]) - 1]);
+  TEST_ASSERT_NOT_NULL(buf);
+
+  // Straight to the file system like the reader task, no stdio buffer
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    FILE *file = fopen(path, "rb");
+    TEST_ASSERT_NOT_NULL(file);
+    setvbuf(file, NULL, _IONBF, 0);
+    size_t total = 0;
+    size_t len;
+    int64_t start = esp_timer_get_time();
+    while ((len = fread(buf, 1, sizes[i], file)) > 0) {
+      total += len;
+    }
+    int64_t elapsed = esp_timer_get_time() - start;
+    fclose(file);
+
+    TEST_ASSERT_EQUAL(BENCH_SIZE, total);
+    test_result("read_block", "\"block\":%u,\"bytes\":%u,\"us\":%lld,"
+                              "\"kb_s\":%lld",
+                (unsigned)sizes[i], (unsigned)total, (long long)elapsed,
+                (long long)(elapsed > 0 ? (int64_t)total * 1000000 / 1024 /
+                                              elapsed
+                                        : 0));
+  }
+  free(buf);
+
+  // And through a stream in the small reads the decoders make, on the
+  // linux target in virtual time with the simulated card latency
+  static uint8_t chunk[STREAM_CHUNK];
+  readahead_t *ra = readahead_open(path);
+  TEST_ASSERT_NOT_NULL(ra);
+  size_t total = 0;
+  size_t len;
+  int64_t start = now_us();
+  while ((len = readahead_read(ra, chunk, sizeof(chunk))) > 0) {
+    total += len;
+  }
+  int64_t elapsed = now_us() - start;
+  readahead_close(ra);
+
+  TEST_ASSERT_EQUAL(BENCH_SIZE, total);
+  test_result("read_stream",
+              "\"block\":%d,\"chunk\":%d,\"bytes\":%u,\"us\":%lld,"
+              "\"kb_s\":%lld",
+              CONFIG_MPLAYER_READAHEAD_SIZE, STREAM_CHUNK, (unsigned)total,
+              (long long)elapsed,
+              (long long)(elapsed > 0 ? (int64_t)total * 1000000 / 1024 /
+                                            elapsed
+                                      : 0));
+}
@@ -0,0 +1,205 @@
+#include "esp_timer.h"
+#include "resampler.h"
+#include "test_util.h"
+#include "unity.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TONE_HZ 1000
+#define AMPLITUDE 16000
+#define IN_BLOCK 100
+#define BENCH_BLOCK 256
+
+static const char *quality_names[] = {"low", "medium", "high"};
+
+// Minimum SNR in dB of a 1 kHz tone through each quality, 16 bit rounding
+// alone keeps it under about 90
+static const float min_snr[] = {50.0f, 70.0f, 75.0f};
+
+// Minimum attenuation in dB of a tone above the output Nyquist frequency
+static const float min_rejection[] = {45.0f, 65.0f, 75.0f};
+
+// Feeds `in` in small blocks so the internal buffer wraps, then flushes
+static size_t resample_all(resampler_t *rs, const int16_t *in, size_t in_len,
+                           int16_t *out, size_t max_out) {
+  size_t written = 0;
+  size_t taken = 0;
+  while (taken < in_len) {
+    size_t frames = in_len - taken < IN_BLOCK ? in_len - taken : IN_BLOCK;
+    written += resampler_process(rs, in + taken, &frames, out + written,
+                                 max_out - written);
+    taken += frames;
+    TEST_ASSERT_LESS_THAN(max_out, written);
+  }
+  size_t flushed;
+  while ((flushed = resampler_flush(rs, out + written, max_out - written))) {
+    written += flushed;
+    TEST_ASSERT_LESS_THAN(max_out, written);
+  }
+  return written;
+}
+
+// Least squares fit of a sine of `freq` to `buf`, whatever its phase, gives
+// the power of the fit and of what is left
+static void fit_sine(const int16_t *buf, size_t len, uint32_t freq,
+                     uint32_t rate, double *signal, double *noise) {
+  double ss = 0, cc = 0, sc = 0, ys = 0, yc = 0;
+  for (size_t i = 0; i < len; i++) {
+    double phase = 2.0 * M_PI * (double)((uint64_t)i * freq % rate) / rate;
+    double s = sin(phase);
+    double c = cos(phase);
+    ss += s * s;
+    cc += c * c;
+    sc += s * c;
+    ys += buf[i] * s;
+    yc += buf[i] * c;
+  }
+  double det = ss * cc - sc * sc;
+  double a = (ys * cc - yc * sc) / det;
+  double b = (yc * ss - ys * sc) / det;
+
+  *signal = 0;
+  *noise = 0;
+  for (size_t i = 0; i < len; i++) {
+    double phase = 2.0 * M_PI * (double)((uint64_t)i * freq % rate) / rate;
+    double fit = a * sin(phase) + b * cos(phase);
+    *signal += fit * fit;
+    *noise += (buf[i] - fit) * (buf[i] - fit);
+  }
+}
+
+// Converts half a second of a tone, checks the length and returns the
+// output, the edges where the filter fills up are left out
+static int16_t *convert_tone(resampler_quality_t quality, uint32_t in_rate,
+                             uint32_t out_rate, uint32_t freq,
+                             size_t *out_len) {
+  size_t in_len = in_rate / 2;
+  size_t max_out = (size_t)((uint64_t)in_len * out_rate / in_rate) + 1024;
+  int16_t *in = malloc(in_len * sizeof(int16_t));
+  int16_t *out = malloc(max_out * sizeof(int16_t));
+  resampler_t *rs = malloc(sizeof(resampler_t));
+  TEST_ASSERT_NOT_NULL(in);
+  TEST_ASSERT_NOT_NULL(out);
+  TEST_ASSERT_NOT_NULL(rs);
+
+  test_sine(in, in_len, freq, in_rate, AMPLITUDE, 0);
+  TEST_ASSERT_EQUAL(ESP_OK, resampler_init(rs, in_rate, out_rate, quality));
+  size_t len = resample_all(rs, in, in_len, out, max_out);
+
+  // Everything comes out, the flush adds at most a wing on each side
+  size_t expected = (size_t)((uint64_t)in_len * out_rate / in_rate);
+  size_t wing = (size_t)((uint64_t)rs->wing_frames * out_rate / in_rate) + 2;
+  TEST_ASSERT_GREATER_OR_EQUAL(expected, len);
+  TEST_ASSERT_LESS_OR_EQUAL(expected + 2 * wing, len);
+
+  free(rs);
+  free(in);
+  TEST_ASSERT_GREATER_THAN(4 * wing, len);
+  memmove(out, out + 2 * wing, (len - 4 * wing) * sizeof(int16_t));
+  *out_len = len - 4 * wing;
+  return out;
+}
+
+static void check_snr(uint32_t in_rate, uint32_t out_rate) {
+  for (int q = RESAMPLER_LOW; q <= RESAMPLER_HIGH; q++) {
+    size_t len;
+    int16_t *out = convert_tone(q, in_rate, out_rate, TONE_HZ, &len);
+    double signal, noise;
+    fit_sine(out, len, TONE_HZ, out_rate, &signal, &noise);
+    free(out);
+
+    float snr = (float)(10.0 * log10(signal / noise));
+    float gain = (float)(10.0 * log10(signal / len / (AMPLITUDE *
+                                                      AMPLITUDE / 2.0)));
+    printf("%u -> %u Hz %s: SNR %.1f dB, gain %.2f dB\n", (unsigned)in_rate,
+           (unsigned)out_rate, quality_names[q], snr, gain);
+    TEST_ASSERT_GREATER_THAN_FLOAT(min_snr[q], snr);
+    TEST_ASSERT_FLOAT_WITHIN(0.5f, 0.0f, gain);
+  }
+}
+
+TEST_CASE("resampler keeps a tone clean going down", "[resampler]") {
+  check_snr(44100, 8000);
+  check_snr(11025, 8000);
+}
+
+TEST_CASE("resampler keeps a tone clean going up", "[resampler]") {
+  check_snr(8000, 22050);
+}
+
+TEST_CASE("resampler rejects tones above the output Nyquist",
+          "[resampler]") {
+  for (int q = RESAMPLER_LOW; q <= RESAMPLER_HIGH; q++) {
+    size_t len;
+    int16_t *out = convert_tone(q, 44100, 8000, 6000, &len);
+    double power = 0;
+    for (size_t i = 0; i < len; i++) {
+      power += (double)out[i] * out[i];
+    }
+    free(out);
+
+    // What aliases lands at 2 kHz, any of it counts against the filter
+    float rejection =
+        (float)(10.0 * log10((AMPLITUDE * AMPLITUDE / 2.0) * len / power));
+    printf("6 kHz at 44100 -> 8000 Hz %s: %.1f dB down\n", quality_names[q],
+           rejection);
+    TEST_ASSERT_GREATER_THAN_FLOAT(min_rejection[q], rejection);
+  }
+}
+
+TEST_CASE("resampler passes the same rate through untouched",
+          "[resampler]") {
+  static int16_t in[1000];
+  static int16_t out[1100];
+  resampler_t *rs = malloc(sizeof(resampler_t));
+  TEST_ASSERT_NOT_NULL(rs);
+  test_sine(in, 1000, TONE_HZ, 8000, AMPLITUDE, 0);
+
+  TEST_ASSERT_EQUAL(ESP_OK, resampler_init(rs, 8000, 8000, RESAMPLER_HIGH));
+  TEST_ASSERT_EQUAL(1000, resample_all(rs, in, 1000, out, 1100));
+  TEST_ASSERT_EQUAL_INT16_ARRAY(in, out, 1000);
+  free(rs);
+}
+
+TEST_CASE("resampler cycles", "[resampler][bench]") {
+  static const uint32_t in_rates[] = {44100, 22050, 11025};
+  static int16_t in[BENCH_BLOCK];
+  static int16_t out[BENCH_BLOCK * 2];
+  resampler_t *rs = malloc(sizeof(resampler_t));
+  TEST_ASSERT_NOT_NULL(rs);
+
+  for (int q = RESAMPLER_LOW; q <= RESAMPLER_HIGH; q++) {
+    for (size_t r = 0; r < sizeof(in_rates) / sizeof(in_rates[0]); r++) {
+      uint32_t in_rate = in_rates[r];
+      TEST_ASSERT_EQUAL(ESP_OK, resampler_init(rs, in_rate,
+                                               CONFIG_MPLAYER_SAMPLE_RATE, q));
+
+      // Two seconds of input, the same block again and again
+      test_sine(in, BENCH_BLOCK, TONE_HZ, in_rate, AMPLITUDE, 0);
+      size_t produced = 0;
+      int64_t start = esp_timer_get_time();
+      uint32_t cycles = test_cycles();
+      for (size_t taken = 0; taken < 2 * in_rate;) {
+        size_t frames = BENCH_BLOCK;
+        produced += resampler_process(rs, in, &frames, out,
+                                      sizeof(out) / sizeof(out[0]));
+        taken += frames;
+      }
+      cycles = test_cycles() - cycles;
+      int64_t elapsed = esp_timer_get_time() - start;
+
+      TEST_ASSERT_GREATER_THAN(0, produced);
+      test_result("resampler",
+                  "\"quality\":\"%s\",\"in_rate\":%u,\"out_rate\":%u,"
+                  "\"samples\":%u,\"us\":%lld,\"ns_per_sample\":%lld,"
+                  "\"cycles_per_sample\":%u",
+                  quality_names[q], (unsigned)in_rate,
+                  (unsigned)CONFIG_MPLAYER_SAMPLE_RATE, (unsigned)produced,
+                  (long long)elapsed, (long long)(elapsed * 1000 / produced),
+                  (unsigned)(cycles / produced));
+    }
+  }
+  free(rs);
+}
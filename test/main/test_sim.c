@@ -0,0 +1,124 @@
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "player.h"
+#include "sim.h"
+#include "test_util.h"
+#include "unity.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+#define SIM_RATE 11025
+#define SIM_FRAMES (SIM_RATE * 3)
+
+// Of the sample stream of the song below with the test app sdkconfig, rerun
+// and update it when a change to the audio path is meant to change the
+// output
+#define SIM_CHECKSUM 0xac3ad2dd
+
+static SemaphoreHandle_t done;
+static mplayer_event_type_t last_event;
+
+static void on_event(const mplayer_event_t *event, void *ctx) {
+  if (event->type == MPLAYER_EVENT_FINISHED ||
+      event->type == MPLAYER_EVENT_ERROR) {
+    last_event = event->type;
+    xSemaphoreGive(done);
+  }
+}
+
+// Two tones one after the other, enough for the resampler and the dither
+// to show any change
+static void write_song(const char *path) {
+  int16_t *pcm = malloc(SIM_FRAMES * sizeof(int16_t));
+  TEST_ASSERT_NOT_NULL(pcm);
+  test_sine(pcm, SIM_FRAMES / 2, 440, SIM_RATE, 12000, 0);
+  test_sine(pcm + SIM_FRAMES / 2, SIM_FRAMES - SIM_FRAMES / 2, 1250, SIM_RATE,
+            20000, 0);
+  test_wav_t wav = {.format_tag = 1,
+                    .channels = 1,
+                    .sample_rate = SIM_RATE,
+                    .bits_per_sample = 16,
+                    .block_align = 2};
+  TEST_ASSERT_EQUAL(ESP_OK, test_write_wav(path, &wav, pcm,
+                                           SIM_FRAMES * sizeof(int16_t)));
+  free(pcm);
+}
+
+// FNV-1a of what the sink wrote from `from` on, without the silence the
+// output plays before and after the song
+static uint32_t sink_checksum(long from, size_t *len) {
+  FILE *file = fopen(CONFIG_MPLAYER_OUTPUT_SINK_PATH, "rb");
+  TEST_ASSERT_NOT_NULL(file);
+  TEST_ASSERT_EQUAL(0, fseek(file, 0, SEEK_END));
+  long size = ftell(file) - from;
+  TEST_ASSERT_GREATER_THAN(0, size);
+  uint8_t *buf = malloc(size);
+  TEST_ASSERT_NOT_NULL(buf);
+  TEST_ASSERT_EQUAL(0, fseek(file, from, SEEK_SET));
+  TEST_ASSERT_EQUAL(size, fread(buf, 1, size, file));
+  fclose(file);
+
+  long start = 0;
+  long end = size;
+  while (start < end && buf[start] == 0x80) {
+    start++;
+  }
+  while (end > start && buf[end - 1] == 0x80) {
+    end--;
+  }
+  uint32_t hash = 2166136261u;
+  for (long i = start; i < end; i++) {
+    hash = (hash ^ buf[i]) * 16777619u;
+  }
+  free(buf);
+  *len = end - start;
+  return hash;
+}
+
+TEST_CASE("sim plays a song to the same samples without underruns",
+          "[sim]") {
+  const char *path = TEST_FILE("sim.wav");
+  write_song(path);
+
+  // Reads of 2 to 3 ms with a 200 ms one every 4, the ring has to ride
+  // them out
+  sim_storage_t storage = {
+      .latency_us = 2000, .jitter_us = 1000, .spike_every = 4,
+      .spike_us = 200000};
+  sim_set_storage(&storage);
+
+  // Only what this song adds to the sink file counts
+  struct stat st;
+  long from = stat(CONFIG_MPLAYER_OUTPUT_SINK_PATH, &st) == 0 ? st.st_size : 0;
+
+  done = xSemaphoreCreateBinary();
+  TEST_ASSERT_NOT_NULL(done);
+  mplayer_set_event_callback(on_event, NULL);
+  TEST_ASSERT_EQUAL(ESP_OK, mplayer_set_volume(80));
+  mplayer_reset_stats();
+  TEST_ASSERT_EQUAL(ESP_OK, mplayer_play(path));
+
+  // Three seconds of virtual time take a few ms of real time
+  bool finished = xSemaphoreTake(done, pdMS_TO_TICKS(10000)) == pdTRUE;
+  mplayer_set_event_callback(NULL, NULL);
+  vSemaphoreDelete(done);
+  sim_set_storage(&(sim_storage_t){
+      .latency_us = CONFIG_MPLAYER_SIM_READ_LATENCY_US,
+      .jitter_us = CONFIG_MPLAYER_SIM_READ_JITTER_US});
+  TEST_ASSERT_TRUE_MESSAGE(finished, "The song never finished");
+  TEST_ASSERT_EQUAL(MPLAYER_EVENT_FINISHED, last_event);
+
+  mplayer_stats_t stats;
+  mplayer_get_stats(&stats);
+  TEST_ASSERT_GREATER_THAN(0, stats.blocks);
+  TEST_ASSERT_EQUAL(0, stats.underruns);
+
+  size_t len;
+  uint32_t checksum = sink_checksum(from, &len);
+  test_result("sim", "\"samples\":%u,\"checksum\":\"%08x\",\"underruns\":%u,"
+                     "\"fill_min\":%u",
+              (unsigned)len, (unsigned)checksum, (unsigned)stats.underruns,
+              (unsigned)stats.fill_min);
+  TEST_ASSERT_EQUAL_HEX32(SIM_CHECKSUM, checksum);
+}
@@ -0,0 +1,115 @@
+#include "test_util.h"
+#include "sdkconfig.h"
+#if CONFIG_IDF_TARGET_LINUX
+#include <malloc.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#else
+#include "esp_cpu.h"
+#include "esp_heap_caps.h"
+#endif
+#include <math.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+void test_result(const char *name, const char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  printf("BENCH {\"bench\":\"%s\",", name);
+  vprintf(fmt, args);
+  printf("}\n");
+  va_end(args);
+}
+
+uint32_t test_cycles(void) {
+#if CONFIG_IDF_TARGET_LINUX && (defined(__x86_64__) || defined(__i386__))
+  return (uint32_t)__rdtsc();
+#elif CONFIG_IDF_TARGET_LINUX
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return (uint32_t)((uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec);
+#else
+  return esp_cpu_get_cycle_count();
+#endif
+}
+
+size_t test_heap_used(void) {
+#if CONFIG_IDF_TARGET_LINUX
+  struct mallinfo2 info = mallinfo2();
+  return info.uordblks + info.hblkhd;
+#else
+  return heap_caps_get_total_size(MALLOC_CAP_DEFAULT) -
+         heap_caps_get_free_size(MALLOC_CAP_DEFAULT);
+#endif
+}
+
+void test_sine(int16_t *buf, size_t len, uint32_t freq, uint32_t rate,
+               int16_t amplitude, size_t start) {
+  for (size_t i = 0; i < len; i++) {
+    // Phase reduced to whole periods first so floats stay precise
+    uint64_t n = (uint64_t)(start + i) * freq % rate;
+    buf[i] = (int16_t)lrintf(amplitude * sinf(2.0f * (float)M_PI * n / rate));
+  }
+}
+
+static void put_le16(uint8_t *p, uint16_t v) {
+  p[0] = (uint8_t)v;
+  p[1] = (uint8_t)(v >> 8);
+}
+
+static void put_le32(uint8_t *p, uint32_t v) {
+  put_le16(p, (uint16_t)v);
+  put_le16(p + 2, (uint16_t)(v >> 16));
+}
+
+esp_err_t test_write_wav(const char *path, const test_wav_t *wav,
+                         const void *data, size_t len) {
+  uint8_t header[64];
+  size_t fmt_size = wav->samples_per_block ? 20 : 16;
+  uint8_t *p = header + 12;
+
+  memcpy(p, "fmt ", 4);
+  put_le32(p + 4, fmt_size);
+  put_le16(p + 8, wav->format_tag);
+  put_le16(p + 10, wav->channels);
+  put_le32(p + 12, wav->sample_rate);
+  put_le32(p + 16, (uint32_t)((uint64_t)wav->sample_rate * wav->block_align /
+                              (wav->samples_per_block ? wav->samples_per_block
+                                                      : 1)));
+  put_le16(p + 20, wav->block_align);
+  put_le16(p + 22, wav->bits_per_sample);
+  if (wav->samples_per_block) {
+    put_le16(p + 24, 2);
+    put_le16(p + 26, wav->samples_per_block);
+  }
+  p += 8 + fmt_size;
+
+  if (wav->fact_frames) {
+    memcpy(p, "fact", 4);
+    put_le32(p + 4, 4);
+    put_le32(p + 8, wav->fact_frames);
+    p += 12;
+  }
+
+  memcpy(p, "data", 4);
+  put_le32(p + 4, len);
+  p += 8;
+
+  size_t header_len = p - header;
+  memcpy(header, "RIFF", 4);
+  put_le32(header + 4, header_len - 8 + len);
+  memcpy(header + 8, "WAVE", 4);
+
+  FILE *file = fopen(path, "wb");
+  if (file == NULL) {
+    return ESP_FAIL;
+  }
+  bool ok = fwrite(header, 1, header_len, file) == header_len &&
+            fwrite(data, 1, len, file) == len;
+  ok = fclose(file) == 0 && ok;
+  return ok ? ESP_OK : ESP_FAIL;
+}
@@ -0,0 +1,64 @@
+
+#ifndef __TEST_UTIL_H__
+#define __TEST_UTIL_H__
+
+/**
+ * Helpers shared by the tests
+ */
+
+#include "esp_err.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Path of a scratch file in CONFIG_TEST_DIR
+ */
+#define TEST_FILE(name) CONFIG_TEST_DIR "/" name
+
+/**
+ * What goes in the headers of a WAV written by test_write_wav
+ */
+typedef struct {
+    uint16_t format_tag;        /**< 1 for PCM, 0x11 for IMA ADPCM */
+    uint16_t channels;          /**< Interleaved channels */
+    uint32_t sample_rate;       /**< Frames per second */
+    uint16_t bits_per_sample;   /**< Bits per sample in the data */
+    uint16_t block_align;       /**< Bytes per frame, or per coded block */
+    uint16_t samples_per_block; /**< Adds the fmt extension when not 0 */
+    uint32_t fact_frames;       /**< Adds a fact chunk when not 0 */
+} test_wav_t;
+
+/**
+ * Print one bench result, a line starting with "BENCH " and a JSON object
+ * as in the benchmark app, `fmt` gives the fields after the name. Checked
+ * as a printf format, uint32_t is unsigned long on the ESP32
+ */
+void test_result(const char *name, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+/**
+ * CPU cycle counter for the benches. On the linux target it is the TSC on
+ * x86 and the thread CPU time in ns elsewhere. It wraps within seconds, sum
+ * short spans to time a long one
+ */
+uint32_t test_cycles(void);
+
+/**
+ * Heap in use, the difference around something is what it allocated
+ */
+size_t test_heap_used(void);
+
+/**
+ * Fill `buf` with a sine of `freq` Hz at `rate` and peak `amplitude`,
+ * starting at sample `start` so a long one can be written in parts
+ */
+void test_sine(int16_t *buf, size_t len, uint32_t freq, uint32_t rate,
+               int16_t amplitude, size_t start);
+
+/**
+ * Write a WAV file at `path` with `data` as its data chunk
+ */
+esp_err_t test_write_wav(const char *path, const test_wav_t *wav,
+                         const void *data, size_t len);
+
+#endif /* __TEST_UTIL_H__ */